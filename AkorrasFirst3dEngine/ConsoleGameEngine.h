@@ -1,4 +1,8 @@
 #pragma once
+
+// On Windows the engine draws into a console window through the Win32 console
+// API. Elsewhere it runs in any ANSI terminal, see ansi_terminal.h, and has no sound
+#ifdef _WIN32
 #pragma comment(lib, "winmm.lib")
 
 #ifndef UNICODE
@@ -7,6 +11,11 @@ Character Set -> Use Unicode. Thanks!
 #endif
 
 #include <windows.h>
+#else
+#include <csignal>
+#include <cerrno>
+#include "console_posix.h"
+#endif
 
 #include <iostream>
 #include <chrono>
@@ -15,6 +24,17 @@ Character Set -> Use Unicode. Thanks!
 #include <thread>
 #include <atomic>
 #include <condition_variable>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include "hiz_buffer.h"
+#include "dirty_spans.h"
+#include "simd_config.h"
+#include "ansi_terminal.h"
+#include "frame_image.h"
 
 enum COLOUR
 {
@@ -202,12 +222,10 @@ public:
 		m_nScreenWidth = 80;
 		m_nScreenHeight = 30;
 
-		m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-		m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
-
 		std::memset(m_keyNewState, 0, 256 * sizeof(short));
 		std::memset(m_keyOldState, 0, 256 * sizeof(short));
 		std::memset(m_keys, 0, 256 * sizeof(sKeyState));
+		std::memset(m_mouse, 0, 5 * sizeof(sKeyState));
 		m_mousePosX = 0;
 		m_mousePosY = 0;
 
@@ -223,12 +241,15 @@ public:
 
 	int ConstructConsole(int width, int height, int fontw, int fonth)
 	{
-		if (m_hConsole == INVALID_HANDLE_VALUE)
-			return Error(L"Bad Handle");
-
 		m_nScreenWidth = width;
 		m_nScreenHeight = height;
 
+#ifdef _WIN32
+		m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+		m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+		if (m_hConsole == INVALID_HANDLE_VALUE)
+			return Error(L"Bad Handle");
+
 		// Update 13/09/2017 - It seems that the console behaves differently on some systems
 		// and I'm unsure why this is. It could be to do with windows default settings, or
 		// screen resolutions, or system languages. Unfortunately, MSDN does not offer much
@@ -296,21 +317,63 @@ public:
 		// Set flags to allow mouse input		
 		if (!SetConsoleMode(m_hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
 			return Error(L"SetConsoleMode");
+#else
+		// The font is the terminal's business. A screen bigger than the terminal is
+		// cut to what fits
+		if (!m_terminal.Open(m_nScreenWidth, m_nScreenHeight))
+			return Error(L"Standard input and output must be a terminal");
+#endif
 
-		// Allocate memory for screen buffer
-		m_bufScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight];
-		memset(m_bufScreen, 0, sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight);
+		CreateBuffers();
 
+#ifdef _WIN32
 		SetConsoleCtrlHandler((PHANDLER_ROUTINE)CloseHandler, TRUE);
+#else
+		signal(SIGINT, CloseSignal);
+		signal(SIGTERM, CloseSignal);
+		signal(SIGHUP, CloseSignal);
+#endif
 		return 1;
 	}
 
+	// Renders into memory only, for benchmarks and image comparisons on machines
+	// without a console: no console or terminal is touched and there is no input or
+	// sound. Start() then runs nFrames frames as fast as they go, or with nFrames 0
+	// until OnUserUpdate returns false. Every frame is told fFrameTime seconds have
+	// passed so that every run draws the same frames
+	int ConstructHeadless(int width, int height, int nFrames, float fFrameTime = 1.0f / 60.0f)
+	{
+		m_nScreenWidth = width;
+		m_nScreenHeight = height;
+		m_bHeadless = true;
+		m_nHeadlessFrames = nFrames;
+		m_fHeadlessFrameTime = fFrameTime;
+		m_bEnableSound = false;
+		m_vecHeadlessFrameTimes.reserve(nFrames);
+		CreateBuffers();
+		return 1;
+	}
+
+	// Seconds each headless frame took to render, in order
+	const std::vector<double>& HeadlessFrameTimes() const { return m_vecHeadlessFrameTimes; }
+
+	// Headless frames to write out as images, numbered from 0. sPattern holds one %d
+	// for the frame number, see FormatFrameName; names ending in .png are PNG, others PPM
+	void DumpFrames(const std::vector<int>& vecFrames, const std::string& sPattern, int nScale = 1)
+	{
+		m_vecDumpFrames = vecFrames;
+		std::sort(m_vecDumpFrames.begin(), m_vecDumpFrames.end());
+		m_sDumpPattern = sPattern;
+		m_nDumpScale = nScale;
+	}
+
 	virtual void Draw(int x, int y, short c = 0x2588, short col = 0x000F)
 	{
 		if (x >= 0 && x < m_nScreenWidth && y >= 0 && y < m_nScreenHeight)
 		{
 			m_bufScreen[y * m_nScreenWidth + x].Char.UnicodeChar = c;
 			m_bufScreen[y * m_nScreenWidth + x].Attributes = col;
+			m_dirtyScreen.Mark(y, x, x);
 		}
 	}
 
@@ -318,9 +381,18 @@ public:
 	{
 		Clip(x1, y1);
 		Clip(x2, y2);
-		for (int x = x1; x < x2; x++)
-			for (int y = y1; y < y2; y++)
-				Draw(x, y, c, col);
+		if (x1 >= x2)
+			return;
+		for (int y = y1; y < y2; y++)
+		{
+			CHAR_INFO* pCell = &m_bufScreen[y * m_nScreenWidth];
+			for (int x = x1; x < x2; x++)
+			{
+				pCell[x].Char.UnicodeChar = c;
+				pCell[x].Attributes = col;
+			}
+			m_dirtyScreen.Mark(y, x1, x2 - 1);
+		}
 	}
 
 	void DrawString(int x, int y, std::wstring c, short col = 0x000F)
@@ -330,6 +402,7 @@ public:
 			m_bufScreen[y * m_nScreenWidth + x + i].Char.UnicodeChar = c[i];
 			m_bufScreen[y * m_nScreenWidth + x + i].Attributes = col;
 		}
+		m_dirtyScreen.MarkRect(x, y, x + (int)c.size() - 1, y);
 	}
 
 	void DrawStringAlpha(int x, int y, std::wstring c, short col = 0x000F)
@@ -342,6 +415,7 @@ public:
 				m_bufScreen[y * m_nScreenWidth + x + i].Attributes = col;
 			}
 		}
+		m_dirtyScreen.MarkRect(x, y, x + (int)c.size() - 1, y);
 	}
 
 	void Clip(int& x, int& y)
@@ -419,11 +493,430 @@ public:
 		DrawLine(x3, y3, x1, y1, c, col);
 	}
 
-	// https://www.avrfreaks.net/sites/default/files/triangles.c
 	void FillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, short c = 0x2588, short col = 0x000F)
+	{
+		// Spans are clamped to the screen, the corners may lie well outside it
+		ScanTriangle(x1, y1, x2, y2, x3, y3, [&](int sx, int ex, int ny)
+		{
+			if (ny < 0 || ny >= m_nScreenHeight)
+				return;
+			sx = (std::max)(sx, 0);
+			ex = (std::min)(ex, m_nScreenWidth - 1);
+			if (sx > ex)
+				return;
+			CHAR_INFO* pCell = &m_bufScreen[ny * m_nScreenWidth];
+			for (int i = sx; i <= ex; i++)
+			{
+				pCell[i].Char.UnicodeChar = c;
+				pCell[i].Attributes = col;
+			}
+			m_dirtyScreen.Mark(ny, sx, ex);
+		});
+	}
+
+	// Same coverage as FillTriangle, but every cell is depth tested against m_bufDepth
+	// before anything is written. Depth is interpolated linearly in screen space, which
+	// is exact for post-projection z. Smaller z is closer.
+	//
+	// With the HiZ pyramid enabled, triangles behind everything already drawn in their
+	// bounding box are rejected without touching a cell (returns false), and triangles
+	// in front of everything skip the per-cell compare
+	bool FillTriangleDepth(float x1, float y1, float z1, float x2, float y2, float z2, float x3, float y3, float z3, short c = 0x2588, short col = 0x000F)
+	{
+		int bx0 = (std::min)((int)x1, (std::min)((int)x2, (int)x3));
+		int by0 = (std::min)((int)y1, (std::min)((int)y2, (int)y3));
+		int bx1 = (std::max)((int)x1, (std::max)((int)x2, (int)x3));
+		int by1 = (std::max)((int)y1, (std::max)((int)y2, (int)y3));
+		float fMinZ = fminf(z1, fminf(z2, z3));
+		float fMaxZ = fmaxf(z1, fmaxf(z2, z3));
+
+		bool bNoTest = false;
+		if (m_bHiZ)
+		{
+			if (m_hizDepth.IsOccluded(bx0, by0, bx1, by1, fMinZ))
+			{
+				m_nHiZRejected++;
+				return false;
+			}
+			bNoTest = m_hizDepth.IsFullyVisible(bx0, by0, bx1, by1, fMaxZ);
+		}
+
+		// Plane z = z1 + dzdx * (x - x1) + dzdy * (y - y1)
+		float dx2 = x2 - x1, dy2 = y2 - y1, dz2 = z2 - z1;
+		float dx3 = x3 - x1, dy3 = y3 - y1, dz3 = z3 - z1;
+		float det = dx2 * dy3 - dx3 * dy2;
+		float dzdx = 0.0f, dzdy = 0.0f, z0 = z1;
+		if (det != 0.0f)
+		{
+			dzdx = (dz2 * dy3 - dz3 * dy2) / det;
+			dzdy = (dx2 * dz3 - dx3 * dz2) / det;
+		}
+		else
+			z0 = fMinZ; // Degenerate, sliver along a line
+
+		ScanTriangle((int)x1, (int)y1, (int)x2, (int)y2, (int)x3, (int)y3, [&](int sx, int ex, int ny)
+		{
+			if (ny < 0 || ny >= m_nScreenHeight)
+				return;
+			if (sx < 0) sx = 0;
+			if (ex >= m_nScreenWidth) ex = m_nScreenWidth - 1;
+			if (sx > ex)
+				return;
+
+			// The whole span counts as dirty, even where the depth test fails
+			m_dirtyScreen.Mark(ny, sx, ex);
+			CHAR_INFO* pCell = &m_bufScreen[ny * m_nScreenWidth];
+			float* pDepth = &m_bufDepth[ny * m_nScreenWidth];
+			float z = z0 + dzdx * ((float)sx - x1) + dzdy * ((float)ny - y1);
+			for (int i = sx; i <= ex; i++, z += dzdx)
+			{
+				if (bNoTest || z < pDepth[i])
+				{
+					pDepth[i] = z;
+					pCell[i].Char.UnicodeChar = c;
+					pCell[i].Attributes = col;
+				}
+			}
+		});
+
+		if (m_bHiZ)
+			m_hizDepth.Update(m_bufDepth, bx0, by0, bx1, by1);
+		return true;
+	}
+
+	void ClearDepth(float fDepth = FLT_MAX)
+	{
+		std::fill(m_bufDepth, m_bufDepth + m_nScreenWidth * m_nScreenHeight, fDepth);
+		m_hizDepth.Clear(fDepth);
+	}
+
+	// Coarse visibility query against what has been drawn so far this frame, for whole
+	// objects: true if the screen rectangle holds nothing farther than fMinZ
+	bool IsRectOccluded(int x0, int y0, int x1, int y1, float fMinZ) const
+	{
+		return m_bHiZ && m_hizDepth.IsOccluded(x0, y0, x1, y1, fMinZ);
+	}
+
+	// Only switching it on needs a rebuild, the pyramid was left behind meanwhile
+	void EnableHiZ(bool bEnable)
+	{
+		bool bRebuild = bEnable && !m_bHiZ;
+		m_bHiZ = bEnable;
+		if (bRebuild)
+			RebuildHiZ();
+	}
+
+	// Bring the HiZ pyramid up to date with depth written without it
+	void RebuildHiZ()
+	{
+		if (m_bHiZ && m_bufDepth)
+			m_hizDepth.Update(m_bufDepth, 0, 0, m_nScreenWidth - 1, m_nScreenHeight - 1);
+	}
+
+	// Triangles rejected by the HiZ test since the last call
+	int TakeHiZRejectedCount()
+	{
+		int n = m_nHiZRejected;
+		m_nHiZRejected = 0;
+		return n;
+	}
+
+	// Only cells marked dirty since the last frame are presented. The drawing functions
+	// mark what they write; anything writing m_bufScreen directly has to say so here
+	void MarkDirty(int x0, int y0, int x1, int y1)
+	{
+		m_dirtyScreen.MarkRect(x0, y0, x1, y1);
+	}
+
+	// Half-space (edge function) rasterizer, an alternative to the scanline FillTriangle.
+	// Vertices are snapped to 1/16 of a cell and a cell is covered when its centre is
+	// inside all three edges. Centres exactly on an edge belong to the triangle only if
+	// that edge is a top or left edge, so two triangles sharing an edge never both
+	// cover, or both miss, a cell along it. Cells are evaluated 4 at a time and written
+	// straight into the screen (and depth) buffer. Returns false if nothing was drawn
+	// because the triangle is degenerate, off screen or rejected by the HiZ test
+	bool FillTriangleEdge(float x1, float y1, float z1, float x2, float y2, float z2, float x3, float y3, float z3, short c = 0x2588, short col = 0x000F, bool bDepthTest = true)
+	{
+		return RasterTriangleEdge(0, 0, m_nScreenWidth - 1, m_nScreenHeight - 1, x1, y1, z1, x2, y2, z2, x3, y3, z3, c, col, bDepthTest);
+	}
+
+	// Cells past the screen edge that triangles may reach without being clipped. Every
+	// rasterizer clamps to the screen, and within this band the edge rasterizer's fixed
+	// point setup stays well inside 32 bits for screens up to 512 cells across
+	static const int RASTER_GUARD_BAND = 512;
+
+	// As FillTriangleEdge, but only cells inside the inclusive rectangle [rx0,rx1]x[ry0,ry1]
+	// are touched. The HiZ pyramid and the dirty spans cover the whole screen, so
+	// concurrent callers working on disjoint rectangles must pass bShared = false, then
+	// call RebuildHiZ and MarkDirty afterwards
+	bool RasterTriangleEdge(int rx0, int ry0, int rx1, int ry1, float x1, float y1, float z1, float x2, float y2, float z2, float x3, float y3, float z3, short c, short col, bool bDepthTest, bool bShared = true)
+	{
+		edge_setup e;
+		if (!SetupTriangleEdge(rx0, ry0, rx1, ry1, x1, y1, z1, x2, y2, z2, x3, y3, z3, e))
+			return false;
+
+		bool bHiZ = m_bHiZ && bDepthTest && bShared;
+		if (bHiZ && m_hizDepth.IsOccluded(e.bx0, e.by0, e.bx1, e.by1, e.fMinZ))
+		{
+			m_nHiZRejected++;
+			return false;
+		}
+
+		e.bDepthTest = bDepthTest && !(bHiZ && m_hizDepth.IsFullyVisible(e.bx0, e.by0, e.bx1, e.by1, e.fMaxZ));
+		e.bWriteDepth = bDepthTest;
+		e.bMarkDirty = bShared;
+		e.c = c;
+		e.col = col;
+
+#if ENGINE_SIMD_SSE
+		if (e.bFits32)
+			RasterEdgeSSE(e);
+		else
+#endif
+			RasterEdgeScalar(e);
+
+		if (bHiZ)
+			m_hizDepth.Update(m_bufDepth, e.bx0, e.by0, e.bx1, e.by1);
+		return true;
+	}
+
+protected:
+	struct edge_setup
+	{
+		int bx0, by0, bx1, by1;		// cells to visit, clipped
+		int64_t A[3], B[3];			// E(x, y) = A * x + B * y + C, in 1/16 cell units
+		int64_t E[3];				// value at the centre of cell (bx0, by0), top-left bias included
+		int xRef, yRef;				// cell depth is evaluated relative to, independent of clipping
+		float z, dzdx, dzdy;		// depth at the centre of cell (xRef, yRef) and per cell slopes
+		float fMinZ, fMaxZ;
+		bool bFits32;				// every edge value in the box fits an int32
+		bool bDepthTest, bWriteDepth;
+		bool bMarkDirty;
+		short c, col;
+	};
+
+	bool SetupTriangleEdge(int rx0, int ry0, int rx1, int ry1, float x1, float y1, float z1, float x2, float y2, float z2, float x3, float y3, float z3, edge_setup& e)
+	{
+		// 28.4 fixed point. Coordinates are limited so edge products stay well inside 64 bits,
+		// anything that far out needs clipping first anyway
+		auto fixed = [](float f)
+		{
+			const float fLimit = (float)(1 << 26) * 16.0f;
+			float v = floorf(f * 16.0f + 0.5f);
+			return (int64_t)(v != v ? 0.0f : (std::max)(-fLimit, (std::min)(fLimit, v)));
+		};
+		int64_t X[3] = { fixed(x1), fixed(x2), fixed(x3) };
+		int64_t Y[3] = { fixed(y1), fixed(y2), fixed(y3) };
+		float Z[3] = { z1, z2, z3 };
+
+		int64_t nArea = (X[1] - X[0]) * (Y[2] - Y[0]) - (Y[1] - Y[0]) * (X[2] - X[0]);
+		if (nArea == 0)
+			return false;
+		if (nArea < 0)
+		{
+			std::swap(X[1], X[2]);
+			std::swap(Y[1], Y[2]);
+			std::swap(Z[1], Z[2]);
+			nArea = -nArea;
+		}
+
+		// Cells whose centre (x * 16 + 8) can fall inside the vertex bounds
+		int64_t nMinX = (std::min)(X[0], (std::min)(X[1], X[2])), nMaxX = (std::max)(X[0], (std::max)(X[1], X[2]));
+		int64_t nMinY = (std::min)(Y[0], (std::min)(Y[1], Y[2])), nMaxY = (std::max)(Y[0], (std::max)(Y[1], Y[2]));
+		int64_t bx0 = (std::max)((int64_t)rx0, (nMinX - 8 + 15) >> 4);
+		int64_t by0 = (std::max)((int64_t)ry0, (nMinY - 8 + 15) >> 4);
+		int64_t bx1 = (std::min)((int64_t)rx1, (nMaxX - 8) >> 4);
+		int64_t by1 = (std::min)((int64_t)ry1, (nMaxY - 8) >> 4);
+		if (bx0 > bx1 || by0 > by1)
+			return false;
+		e.bx0 = (int)bx0; e.by0 = (int)by0;
+		e.bx1 = (int)bx1; e.by1 = (int)by1;
+
+		int64_t px = (int64_t)e.bx0 * 16 + 8;
+		int64_t py = (int64_t)e.by0 * 16 + 8;
+		int64_t nMaxAbs = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			int j = (i + 1) % 3;
+			e.A[i] = Y[i] - Y[j];
+			e.B[i] = X[j] - X[i];
+			bool bTopLeft = e.A[i] > 0 || (e.A[i] == 0 && e.B[i] > 0);
+			e.E[i] = e.A[i] * (px - X[i]) + e.B[i] * (py - Y[i]) + (bTopLeft ? 0 : -1);
+
+			// Bound the edge value over the whole box from its corners
+			int64_t w = (int64_t)(e.bx1 - e.bx0) * 16, h = (int64_t)(e.by1 - e.by0) * 16;
+			int64_t corners[4] = { e.E[i], e.E[i] + e.A[i] * w, e.E[i] + e.B[i] * h, e.E[i] + e.A[i] * w + e.B[i] * h };
+			for (int64_t v : corners)
+				nMaxAbs = (std::max)(nMaxAbs, v < 0 ? -v : v);
+		}
+		// Leave room for the 4 cell step of the last SIMD group
+		e.bFits32 = nMaxAbs + 4 * 16 * (std::max)((std::max)(std::abs(e.A[0]), std::abs(e.A[1])), std::abs(e.A[2])) < INT32_MAX;
+
+		// Depth plane through the snapped vertices, per cell
+		float fx1 = (float)(X[1] - X[0]), fy1 = (float)(Y[1] - Y[0]);
+		float fx2 = (float)(X[2] - X[0]), fy2 = (float)(Y[2] - Y[0]);
+		float fz1 = Z[1] - Z[0], fz2 = Z[2] - Z[0];
+		float fDet = (float)nArea;
+		e.dzdx = (fz1 * fy2 - fz2 * fy1) / fDet * 16.0f;
+		e.dzdy = (fx1 * fz2 - fx2 * fz1) / fDet * 16.0f;
+		// Depth is never stepped from the clipped box: the same cell must get the same
+		// bits whichever rectangle it was rasterized through
+		e.xRef = (int)((nMinX - 8 + 15) >> 4);
+		e.yRef = (int)((nMinY - 8 + 15) >> 4);
+		e.z = Z[0] + e.dzdx * (float)((int64_t)e.xRef * 16 + 8 - X[0]) / 16.0f + e.dzdy * (float)((int64_t)e.yRef * 16 + 8 - Y[0]) / 16.0f;
+		e.fMinZ = fminf(Z[0], fminf(Z[1], Z[2]));
+		e.fMaxZ = fmaxf(Z[0], fmaxf(Z[1], Z[2]));
+		return true;
+	}
+
+	void RasterEdgeScalar(const edge_setup& e)
+	{
+		int64_t E0 = e.E[0], E1 = e.E[1], E2 = e.E[2];
+		const int64_t A0 = e.A[0] * 16, A1 = e.A[1] * 16, A2 = e.A[2] * 16;
+		const int64_t B0 = e.B[0] * 16, B1 = e.B[1] * 16, B2 = e.B[2] * 16;
+
+		for (int y = e.by0; y <= e.by1; y++, E0 += B0, E1 += B1, E2 += B2)
+		{
+			CHAR_INFO* pCell = &m_bufScreen[y * m_nScreenWidth];
+			float* pDepth = &m_bufDepth[y * m_nScreenWidth];
+			int64_t w0 = E0, w1 = E1, w2 = E2;
+			float zRow = e.z + e.dzdy * (float)(y - e.yRef);
+			int nFirst = e.bx1 + 1, nLast = -1;
+			for (int x = e.bx0; x <= e.bx1; x++, w0 += A0, w1 += A1, w2 += A2)
+			{
+				if ((w0 | w1 | w2) < 0)
+					continue;
+				float z = zRow + e.dzdx * (float)(x - e.xRef);
+				if (e.bDepthTest && !(z < pDepth[x]))
+					continue;
+				if (e.bWriteDepth)
+					pDepth[x] = z;
+				pCell[x].Char.UnicodeChar = e.c;
+				pCell[x].Attributes = e.col;
+				if (x < nFirst) nFirst = x;
+				nLast = x;
+			}
+			if (e.bMarkDirty && nFirst <= nLast)
+				m_dirtyScreen.Mark(y, nFirst, nLast);
+		}
+	}
+
+#if ENGINE_SIMD_SSE
+	void RasterEdgeSSE(const edge_setup& e)
+	{
+		const int32_t A0 = (int32_t)e.A[0] * 16, A1 = (int32_t)e.A[1] * 16, A2 = (int32_t)e.A[2] * 16;
+		const int32_t B0 = (int32_t)e.B[0] * 16, B1 = (int32_t)e.B[1] * 16, B2 = (int32_t)e.B[2] * 16;
+
+		// Per lane offsets for 4 neighbouring cells, and the step to the next group of 4
+		const __m128i vA0 = _mm_setr_epi32(0, A0, 2 * A0, 3 * A0);
+		const __m128i vA1 = _mm_setr_epi32(0, A1, 2 * A1, 3 * A1);
+		const __m128i vA2 = _mm_setr_epi32(0, A2, 2 * A2, 3 * A2);
+		const __m128i vLane = _mm_setr_epi32(0, 1, 2, 3);
+		const __m128 vDzDx = _mm_set1_ps(e.dzdx);
+		const __m128i vMinusOne = _mm_set1_epi32(-1);
+
+		// CHAR_INFO is a 16 bit glyph and 16 bit attribute on Windows, 4 cells fit a register
+		const bool bPackedCells = sizeof(CHAR_INFO) == 4;
+		CHAR_INFO ci;
+		ci.Char.UnicodeChar = e.c;
+		ci.Attributes = e.col;
+		uint32_t nPacked = 0;
+		std::memcpy(&nPacked, &ci, (std::min)(sizeof(ci), sizeof(nPacked)));
+		const __m128i vCell = _mm_set1_epi32((int)nPacked);
+
+		int32_t E0 = (int32_t)e.E[0], E1 = (int32_t)e.E[1], E2 = (int32_t)e.E[2];
+
+		for (int y = e.by0; y <= e.by1; y++)
+		{
+			// Stepped on entry, not after the row: bFits32 only covers rows inside the box,
+			// and the step past the last one could overflow
+			if (y > e.by0)
+			{
+				E0 += B0; E1 += B1; E2 += B2;
+			}
+
+			CHAR_INFO* pCell = &m_bufScreen[y * m_nScreenWidth];
+			float* pDepth = &m_bufDepth[y * m_nScreenWidth];
+			int32_t w0 = E0, w1 = E1, w2 = E2;
+			float zRow = e.z + e.dzdy * (float)(y - e.yRef);
+			const __m128 vZRow = _mm_set1_ps(zRow);
+			int x = e.bx0;
+			int nFirst = e.bx1 + 1, nLast = -1;	// written cells, to the nearest group of 4
+
+			for (; x + 3 <= e.bx1; x += 4, w0 += 4 * A0, w1 += 4 * A1, w2 += 4 * A2)
+			{
+				__m128i v0 = _mm_add_epi32(_mm_set1_epi32(w0), vA0);
+				__m128i v1 = _mm_add_epi32(_mm_set1_epi32(w1), vA1);
+				__m128i v2 = _mm_add_epi32(_mm_set1_epi32(w2), vA2);
+				__m128i vInside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(v0, v1), v2), vMinusOne);
+				if (_mm_movemask_epi8(vInside) == 0)
+					continue;
+
+				__m128 vX = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x - e.xRef), vLane));
+				__m128 vDepth = _mm_add_ps(vZRow, _mm_mul_ps(vDzDx, vX));
+				__m128 vOld = _mm_loadu_ps(pDepth + x);
+				__m128 vMask = _mm_castsi128_ps(vInside);
+				if (e.bDepthTest)
+					vMask = _mm_and_ps(vMask, _mm_cmplt_ps(vDepth, vOld));
+
+				int nMask = _mm_movemask_ps(vMask);
+				if (nMask == 0)
+					continue;
+				if (x < nFirst) nFirst = x;
+				nLast = x + 3;
+
+				if (e.bWriteDepth)
+					_mm_storeu_ps(pDepth + x, _mm_or_ps(_mm_and_ps(vMask, vDepth), _mm_andnot_ps(vMask, vOld)));
+
+				if (bPackedCells)
+				{
+					__m128i vM = _mm_castps_si128(vMask);
+					__m128i vOldCells = _mm_loadu_si128((const __m128i*)(pCell + x));
+					_mm_storeu_si128((__m128i*)(pCell + x), _mm_or_si128(_mm_and_si128(vM, vCell), _mm_andnot_si128(vM, vOldCells)));
+				}
+				else
+				{
+					for (int i = 0; i < 4; i++)
+					{
+						if (nMask & (1 << i))
+						{
+							pCell[x + i].Char.UnicodeChar = e.c;
+							pCell[x + i].Attributes = e.col;
+						}
+					}
+				}
+			}
+
+			// Remaining 0-3 cells of the row
+			for (; x <= e.bx1; x++, w0 += A0, w1 += A1, w2 += A2)
+			{
+				if ((w0 | w1 | w2) < 0)
+					continue;
+				float z = zRow + e.dzdx * (float)(x - e.xRef);
+				if (e.bDepthTest && !(z < pDepth[x]))
+					continue;
+				if (e.bWriteDepth)
+					pDepth[x] = z;
+				pCell[x].Char.UnicodeChar = e.c;
+				pCell[x].Attributes = e.col;
+				if (x < nFirst) nFirst = x;
+				nLast = x;
+			}
+			if (e.bMarkDirty && nFirst <= nLast)
+				m_dirtyScreen.Mark(y, nFirst, nLast);
+		}
+	}
+#endif
+
+public:
+
+	// https://www.avrfreaks.net/sites/default/files/triangles.c
+	// Walks the triangle's rows, calling drawline(minx, maxx, y) with an inclusive,
+	// unclipped span for each
+	template<typename SpanFn>
+	void ScanTriangle(int x1, int y1, int x2, int y2, int x3, int y3, SpanFn&& drawline)
 	{
 		auto SWAP = [](int& x, int& y) { int t = x; x = y; y = t; };
-		auto drawline = [&](int sx, int ex, int ny) { for (int i = sx; i <= ex; i++) Draw(i, ny, c, col); };
 
 		int t1x, t2x, y, minx, maxx, t1xp, t2xp;
 		bool changed1 = false;
@@ -677,8 +1170,14 @@ public:
 
 	~ConsoleGameEngine()
 	{
-		SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+#ifdef _WIN32
+		if (!m_bHeadless)
+			SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+#else
+		m_terminal.Close();
+#endif
 		delete[] m_bufScreen;
+		delete[] m_bufDepth;
 	}
 
 public:
@@ -703,6 +1202,150 @@ public:
 	}
 
 private:
+	// Screen buffer, depth buffer and what is derived from them
+	void CreateBuffers()
+	{
+		m_bufScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight];
+		memset(m_bufScreen, 0, sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight);
+		m_dirtyScreen.Create(m_nScreenWidth, m_nScreenHeight);
+
+		// And a depth value for every cell
+		m_bufDepth = new float[m_nScreenWidth * m_nScreenHeight];
+		m_hizDepth.Create(m_nScreenWidth, m_nScreenHeight);
+		ClearDepth();
+	}
+
+	// Writes the frame out if it was asked for and stops after the last one
+	void PresentHeadless()
+	{
+		if (std::binary_search(m_vecDumpFrames.begin(), m_vecDumpFrames.end(), m_nHeadlessFrame))
+		{
+			std::string sFilename;
+			if (!FormatFrameName(m_sDumpPattern, m_nHeadlessFrame, sFilename))
+				fprintf(stderr, "Frame name pattern %s needs exactly one %%d\n", m_sDumpPattern.c_str());
+			else if (!WriteScreenImage(sFilename, m_bufScreen, m_nScreenWidth, m_nScreenHeight, m_nDumpScale))
+				fprintf(stderr, "Could not write %s\n", sFilename.c_str());
+		}
+		m_dirtyScreen.Clear();
+
+		if (++m_nHeadlessFrame == m_nHeadlessFrames)
+			m_bAtomActive = false;
+	}
+
+	// Key and mouse states for this frame
+	void UpdateInput()
+	{
+#ifndef _WIN32
+		m_terminal.PollInput();
+#endif
+		for (int i = 0; i < 256; i++)
+		{
+#ifdef _WIN32
+			m_keyNewState[i] = GetAsyncKeyState(i);
+#else
+			m_keyNewState[i] = m_terminal.KeyHeld(i) ? (short)0x8000 : 0;
+#endif
+
+			m_keys[i].bPressed = false;
+			m_keys[i].bReleased = false;
+
+			if (m_keyNewState[i] != m_keyOldState[i])
+			{
+				if (m_keyNewState[i] & 0x8000)
+				{
+					m_keys[i].bPressed = !m_keys[i].bHeld;
+					m_keys[i].bHeld = true;
+				}
+				else
+				{
+					m_keys[i].bReleased = true;
+					m_keys[i].bHeld = false;
+				}
+			}
+
+			m_keyOldState[i] = m_keyNewState[i];
+		}
+
+		// Handle Mouse Input - Check for window events
+#ifdef _WIN32
+		INPUT_RECORD inBuf[32];
+		DWORD events = 0;
+		GetNumberOfConsoleInputEvents(m_hConsoleIn, &events);
+		if (events > 0)
+			ReadConsoleInput(m_hConsoleIn, inBuf, events, &events);
+
+		// Handle events - we only care about mouse clicks and movement
+		// for now
+		for (DWORD i = 0; i < events; i++)
+		{
+			switch (inBuf[i].EventType)
+			{
+			case FOCUS_EVENT:
+			{
+				m_bConsoleInFocus = inBuf[i].Event.FocusEvent.bSetFocus;
+			}
+			break;
+
+			case MOUSE_EVENT:
+			{
+				switch (inBuf[i].Event.MouseEvent.dwEventFlags)
+				{
+				case MOUSE_MOVED:
+				{
+					m_mousePosX = inBuf[i].Event.MouseEvent.dwMousePosition.X;
+					m_mousePosY = inBuf[i].Event.MouseEvent.dwMousePosition.Y;
+				}
+				break;
+
+				case 0:
+				{
+					for (int m = 0; m < 5; m++)
+						m_mouseNewState[m] = (inBuf[i].Event.MouseEvent.dwButtonState & (1 << m)) > 0;
+
+				}
+				break;
+
+				default:
+					break;
+				}
+			}
+			break;
+
+			default:
+				break;
+				// We don't care just at the moment
+			}
+		}
+#else
+		m_mousePosX = m_terminal.MouseX();
+		m_mousePosY = m_terminal.MouseY();
+		for (int m = 0; m < 5; m++)
+			m_mouseNewState[m] = m_terminal.MouseButton(m);
+#endif
+
+		for (int m = 0; m < 5; m++)
+		{
+			m_mouse[m].bPressed = false;
+			m_mouse[m].bReleased = false;
+
+			if (m_mouseNewState[m] != m_mouseOldState[m])
+			{
+				if (m_mouseNewState[m])
+				{
+					m_mouse[m].bPressed = true;
+					m_mouse[m].bHeld = true;
+				}
+				else
+				{
+					m_mouse[m].bReleased = true;
+					m_mouse[m].bHeld = false;
+				}
+			}
+
+			m_mouseOldState[m] = m_mouseNewState[m];
+		}
+	}
+
 	void GameThread()
 	{
 		// Create user resources as part of this thread
@@ -731,115 +1374,43 @@ private:
 				tp2 = std::chrono::system_clock::now();
 				std::chrono::duration<float> elapsedTime = tp2 - tp1;
 				tp1 = tp2;
-				float fElapsedTime = elapsedTime.count();
-
-				// Handle Keyboard Input
-				for (int i = 0; i < 256; i++)
-				{
-					m_keyNewState[i] = GetAsyncKeyState(i);
-
-					m_keys[i].bPressed = false;
-					m_keys[i].bReleased = false;
-
-					if (m_keyNewState[i] != m_keyOldState[i])
-					{
-						if (m_keyNewState[i] & 0x8000)
-						{
-							m_keys[i].bPressed = !m_keys[i].bHeld;
-							m_keys[i].bHeld = true;
-						}
-						else
-						{
-							m_keys[i].bReleased = true;
-							m_keys[i].bHeld = false;
-						}
-					}
-
-					m_keyOldState[i] = m_keyNewState[i];
-				}
-
-				// Handle Mouse Input - Check for window events
-				INPUT_RECORD inBuf[32];
-				DWORD events = 0;
-				GetNumberOfConsoleInputEvents(m_hConsoleIn, &events);
-				if (events > 0)
-					ReadConsoleInput(m_hConsoleIn, inBuf, events, &events);
-
-				// Handle events - we only care about mouse clicks and movement
-				// for now
-				for (DWORD i = 0; i < events; i++)
-				{
-					switch (inBuf[i].EventType)
-					{
-					case FOCUS_EVENT:
-					{
-						m_bConsoleInFocus = inBuf[i].Event.FocusEvent.bSetFocus;
-					}
-					break;
-
-					case MOUSE_EVENT:
-					{
-						switch (inBuf[i].Event.MouseEvent.dwEventFlags)
-						{
-						case MOUSE_MOVED:
-						{
-							m_mousePosX = inBuf[i].Event.MouseEvent.dwMousePosition.X;
-							m_mousePosY = inBuf[i].Event.MouseEvent.dwMousePosition.Y;
-						}
-						break;
-
-						case 0:
-						{
-							for (int m = 0; m < 5; m++)
-								m_mouseNewState[m] = (inBuf[i].Event.MouseEvent.dwButtonState & (1 << m)) > 0;
-
-						}
-						break;
-
-						default:
-							break;
-						}
-					}
-					break;
-
-					default:
-						break;
-						// We don't care just at the moment
-					}
-				}
-
-				for (int m = 0; m < 5; m++)
-				{
-					m_mouse[m].bPressed = false;
-					m_mouse[m].bReleased = false;
-
-					if (m_mouseNewState[m] != m_mouseOldState[m])
-					{
-						if (m_mouseNewState[m])
-						{
-							m_mouse[m].bPressed = true;
-							m_mouse[m].bHeld = true;
-						}
-						else
-						{
-							m_mouse[m].bReleased = true;
-							m_mouse[m].bHeld = false;
-						}
-					}
-
-					m_mouseOldState[m] = m_mouseNewState[m];
-				}
+				float fElapsedTime = m_bHeadless ? m_fHeadlessFrameTime : elapsedTime.count();
 
+				// Handle Keyboard and Mouse Input, a headless run has none
+				if (!m_bHeadless)
+					UpdateInput();
 
 				// Handle Frame Update
 				if (!OnUserUpdate(fElapsedTime))
 					m_bAtomActive = false;
 
+				if (m_bHeadless)
+				{
+					// Image writing is left out of the frame time
+					std::chrono::duration<double> durFrame = std::chrono::system_clock::now() - tp1;
+					m_durHeadlessRender += durFrame;
+					m_vecHeadlessFrameTimes.push_back(durFrame.count());
+					PresentHeadless();
+					tp1 = std::chrono::system_clock::now();
+					continue;
+				}
+
 				// Update Title & Present Screen Buffer
 				wchar_t s[256];
-				swprintf_s(s, 256, L"Akorra - Console Game Engine - %s - FPS: %3.2f", m_sAppName.c_str(), 1.0f / fElapsedTime);
+#ifdef _WIN32
+				swprintf_s(s, 256, L"Akorra - Console Game Engine - %ls - FPS: %3.2f%ls", m_sAppName.c_str(), 1.0f / fElapsedTime, m_sAppStats);
 				SetConsoleTitle(s);
-				WriteConsoleOutput(m_hConsole, m_bufScreen, { (short)m_nScreenWidth, (short)m_nScreenHeight }, { 0,0 }, &m_rectWindow);
+				m_dirtyScreen.ForEachRect([&](int x0, int y0, int x1, int y1)
+				{
+					SMALL_RECT rectWrite = { (short)x0, (short)y0, (short)x1, (short)y1 };
+					WriteConsoleOutput(m_hConsole, m_bufScreen, { (short)m_nScreenWidth, (short)m_nScreenHeight }, { (short)x0, (short)y0 }, &rectWrite);
+				});
+#else
+				swprintf_s(s, 256, L"Akorra - Console Game Engine - %ls - FPS: %3.2f - %zu B/frame%ls", m_sAppName.c_str(), 1.0f / fElapsedTime, m_terminal.LastFrameBytes(), m_sAppStats);
+				m_terminal.SetTitle(s);
+				m_terminal.Present(m_bufScreen, &m_dirtyScreen);
+#endif
+				m_dirtyScreen.Clear();
 			}
 
 			if (m_bEnableSound)
@@ -847,12 +1418,23 @@ private:
 				// Close and Clean up audio system
 			}
 
+			if (m_bHeadless)
+				printf("%d frames in %.3f s, %.1f fps\n", m_nHeadlessFrame, m_durHeadlessRender.count(), m_nHeadlessFrame / m_durHeadlessRender.count());
+
 			// Allow the user to free resources if they have overrided the destroy function
 			if (OnUserDestroy())
 			{
 				// User has permitted destroy, so exit and clean up
 				delete[] m_bufScreen;
-				SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+				delete[] m_bufDepth;
+				m_bufScreen = nullptr;
+				m_bufDepth = nullptr;
+#ifdef _WIN32
+				if (!m_bHeadless)
+					SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+#else
+				m_terminal.Close();
+#endif
 				m_cvGameFinished.notify_one();
 			}
 			else
@@ -1017,6 +1599,11 @@ protected: // Audio Engine =====================================================
 		m_nBlockFree = m_nBlockCount;
 		m_nBlockCurrent = 0;
 		m_pBlockMemory = nullptr;
+
+#ifndef _WIN32
+		// No sound device outside Windows
+		return DestroyAudio();
+#else
 		m_pWaveHeaders = nullptr;
 
 		// Device is available
@@ -1058,6 +1645,7 @@ protected: // Audio Engine =====================================================
 		std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
 		m_cvBlockNotZero.notify_one();
 		return true;
+#endif
 	}
 
 	// Stop and clean up audio system
@@ -1067,6 +1655,7 @@ protected: // Audio Engine =====================================================
 		return false;
 	}
 
+#ifdef _WIN32
 	// Handler for soundcard request for more data
 	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
 	{
@@ -1144,6 +1733,11 @@ protected: // Audio Engine =====================================================
 			m_nBlockCurrent %= m_nBlockCount;
 		}
 	}
+#else
+	void AudioThread()
+	{
+	}
+#endif
 
 	// Overridden by user if they want to generate sound in real-time
 	virtual float onUserSoundSample(int nChannel, float fGlobalTime, float fTimeStep)
@@ -1208,15 +1802,17 @@ protected: // Audio Engine =====================================================
 	unsigned int m_nBlockCurrent;
 
 	short* m_pBlockMemory = nullptr;
+#ifdef _WIN32
 	WAVEHDR* m_pWaveHeaders = nullptr;
 	HWAVEOUT m_hwDevice = nullptr;
+#endif
 
 	std::thread m_AudioThread;
-	std::atomic<bool> m_bAudioThreadActive = false;
-	std::atomic<unsigned int> m_nBlockFree = 0;
+	std::atomic<bool> m_bAudioThreadActive{ false };
+	std::atomic<unsigned int> m_nBlockFree{ 0 };
 	std::condition_variable m_cvBlockNotZero;
 	std::mutex m_muxBlockNotZero;
-	std::atomic<float> m_fGlobalTime = 0.0f;
+	std::atomic<float> m_fGlobalTime{ 0.0f };
 
 
 
@@ -1244,13 +1840,22 @@ public:
 protected:
 	int Error(const wchar_t* msg)
 	{
+#ifdef _WIN32
 		wchar_t buf[256];
 		FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, 256, NULL);
-		SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+		if (!m_bHeadless)
+			SetConsoleActiveScreenBuffer(m_hOriginalConsole);
 		wprintf(L"ERROR: %s\n\t%s\n", msg, buf);
+#else
+		int nError = errno;
+		m_terminal.Close();
+		fprintf(stderr, "ERROR: %ls\n\t%s\n", msg, strerror(nError));
+#endif
 		return 0;
 	}
 
+#ifdef _WIN32
+
 	static BOOL CloseHandler(DWORD evt)
 	{
 		// Note this gets called in a seperate OS thread, so it must
@@ -1266,17 +1871,35 @@ protected:
 		}
 		return true;
 	}
+#else
+	// Ctrl+C and closing the terminal end the game loop, which then puts the
+	// terminal back the way it was
+	static void CloseSignal(int)
+	{
+		m_bAtomActive = false;
+	}
+#endif
 
 protected:
 	int m_nScreenWidth;
 	int m_nScreenHeight;
-	CHAR_INFO* m_bufScreen;
+	CHAR_INFO* m_bufScreen = nullptr;
+	float* m_bufDepth = nullptr;
+	hiz_buffer m_hizDepth;
+	dirty_spans m_dirtyScreen;
+	bool m_bHiZ = true;
+	int m_nHiZRejected = 0;
 	std::wstring m_sAppName;
+	wchar_t m_sAppStats[128] = { 0 };	// per frame text after the FPS, a fixed buffer so it can be written without allocating
+#ifdef _WIN32
 	HANDLE m_hOriginalConsole;
 	CONSOLE_SCREEN_BUFFER_INFO m_OriginalConsoleInfo;
 	HANDLE m_hConsole;
 	HANDLE m_hConsoleIn;
 	SMALL_RECT m_rectWindow;
+#else
+	ansi_terminal m_terminal;
+#endif
 	short m_keyOldState[256] = { 0 };
 	short m_keyNewState[256] = { 0 };
 	bool m_mouseOldState[5] = { 0 };
@@ -1284,6 +1907,17 @@ protected:
 	bool m_bConsoleInFocus = true;
 	bool m_bEnableSound = false;
 
+	// Headless runs, see ConstructHeadless
+	bool m_bHeadless = false;
+	int m_nHeadlessFrames = 0;
+	int m_nHeadlessFrame = 0;
+	float m_fHeadlessFrameTime = 0.0f;
+	std::chrono::duration<double> m_durHeadlessRender{ 0.0 };
+	std::vector<double> m_vecHeadlessFrameTimes;
+	std::vector<int> m_vecDumpFrames;
+	std::string m_sDumpPattern;
+	int m_nDumpScale = 1;
+
 	// These need to be static because of the OnDestroy call the OS may make. The OS
 	// spawns a special thread just for that
 	static std::atomic<bool> m_bAtomActive;
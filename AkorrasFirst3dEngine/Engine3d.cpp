@@ -5,6 +5,8 @@ std::atomic<bool> ConsoleGameEngine::m_bAtomActive(false);
 std::condition_variable ConsoleGameEngine::m_cvGameFinished;
 std::mutex ConsoleGameEngine::m_muxGame;
 
+static const float PI = 3.14159f;
+
 Engine3D::Engine3D()
 {
 	m_sAppName = L"3D Demo";
@@ -12,6 +14,108 @@ Engine3D::Engine3D()
 
 }
 
+void Engine3D::EnableBenchmark(const std::string& sPathFile, int nWarmup)
+{
+	bBenchmark = true;
+	sBenchmarkPath = sPathFile;
+	nBenchmarkWarmup = (std::max)(nWarmup, 0);
+}
+
+void Engine3D::EnableSceneGrid(int nSize)
+{
+	nSceneGrid = (std::max)(nSize, 1);
+}
+
+void Engine3D::BuildBenchmarkPath(camera_path& path)
+{
+	// In grid units: columns stand at whole multiples of the spacing, so x = 0.5 runs
+	// between two of them, and z = 4.5 between two rows
+	float s = 3.0f * (std::max)(meshCube.fSphereRadius, 1.0f);
+	auto grid = [&](float x, float y, float z) { return vec3d(x * s, y * s, 5.0f + z * s); };
+	path.Add(0.0f, grid(0.5f, 0.0f, -2.0f), 0.0f);
+	path.Add(4.0f, grid(0.5f, 0.0f, 4.5f), 0.0f);
+	path.Add(6.0f, grid(0.5f, 0.0f, 4.5f), 0.5f * PI);
+	path.Add(8.0f, grid(0.5f, 0.0f, 4.5f), PI);
+	path.Add(10.0f, grid(0.5f, 2.0f, 4.5f), PI);
+	path.Add(14.0f, grid(0.5f, 2.0f, -2.0f), 2.0f * PI);
+}
+
+// A JSON string literal, quotes included. Paths are the only free text in the report
+// and Windows ones are full of backslashes
+static void WriteJsonString(FILE* f, const std::string& s)
+{
+	fputc('"', f);
+	for (unsigned char c : s)
+	{
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+bool Engine3D::WriteBenchmarkReport(const std::string& sFilename)
+{
+	// Nothing ran without a path
+	if (pathBenchmark.Empty())
+		return false;
+
+	const std::vector<double>& vecTimes = HeadlessFrameTimes();
+	size_t nFrames = (std::min)(vecTimes.size(), vecBenchmarkSubmitted.size());
+	size_t nFirst = (std::min)((size_t)nBenchmarkWarmup, nFrames);
+	std::vector<double> vecMeasured;
+	uint64_t nSubmitted = 0, nRasterized = 0;
+	for (size_t i = nFirst; i < nFrames; i++)
+	{
+		vecMeasured.push_back(vecTimes[i] * 1000.0);
+		nSubmitted += vecBenchmarkSubmitted[i];
+		nRasterized += vecBenchmarkRasterized[i];
+	}
+	timing_stats stats = timing_stats::FromSamples(vecMeasured);
+	double fSeconds = stats.fTotal / 1000.0;
+
+	FILE* f = nullptr;
+#ifdef _MSC_VER
+	if (fopen_s(&f, sFilename.c_str(), "w") != 0)
+		return false;
+#else
+	f = std::fopen(sFilename.c_str(), "w");
+#endif
+	if (f == nullptr)
+		return false;
+
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"path\": ");
+	WriteJsonString(f, sBenchmarkPath.empty() ? "built in" : sBenchmarkPath);
+	fprintf(f, ",\n");
+	fprintf(f, "\t\"path_seconds\": %.3f,\n", pathBenchmark.Duration());
+	fprintf(f, "\t\"frame_step_ms\": %.4f,\n", m_fHeadlessFrameTime * 1000.0f);
+	fprintf(f, "\t\"screen\": [%d, %d],\n", ScreenWidth(), ScreenHeight());
+	fprintf(f, "\t\"threads\": %u,\n", poolWorkers.ThreadCount());
+	fprintf(f, "\t\"scene_grid\": %d,\n", nSceneGrid);
+	fprintf(f, "\t\"mesh_load\": { \"cached\": %d, \"ms\": %.3f, \"parse_mb_per_s\": %.1f, \"triangles\": %zu, \"skipped_faces\": %zu },\n",
+		infoLoad.bFromCache, infoLoad.fSeconds * 1000.0, infoLoad.stats.MegabytesPerSecond(), meshCube.TriangleCount(), infoLoad.stats.nSkippedFaces);
+	fprintf(f, "\t\"settings\": { \"depth_test\": %d, \"hiz\": %d, \"edge_raster\": %d, \"tiled_raster\": %d, \"guard_band\": %d, \"meshlets\": %d, \"lod\": %d, \"bsp\": %d, \"sort\": %d },\n",
+		bDepthTest, bHiZ, bEdgeRaster, bTiledRaster, bGuardBand, bMeshlets, bLod, bBsp, (int)nSortMode);
+	fprintf(f, "\t\"warmup_frames\": %zu,\n", nFirst);
+	fprintf(f, "\t\"frames\": %zu,\n", stats.nCount);
+	fprintf(f, "\t\"frame_ms\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f, \"min\": %.4f },\n",
+		stats.fMean, stats.fP50, stats.fP95, stats.fP99, stats.fMax, stats.fMin);
+	fprintf(f, "\t\"triangles_submitted\": %llu,\n", (unsigned long long)nSubmitted);
+	fprintf(f, "\t\"triangles_rasterized\": %llu,\n", (unsigned long long)nRasterized);
+	fprintf(f, "\t\"triangles_per_second\": %.0f,\n", fSeconds > 0.0 ? nSubmitted / fSeconds : 0.0);
+	fprintf(f, "\t\"rasterized_per_second\": %.0f,\n", fSeconds > 0.0 ? nRasterized / fSeconds : 0.0);
+	fprintf(f, "\t\"frame_times_ms\": [");
+	for (size_t i = 0; i < vecMeasured.size(); i++)
+		fprintf(f, "%s%.4f", i == 0 ? "" : ", ", vecMeasured[i]);
+	fprintf(f, "]\n}\n");
+	bool bOk = !ferror(f);
+	return fclose(f) == 0 && bOk;
+}
+
 CHAR_INFO Engine3D::GetColour(float lum)
 {
 	short bg_col, fg_col;
@@ -45,54 +149,504 @@ CHAR_INFO Engine3D::GetColour(float lum)
 	return c;
 }
 
+vec3d Engine3D::ProjectToScreen(const vec3d& vView)
+{
+	return ClipToScreen(matProj * vView);
+}
+
+vec3d Engine3D::ClipToScreen(const vec3d& vClip)
+{
+	// Perspective divide, then X/Y are inverted so put them back and scale into view
+	float fInvW = 1.0f / vClip.w;
+	vec3d v;
+	v.x = (-vClip.x * fInvW + 1.0f) * 0.5f * (float)ScreenWidth();
+	v.y = (-vClip.y * fInvW + 1.0f) * 0.5f * (float)ScreenHeight();
+	v.z = vClip.z * fInvW;
+	return v;
+}
+
+bool Engine3D::IsObjectOccluded(const indexed_mesh& m, mat4x4& matWorldView)
+{
+	float fMinX = FLT_MAX, fMinY = FLT_MAX, fMinZ = FLT_MAX;
+	float fMaxX = -FLT_MAX, fMaxY = -FLT_MAX;
+	for (int i = 0; i < 8; i++)
+	{
+		vec3d vCorner((i & 1) ? m.vBoundsMax.x : m.vBoundsMin.x,
+					  (i & 2) ? m.vBoundsMax.y : m.vBoundsMin.y,
+					  (i & 4) ? m.vBoundsMax.z : m.vBoundsMin.z);
+		vec3d vView = matWorldView * vCorner;
+
+		// Box crosses the near plane, its screen extent is unbounded
+		if (vView.z < 0.1f)
+			return false;
+
+		vec3d vScreen = ProjectToScreen(vView);
+		fMinX = (std::min)(fMinX, vScreen.x);	fMaxX = (std::max)(fMaxX, vScreen.x);
+		fMinY = (std::min)(fMinY, vScreen.y);	fMaxY = (std::max)(fMaxY, vScreen.y);
+		fMinZ = (std::min)(fMinZ, vScreen.z);
+	}
+
+	return IsRectOccluded((int)fMinX, (int)fMinY, (int)fMaxX, (int)fMaxY, fMinZ);
+}
+
+void Engine3D::RasterTrianglesTiled(const arena_vector<triangle>& vecTriangles)
+{
+	binsRaster.Clear(arenaFrame);
+
+	// Bin consecutive runs of triangles in parallel, one chunk per thread
+	poolWorkers.ParallelFor(binsRaster.ChunkCount(), [&](size_t nChunk, unsigned)
+	{
+		size_t nBegin, nEnd;
+		binsRaster.ChunkRange((unsigned)nChunk, vecTriangles.size(), nBegin, nEnd);
+		for (size_t i = nBegin; i < nEnd; i++)
+		{
+			const triangle& t = vecTriangles[i];
+			binsRaster.Add((unsigned)nChunk, (uint32_t)i,
+				(std::min)(t.p[0].x, (std::min)(t.p[1].x, t.p[2].x)), (std::min)(t.p[0].y, (std::min)(t.p[1].y, t.p[2].y)),
+				(std::max)(t.p[0].x, (std::max)(t.p[1].x, t.p[2].x)), (std::max)(t.p[0].y, (std::max)(t.p[1].y, t.p[2].y)));
+		}
+	});
+
+	// Tiles never share cells, no locking needed. The HiZ pyramid and dirty spans are
+	// shared, so they are left out of the per triangle work and updated once at the end
+	poolWorkers.ParallelFor(binsRaster.TileCount(), [&](size_t nTile, unsigned)
+	{
+		int x0, y0, x1, y1;
+		binsRaster.TileRect((int)nTile, x0, y0, x1, y1);
+		binsRaster.ForEachInTile((int)nTile, [&](uint32_t i)
+		{
+			const triangle& t = vecTriangles[i];
+			RasterTriangleEdge(x0, y0, x1, y1, t.p[0].x, t.p[0].y, t.p[0].z, t.p[1].x, t.p[1].y, t.p[1].z, t.p[2].x, t.p[2].y, t.p[2].z, t.sym, t.col, bDepthTest, false);
+		});
+	});
+
+	for (int nTile = 0; nTile < binsRaster.TileCount(); nTile++)
+	{
+		if (binsRaster.TileEmpty(nTile))
+			continue;
+		int x0, y0, x1, y1;
+		binsRaster.TileRect(nTile, x0, y0, x1, y1);
+		MarkDirty(x0, y0, x1, y1);
+	}
+
+	if (bDepthTest)
+		RebuildHiZ();
+}
+
+void Engine3D::ProjectFace(const object_draw& d, const vec3d* pClipVerts, const uint16_t* pOutcodes, uint32_t i0, uint32_t i1, uint32_t i2, const vec3d& normal, const vec3d& p0, arena_vector<triangle>& vecOut)
+{
+	//cast ray from triangle to camera to see if it is visible. Done in object space
+	//with the normal from load time, before anything of the face is fetched
+	const vec3d& vCameraObject = d.vCameraObject;
+	float fFacing = normal.x * (p0.x - vCameraObject.x) + normal.y * (p0.y - vCameraObject.y) + normal.z * (p0.z - vCameraObject.z);
+
+	// if ray is aligned with normal, then triangle is visible
+	if (!(fFacing < 0.0f))
+		return;
+
+	// All three corners outside the same plane, nothing of it can be seen
+	uint32_t nOutside0 = pOutcodes[i0], nOutside1 = pOutcodes[i1], nOutside2 = pOutcodes[i2];
+	if (nOutside0 & nOutside1 & nOutside2 & CLIP_ALL)
+		return;
+
+	//how aligned are light direction and triangle surface normal
+	const vec3d& vLightObject = d.vLightObject;
+	float dp = (std::max)(0.1f, vLightObject.x * normal.x + vLightObject.y * normal.y + vLightObject.z * normal.z);
+
+	//Choose console colours as required 
+	CHAR_INFO c = GetColour(dp);
+	triangle triProjected;
+	triProjected.col = c.Attributes;
+	triProjected.sym = c.Char.UnicodeChar;
+
+	// Entirely inside the view volume (or the guard band), straight to the screen
+	uint32_t nStraddled = (nOutside0 | nOutside1 | nOutside2) >> 8;
+	if (nStraddled == 0)
+	{
+		triProjected.p[0] = ClipToScreen(pClipVerts[i0]);
+		triProjected.p[1] = ClipToScreen(pClipVerts[i1]);
+		triProjected.p[2] = ClipToScreen(pClipVerts[i2]);
+		vecOut.push_back(triProjected);
+		return;
+	}
+
+	// Clip against the planes it crosses, then fan the polygon back into triangles
+	clip_polygon poly;
+	poly.v[0] = pClipVerts[i0];
+	poly.v[1] = pClipVerts[i1];
+	poly.v[2] = pClipVerts[i2];
+	poly.nCount = 3;
+	int nCount = ClipPolygon(poly, nStraddled, fGuardX, fGuardY);
+	if (nCount < 3)
+		return;
+
+	vec3d vScreen[clip_polygon::MAX_VERTS];
+	for (int n = 0; n < nCount; n++)
+		vScreen[n] = ClipToScreen(poly.v[n]);
+
+	for (int n = 1; n + 1 < nCount; n++)
+	{
+		triProjected.p[0] = vScreen[0];
+		triProjected.p[1] = vScreen[n];
+		triProjected.p[2] = vScreen[n + 1];
+		vecOut.push_back(triProjected);
+	}
+}
+
+void Engine3D::ProjectTriangles(const object_draw& d, size_t nFirst, size_t nEnd, arena_vector<triangle>& vecOut)
+{
+	const uint32_t* pIndices = d.pMesh->Indices();
+	const vec3d* pVerts = d.pMesh->Verts();
+	const vec3d* pNormals = d.pMesh->Normals();
+	const vec3d* pClipVerts = &vecClipVerts[d.nVertexBase];
+	const uint16_t* pOutcodes = &vecOutcodes[d.nVertexBase];
+	for (size_t n = nFirst; n < nEnd; n++)
+	{
+		size_t i = (d.pFaceOrder ? d.pFaceOrder[n] : n) * 3;
+		ProjectFace(d, pClipVerts, pOutcodes, pIndices[i + 0], pIndices[i + 1], pIndices[i + 2], pNormals[i / 3], pVerts[pIndices[i + 0]], vecOut);
+	}
+}
+
+void Engine3D::ProjectMeshlets(const object_draw& d, size_t nFirst, size_t nEnd, arena_vector<triangle>& vecOut)
+{
+	const meshlet_mesh& ms = *d.pMeshlets;
+	const vec3d* pVerts = d.pMesh->Verts();
+	const vec3d* pNormals = d.pMesh->Normals();
+
+	uint32_t nCulled = 0;
+	for (size_t n = nFirst; n < nEnd; n++)
+	{
+		const meshlet& ml = ms.vecMeshlets[n];
+		bool bInside;
+		if (d.frustumObject.CullSphere(ml.vCenter, ml.fRadius, bInside) || ml.IsBackfacing(d.vCameraObject))
+		{
+			nCulled++;
+			continue;
+		}
+
+		// Only now are the cluster's vertices gathered and transformed, on the stack
+		vec3d vObject[MESHLET_MAX_VERTS], vClip[MESHLET_MAX_VERTS];
+		uint16_t nOutcodes[MESHLET_MAX_VERTS];
+		const uint32_t* pVertices = &ms.vecVertices[ml.nVertexOffset];
+		for (uint32_t v = 0; v < ml.nVertexCount; v++)
+			vObject[v] = pVerts[pVertices[v]];
+		d.matWorldViewProj.TransformBatch(vObject, vClip, ml.nVertexCount);
+		for (uint32_t v = 0; v < ml.nVertexCount; v++)
+			nOutcodes[v] = (uint16_t)(ClipOutcode(vClip[v]) | ClipOutcode(vClip[v], fGuardX, fGuardY) << 8);
+
+		const uint8_t* pTriangles = &ms.vecTriangles[(size_t)ml.nTriangleOffset * 3];
+		const uint32_t* pFaces = &ms.vecFaces[ml.nTriangleOffset];
+		for (uint32_t t = 0; t < ml.nTriangleCount; t++)
+			ProjectFace(d, vClip, nOutcodes, pTriangles[t * 3 + 0], pTriangles[t * 3 + 1], pTriangles[t * 3 + 2], pNormals[pFaces[t]], vObject[pTriangles[t * 3 + 0]], vecOut);
+	}
+	nClustersCulled.fetch_add(nCulled, std::memory_order_relaxed);
+}
+
+mat4x4 Engine3D::GridTransform(int x, int z, float fTime)
+{
+	// Far enough apart not to touch. The back row bobs up and down over time
+	float fSpacing = 3.0f * (std::max)(meshCube.fSphereRadius, 1.0f);
+	int nCol = x - nSceneGrid / 2;
+	float fLift = z == nSceneGrid - 1 ? sinf(fTime + (float)x) * fSpacing * 0.5f : 0.0f;
+	mat4x4 matWorld = mat4x4::RotationY((float)(nCol * 7 + z * 13) * 0.25f);
+	return matWorld * mat4x4::Translation((float)nCol * fSpacing, fLift, 5.0f + (float)z * fSpacing);
+}
+
+void Engine3D::BuildLevel(indexed_mesh& m)
+{
+	// Quads are wound so their normal points along vOut, whichever order the corners come in
+	mesh soup;
+	auto addQuad = [&](vec3d a, vec3d b, vec3d c, vec3d d, const vec3d& vOut)
+	{
+		vec3d n = (b - a).cross(c - a);
+		if (n.x * vOut.x + n.y * vOut.y + n.z * vOut.z < 0.0f)
+			std::swap(b, d);
+		triangle t;
+		t.p[0] = a; t.p[1] = b; t.p[2] = c;
+		soup.tris.push_back(t);
+		t.p[0] = a; t.p[1] = c; t.p[2] = d;
+		soup.tris.push_back(t);
+	};
+
+	// Floor under the grid, a tile per cell
+	float fSpacing = 3.0f * (std::max)(meshCube.fSphereRadius, 1.0f);
+	float fFloor = meshCube.vBoundsMin.y;
+	float fLeft = (-nSceneGrid / 2 - 0.5f) * fSpacing;
+	float fNear = 5.0f - 0.5f * fSpacing;
+	for (int z = 0; z < nSceneGrid; z++)
+	{
+		for (int x = 0; x < nSceneGrid; x++)
+		{
+			float x0 = fLeft + x * fSpacing, x1 = x0 + fSpacing;
+			float z0 = fNear + z * fSpacing, z1 = z0 + fSpacing;
+			addQuad(vec3d(x0, fFloor, z0), vec3d(x1, fFloor, z0), vec3d(x1, fFloor, z1), vec3d(x0, fFloor, z1), vec3d(0.0f, 1.0f, 0.0f, 0.0f));
+		}
+	}
+
+	// Pillars between every other pair of rows and columns, sunk through the floor
+	float fHalf = 0.1f * fSpacing;
+	for (int z = 1; z < nSceneGrid; z += 2)
+	{
+		for (int x = 1; x < nSceneGrid; x += 2)
+		{
+			float cx = fLeft + x * fSpacing, cz = fNear + z * fSpacing;
+			float vMin[3] = { cx - fHalf, fFloor - 0.5f * fSpacing, cz - fHalf };
+			float vMax[3] = { cx + fHalf, fFloor + 1.5f * fSpacing, cz + fHalf };
+			for (int a = 0; a < 3; a++)
+			{
+				int u = (a + 1) % 3, v = (a + 2) % 3;
+				for (int nSide = 0; nSide < 2; nSide++)
+				{
+					vec3d vCorner[4], vOut(0.0f, 0.0f, 0.0f, 0.0f);
+					for (int k = 0; k < 4; k++)
+					{
+						float c[3];
+						c[a] = nSide ? vMax[a] : vMin[a];
+						c[u] = (k == 1 || k == 2) ? vMax[u] : vMin[u];
+						c[v] = (k >= 2) ? vMax[v] : vMin[v];
+						vCorner[k] = vec3d(c[0], c[1], c[2]);
+					}
+					float o[3] = { 0.0f, 0.0f, 0.0f };
+					o[a] = nSide ? 1.0f : -1.0f;
+					vOut = vec3d(o[0], o[1], o[2], 0.0f);
+					addQuad(vCorner[0], vCorner[1], vCorner[2], vCorner[3], vOut);
+				}
+			}
+		}
+	}
+	m.FromTriangles(soup);
+}
+
+void Engine3D::MoveCamera(const vec3d& vMove)
+{
+	// Stop CAMERA_RADIUS short of the first surface along the way
+	float fLength = vMove.length();
+	if (fLength <= 0.0f)
+		return;
+	vec3d vDir(vMove.x / fLength, vMove.y / fLength, vMove.z / fLength, 0.0f);
+	scene_hit hit;
+	if (sceneMain.Raycast(vCamera, vDir, fLength + CAMERA_RADIUS, hit))
+		fLength = (std::max)(0.0f, hit.t - CAMERA_RADIUS);
+	vCamera.x += vDir.x * fLength;
+	vCamera.y += vDir.y * fLength;
+	vCamera.z += vDir.z * fLength;
+}
+
+vec3d Engine3D::MouseRay(const mat4x4& matCamera)
+{
+	// Undo the viewport transform to get x/w and y/w at the cell centre, then the
+	// projection's scale to get a view space direction at z = 1
+	float fNdcX = 1.0f - 2.0f * ((float)GetMouseX() + 0.5f) / (float)ScreenWidth();
+	float fNdcY = 1.0f - 2.0f * ((float)GetMouseY() + 0.5f) / (float)ScreenHeight();
+	vec3d vDirView(fNdcX / matProj.m[0][0], fNdcY / matProj.m[1][1], 1.0f, 0.0f);
+	vec3d vDir = matCamera * vDirView;
+	vDir.w = 0.0f;
+	return vDir;
+}
+
 bool Engine3D::OnUserCreate() 
 {
-	meshCube.LoadFromObjectFile("Assets/teapot.obj");
+	// Where the asset came from and how long it took goes in the benchmark report
+	LoadMeshCached("Assets/teapot.obj", meshCube, &infoLoad);
+
+	// The mesh on its own, or copies of it on a grid with a level around them. The one at
+	// the front of the middle column sits where the single mesh is
+	for (int z = 0; z < nSceneGrid; z++)
+		for (int x = 0; x < nSceneGrid; x++)
+			sceneMain.Add(meshCube, GridTransform(x, z, 0.0f));
+	if (nSceneGrid > 1)
+	{
+		BuildLevel(meshLevel);
+		nLevelObject = sceneMain.Add(meshLevel, mat4x4(1.0f));
+		bspLevel.Build(meshLevel);
+		m_sAppName += L" - level " + std::to_wstring(bspLevel.Mesh().TriangleCount()) + L" tris, " + std::to_wstring(bspLevel.SplitCount()) + L" splits";
+	}
+	sceneMain.BuildHierarchy();
+	sceneMain.BuildLods();
+	sceneMain.BuildMeshlets();
+
+	poolWorkers.Create();
+	binsRaster.Create(ScreenWidth(), ScreenHeight(), RASTER_TILE_W, RASTER_TILE_H, poolWorkers.ThreadCount());
+
+	if (bBenchmark)
+	{
+		if (sBenchmarkPath.empty())
+			BuildBenchmarkPath(pathBenchmark);
+		else if (!pathBenchmark.Load(sBenchmarkPath))
+		{
+			fprintf(stderr, "Could not read a camera path from %s\n", sBenchmarkPath.c_str());
+			return false;
+		}
+
+		// Recorded inside the frame, where nothing may allocate
+		size_t nFrames = (size_t)(pathBenchmark.Duration() / (std::max)(m_fHeadlessFrameTime, 1e-4f)) + nBenchmarkWarmup + 2;
+		vecBenchmarkSubmitted.reserve(nFrames);
+		vecBenchmarkRasterized.reserve(nFrames);
+	}
 
 	//Projection Matrix
 	matProj = mat4x4::Projection(90.0f, (float)ScreenHeight() / (float)ScreenWidth(), 0.1f, 1000.0f);
 	return true;
 }
 
+void Engine3D::DrawBatch(size_t nTotalVerts, SORT_MODE nSort)
+{
+	// Transform every unique vertex once, triangles below only gather from these. Clip
+	// space comes from the fused world * view * projection matrix along with each vertex's
+	// outcodes: against the view volume in the low byte for rejection, against the guard
+	// band above it for clipping
+	vecClipVerts.resize(nTotalVerts);
+	vecOutcodes.resize(nTotalVerts);
+	poolWorkers.ParallelFor(vecVertexJobs.size(), [&](size_t nJob, unsigned)
+	{
+		const geometry_job& job = vecVertexJobs[nJob];
+		const object_draw& d = vecDraws[job.nDraw];
+		size_t nBase = d.nVertexBase;
+		d.matWorldViewProj.TransformBatch(d.pMesh->Verts() + job.nFirst, &vecClipVerts[nBase + job.nFirst], job.nEnd - job.nFirst);
+		for (size_t v = nBase + job.nFirst; v < nBase + job.nEnd; v++)
+			vecOutcodes[v] = (uint16_t)(ClipOutcode(vecClipVerts[v]) | ClipOutcode(vecClipVerts[v], fGuardX, fGuardY) << 8);
+	});
+
+	// Faces are processed in fixed size chunks, each into its own list. Chunks do not
+	// depend on the thread count and are concatenated in order, so the raster list
+	// comes out in object and face order however the work was scheduled
+	size_t nChunks = vecFaceJobs.size();
+	vecChunkTriangles.resize(nChunks, arena_vector<triangle>(arenaFrame));
+	vecChunkOffsets.resize(nChunks + 1);
+
+	poolWorkers.ParallelFor(nChunks, [&](size_t nChunk, unsigned)
+	{
+		const geometry_job& job = vecFaceJobs[nChunk];
+		const object_draw& d = vecDraws[job.nDraw];
+		if (d.pMeshlets)
+			ProjectMeshlets(d, job.nFirst, job.nEnd, vecChunkTriangles[nChunk]);
+		else
+			ProjectTriangles(d, job.nFirst, job.nEnd, vecChunkTriangles[nChunk]);
+	});
+
+	// Prefix sum of the chunk sizes gives every chunk its place in the raster list
+	vecChunkOffsets[0] = 0;
+	for (size_t c = 0; c < nChunks; c++)
+		vecChunkOffsets[c + 1] = vecChunkOffsets[c] + vecChunkTriangles[c].size();
+
+	vecTrianglesToRaster.resize(vecChunkOffsets[nChunks]);
+	poolWorkers.ParallelFor(nChunks, [&](size_t nChunk, unsigned)
+	{
+		std::copy(vecChunkTriangles[nChunk].begin(), vecChunkTriangles[nChunk].end(), vecTrianglesToRaster.begin() + vecChunkOffsets[nChunk]);
+	});
+
+	if (nSort != SORT_NONE)
+		sorterDepth.Sort(vecTrianglesToRaster, nSort == SORT_BACK_TO_FRONT, arenaFrame);
+
+	nTrianglesRasterized += (uint32_t)vecTrianglesToRaster.size();
+
+	// Already clipped to the view volume, every triangle is drawn exactly once
+	if (bEdgeRaster && bTiledRaster)
+		RasterTrianglesTiled(vecTrianglesToRaster);
+	else for (auto& t : vecTrianglesToRaster)
+	{
+		if (bEdgeRaster)
+			FillTriangleEdge(t.p[0].x, t.p[0].y, t.p[0].z, t.p[1].x, t.p[1].y, t.p[1].z, t.p[2].x, t.p[2].y, t.p[2].z, t.sym, t.col, bDepthTest);
+		else if (bDepthTest)
+			FillTriangleDepth(t.p[0].x, t.p[0].y, t.p[0].z, t.p[1].x, t.p[1].y, t.p[1].z, t.p[2].x, t.p[2].y, t.p[2].z, t.sym, t.col);
+		else
+			FillTriangle(t.p[0].x, t.p[0].y, t.p[1].x, t.p[1].y, t.p[2].x, t.p[2].y, t.sym, t.col);
+	}
+
+
+	vecDraws.clear();
+	vecVertexJobs.clear();
+	vecFaceJobs.clear();
+	vecChunkTriangles.clear();
+	vecChunkOffsets.clear();
+	vecTrianglesToRaster.clear();
+}
+
 bool Engine3D::OnUserUpdate(float fElapsedTime) 
 {
+	// Moving objects refit the scene hierarchy; an occasional rebuild may allocate, so
+	// it happens ahead of the heap check. The single mesh stays put
+	fTime += fElapsedTime;
+	if (nSceneGrid > 1)
+	{
+		for (int x = 0; x < nSceneGrid; x++)
+			sceneMain.SetTransform((uint32_t)((nSceneGrid - 1) * nSceneGrid + x), GridTransform(x, nSceneGrid - 1, fTime));
+	}
+	sceneMain.RebuildIfDegraded();
+
+	// Last frame's transient data is dropped in one go, the containers holding it are
+	// let go of first. From here on nothing should reach the heap, the check asserts
+	// it in debug builds
+	heap_allocation_check checkHeap;
+	ArenaReset(vecVisibleObjects, arenaFrame);
+	ArenaReset(vecLevelOrder, arenaFrame);
+	ArenaReset(vecDraws, arenaFrame);
+	ArenaReset(vecVertexJobs, arenaFrame);
+	ArenaReset(vecFaceJobs, arenaFrame);
+	ArenaReset(vecClipVerts, arenaFrame);
+	ArenaReset(vecOutcodes, arenaFrame);
+	ArenaReset(vecTrianglesToRaster, arenaFrame);
+	ArenaReset(vecChunkTriangles, arenaFrame);
+	ArenaReset(vecChunkOffsets, arenaFrame);
+	arenaFrame.Reset();
+
 	vec3d vForward = vLookDir * (8.0f * fElapsedTime);
 	vec3d vRight = vLookDir.normalise().cross({0,1,0}) * (8.0f * fElapsedTime);
 
+	vec3d vMove(0.0f, 0.0f, 0.0f, 0.0f);
 	if (GetKey(VK_UP).bHeld)
-		vCamera.y += 8.0f * fElapsedTime;
+		vMove.y += 8.0f * fElapsedTime;
 	if (GetKey(VK_DOWN).bHeld)
-		vCamera.y -= 8.0f * fElapsedTime;
+		vMove.y -= 8.0f * fElapsedTime;
 	if (GetKey(VK_LEFT).bHeld)
-		vCamera -= vRight; 
+		vMove -= vRight; 
 	if (GetKey(VK_RIGHT).bHeld)
-		vCamera += vRight;
+		vMove += vRight;
 	
 	if (GetKey(L'W').bHeld)
-		vCamera += vForward;
+		vMove += vForward;
 	if (GetKey(L'S').bHeld)
-		vCamera -= vForward;
+		vMove -= vForward;
+	MoveCamera(vMove);
+
+	// Z toggles the depth buffer, X cycles the triangle ordering
+	if (GetKey(L'Z').bPressed)
+		bDepthTest = !bDepthTest;
+	if (GetKey(L'X').bPressed)
+		nSortMode = (SORT_MODE)((nSortMode + 1) % 3);
+	if (GetKey(L'C').bPressed)
+		bHiZ = !bHiZ;
+	if (GetKey(L'R').bPressed)
+		bEdgeRaster = !bEdgeRaster;
+	if (GetKey(L'T').bPressed)
+		bTiledRaster = !bTiledRaster;
+	if (GetKey(L'G').bPressed)
+		bGuardBand = !bGuardBand;
+	if (GetKey(L'M').bPressed)
+		bMeshlets = !bMeshlets;
+	if (GetKey(L'L').bPressed)
+		bLod = !bLod;
+	if (GetKey(L'O').bPressed)
+		sorterDepth.bCoherent = !sorterDepth.bCoherent;
+	if (GetKey(L'B').bPressed)
+		bBsp = !bBsp;
+	if (GetKey(L'I').bPressed)
+		bShowStats = !bShowStats;
 
 	if (GetKey(L'A').bHeld)
 		fYaw -= 2.0f * fElapsedTime;
 	if (GetKey(L'D').bHeld)
 		fYaw += 2.0f * fElapsedTime;
 
-	fTheta = 0.0f;
-
-	// Rotation Z
-	mat4x4 matRotZ = mat4x4::RotationZ(fTheta * 0.5f);
-
-	// Rotation X
-	mat4x4 matRotX = mat4x4::RotationX(fTheta);
-
-	// Translation matrix
-	mat4x4 matTrans = mat4x4::Translation(0.0f, 0.0f, 5.0f);
-
-	// World Matrix
-	mat4x4 matWorld(1.0f);
-	matWorld = matRotZ * matRotX;		//rotate around origin
-	matWorld = matWorld * matTrans;		//translate to another location
+	// A benchmark's camera follows its path. Frame times are fixed, so counting frames
+	// gives the same positions on every run
+	if (bBenchmark)
+	{
+		float fPathTime = (float)(nBenchmarkFrame - nBenchmarkWarmup) * fElapsedTime;
+		pathBenchmark.Sample((std::max)(fPathTime, 0.0f), vCamera, fYaw);
+		bBenchmarkDone = fPathTime >= pathBenchmark.Duration();
+		nBenchmarkFrame++;
+	}
 
 	vec3d vUp     = { 0,1,0 };
 	vec3d vTarget = { 0,0,1 };
@@ -107,142 +661,168 @@ bool Engine3D::OnUserUpdate(float fElapsedTime)
 	// Make view Matrix from camera
 	mat4x4 matView = matCamera.Inverse();
 
-	std::vector<triangle> vecTrianglesToRaster;
-
-	// Draw Triangles
-	for (const auto& tri : meshCube.tris)
+	// Left click picks whatever is under the mouse
+	if (GetMouse(0).bPressed)
 	{
-		triangle triProjected, triTransformed, triViewed;
-
-		triTransformed.p[0] = matWorld * tri.p[0];
-		triTransformed.p[1] = matWorld * tri.p[1];
-		triTransformed.p[2] = matWorld * tri.p[2];
-
-		vec3d normal, line1, line2;
-		line1 = triTransformed.p[1] - triTransformed.p[0];
-		line2 = triTransformed.p[2] - triTransformed.p[0];
-
-		normal = line1.cross(line2).normalise();
-
-		//cast ray from triangle to camera to see if it is visible
-		vec3d vCameraRay = triTransformed.p[0] - vCamera;
-		
-		// if ray is aligned with normal, then triangle is visible
-		if ( normal.dot(vCameraRay) < 0.0f)
-		{
-			//Ilumination
-			vec3d light_direction = { 0.0f, 1.0f, -1.0f };
-			light_direction = light_direction.normalise();
-
-			//how aligned are light direction and triangle surface normal
-			float dp = max(0.1f, light_direction.dot(normal));
-
-			//Choose console colours as required 
-			CHAR_INFO c = GetColour(dp);
-			triTransformed.col = c.Attributes;
-			triTransformed.sym = c.Char.UnicodeChar;
-
-			//Convert worls space to viewed space
-			triViewed.p[0] = matView * triTransformed.p[0];
-			triViewed.p[1] = matView * triTransformed.p[1];
-			triViewed.p[2] = matView * triTransformed.p[2];
-			triViewed.col = triTransformed.col;
-			triViewed.sym = triTransformed.sym;
-
-			// Clip Viewd Triangle against near plane
-			int nClippedTriangles = 0;
-			triangle clipped[2];
-			nClippedTriangles = ClipTriangleAgainstPlane({ 0.0f, 0.0f, 0.1f }, { 0.0f, 0.0f, 1.0f }, triViewed, clipped[0], clipped[1]);
-		
-			for (int n = 0; n < nClippedTriangles; n++)
-			{
-				// Project Triangles from 3D --> 2D
-				triProjected.p[0] = matProj * clipped[n].p[0];
-				triProjected.p[1] = matProj * clipped[n].p[1];
-				triProjected.p[2] = matProj * clipped[n].p[2];
-				triProjected.col = clipped[n].col;
-				triProjected.sym = clipped[n].sym;
-
-				//normalize result due to 4th element of vector
-				triProjected.p[0] = triProjected.p[0] / triProjected.p[0].w;
-				triProjected.p[1] = triProjected.p[1] / triProjected.p[1].w;
-				triProjected.p[2] = triProjected.p[2] / triProjected.p[2].w;
-
-				// X/Y are inverted so put them back
-				triProjected.p[0].x *= -1.0f;
-				triProjected.p[1].x *= -1.0f;
-				triProjected.p[2].x *= -1.0f;
-				triProjected.p[0].y *= -1.0f;
-				triProjected.p[1].y *= -1.0f;
-				triProjected.p[2].y *= -1.0f;
-
-				//Scale into View
-				vec3d vOffsetView = { 1, 1, 0 };
-				triProjected.p[0] += vOffsetView;
-				triProjected.p[1] += vOffsetView;
-				triProjected.p[2] += vOffsetView;
-
-				triProjected.p[0].x *= 0.5f * (float)ScreenWidth();
-				triProjected.p[0].y *= 0.5f * (float)ScreenHeight();
-				triProjected.p[1].x *= 0.5f * (float)ScreenWidth();
-				triProjected.p[1].y *= 0.5f * (float)ScreenHeight();
-				triProjected.p[2].x *= 0.5f * (float)ScreenWidth();
-				triProjected.p[2].y *= 0.5f * (float)ScreenHeight();
-
-				// Store triangles for sorting 
-				vecTrianglesToRaster.push_back(triProjected);
-			}
-		}
+		scene_hit hit;
+		nPickedObject = sceneMain.Raycast(vCamera, MouseRay(matCamera), 1000.0f, hit) ? hit.nObject : UINT32_MAX;
 	}
 
-	std::sort(vecTrianglesToRaster.begin(), vecTrianglesToRaster.end(), [](triangle& t1, triangle& t2)
-	{
-		float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
-		float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
-		return z1 > z2;
-	});
-
 	//Clear Screen
 	Fill(0, 0, ScreenWidth(), ScreenHeight(), PIXEL_SOLID, FG_BLACK);
+	EnableHiZ(bDepthTest && bHiZ);
+	if (bDepthTest)
+		ClearDepth();
+	nHiZRejected = 0;
+	nTrianglesRasterized = 0;
+
+	// Whole objects outside the view frustum are dropped before any of their vertices are touched
+	frustum frustumView = frustum::FromMatrix(matView * matProj);
+	nObjectsCulled = sceneMain.CullFrustum(frustumView, vecVisibleObjects);
+
+	// Side planes of the guard band in clip space, RASTER_GUARD_BAND cells past each edge
+	fGuardX = bGuardBand ? 1.0f + 2.0f * RASTER_GUARD_BAND / (float)ScreenWidth() : 1.0f;
+	fGuardY = bGuardBand ? 1.0f + 2.0f * RASTER_GUARD_BAND / (float)ScreenHeight() : 1.0f;
+
+	vec3d light_direction = vec3d(0.0f, 1.0f, -1.0f).normalise();
+	light_direction.w = 0.0f; // direction, no translation
+
+	// Without the depth buffer painter's ordering is the only thing resolving visibility
+	SORT_MODE nSort = bDepthTest ? nSortMode : SORT_BACK_TO_FRONT;
+
+	// Set up every visible object and cut its vertices and faces into jobs, so one
+	// parallel loop covers all objects whether there are a few big ones or many small
+	size_t nTotalVerts = 0;
+	uint32_t nClustersTotal = 0;
+	nTrianglesSubmitted = 0;
+	nClustersCulled.store(0, std::memory_order_relaxed);
+
+	// The level goes first, its faces walked out of the BSP tree already in drawing
+	// order: back to front for painter's ordering, otherwise front to back, which
+	// suits the depth test. It is drawn as a batch of its own, unsorted, before the
+	// objects are even looked at, so that they can be tested against its depth
+	bool bLevelBsp = bBsp && std::find(vecVisibleObjects.begin(), vecVisibleObjects.end(), nLevelObject) != vecVisibleObjects.end();
+	if (bLevelBsp)
+	{
+		bspLevel.Traverse(vCamera, frustumView, nSort == SORT_BACK_TO_FRONT, vecLevelOrder);
+
+		object_draw d;
+		d.pMesh = &bspLevel.Mesh();
+		d.vCameraObject = vCamera;
+		d.vLightObject = light_direction;
+		d.matWorldViewProj = matView * matProj;
+		d.nVertexBase = nTotalVerts;
+		d.pMeshlets = nullptr;
+		d.pFaceOrder = vecLevelOrder.data();
+
+		size_t nVerts = d.pMesh->VertexCount();
+		for (size_t v = 0; v < nVerts; v += GEOMETRY_VERTEX_BLOCK)
+			vecVertexJobs.push_back({ 0, v, (std::min)(v + GEOMETRY_VERTEX_BLOCK, nVerts) });
+		size_t nFaces = vecLevelOrder.size();
+		for (size_t t = 0; t < nFaces; t += GEOMETRY_FACE_CHUNK)
+			vecFaceJobs.push_back({ 0, t, (std::min)(t + GEOMETRY_FACE_CHUNK, nFaces) });
+
+		vecDraws.push_back(d);
+		nTrianglesSubmitted += (uint32_t)nFaces;
+		DrawBatch(nVerts, SORT_NONE);
+	}
 
-	for (auto& triToRaster : vecTrianglesToRaster)
+	// Only depth from this frame can hide an object, with nothing drawn yet there is
+	// nothing to test against
+	bool bOccluders = bDepthTest && bHiZ && nTrianglesRasterized > 0;
+	for (uint32_t nObject : vecVisibleObjects)
 	{
-		// Clip Triangles against all four screen edges, this could yield many triangles
-		triangle clipped[2];
-		std::list<triangle> listTriangles;
+		if (bLevelBsp && nObject == nLevelObject)
+			continue;
+		const scene_object& obj = sceneMain.Object(nObject);
 
-		listTriangles.push_back(triToRaster);
-		int nNewTriangles = 1;
+		// Whole object behind what is already on screen, nothing to do
+		mat4x4 matWorldView = obj.matWorld * matView;
+		if (bOccluders && IsObjectOccluded(*obj.pMesh, matWorldView))
+		{
+			nHiZRejected++;
+			continue;
+		}
 
-		for (int p = 0; p < 4; p++)
+		// Distant objects are drawn from a coarser level, sized to roughly
+		// LOD_TRIANGLES_PER_CELL triangles for every cell their bounding sphere covers
+		uint32_t nMesh = obj.nMesh;
+		if (bLod)
 		{
-			int nTrisToAdd = 0;
-			while (nNewTriangles > 0)
+			float dx = obj.vSphereCenter.x - vCamera.x, dy = obj.vSphereCenter.y - vCamera.y, dz = obj.vSphereCenter.z - vCamera.z;
+			float fDistance = sqrtf(dx * dx + dy * dy + dz * dz);
+			float fBudget = FLT_MAX;
+			if (fDistance > obj.fSphereRadius)
 			{
-				triangle test = listTriangles.front();
-				listTriangles.pop_front();
-				nNewTriangles--;
+				float fRadiusCells = obj.fSphereRadius / fDistance * matProj.m[1][1] * 0.5f * (float)ScreenHeight();
+				fBudget = PI * fRadiusCells * fRadiusCells * LOD_TRIANGLES_PER_CELL;
+			}
+			nMesh = sceneMain.SelectLod(nObject, fBudget);
+		}
 
-				switch(p)
-				{
-				case 0: nTrisToAdd = ClipTriangleAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, test, clipped[0], clipped[1]); break; //bottom view plane
-				case 1: nTrisToAdd = ClipTriangleAgainstPlane({ 0.0f, (float)ScreenHeight()-1, 0.0f }, { 0.0f, -1.0f, 0.0f }, test, clipped[0], clipped[1]); break; //top view plane
-				case 2: nTrisToAdd = ClipTriangleAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]); break;
-				case 3: nTrisToAdd = ClipTriangleAgainstPlane({ (float)ScreenWidth()-1, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]); break;
-				}
+		// Backface culling and lighting work on the mesh's own normals, so the camera and
+		// light go to object space once instead of every face going to world space. World
+		// matrices are rotation and translation only, the inverse keeps angles intact
+		object_draw d;
+		mat4x4 matWorldInv = obj.matWorld.Inverse();
+		d.pMesh = &sceneMain.Mesh(nMesh);
+		d.vCameraObject = matWorldInv * vCamera;
+		d.vLightObject = (matWorldInv * light_direction).normalise();
+		d.matWorldViewProj = matWorldView * matProj;
+		d.nVertexBase = nTotalVerts;
+		d.pMeshlets = nullptr;
+		d.pFaceOrder = nullptr;
+
+		// Clustered meshes cull and transform per meshlet inside the face jobs, the
+		// frustum comes along in object space so meshlet bounds are used as stored
+		uint32_t nDraw = (uint32_t)vecDraws.size();
+		const meshlet_mesh& ms = sceneMain.Meshlets(nMesh);
+		nTrianglesSubmitted += (uint32_t)d.pMesh->TriangleCount();
+		if (bMeshlets && !ms.vecMeshlets.empty())
+		{
+			d.pMeshlets = &ms;
+			d.frustumObject = frustum::FromMatrix(d.matWorldViewProj);
+			size_t nMeshlets = ms.vecMeshlets.size();
+			for (size_t n = 0; n < nMeshlets; n += GEOMETRY_MESHLET_CHUNK)
+				vecFaceJobs.push_back({ nDraw, n, (std::min)(n + GEOMETRY_MESHLET_CHUNK, nMeshlets) });
+			nClustersTotal += (uint32_t)nMeshlets;
+			vecDraws.push_back(d);
+			continue;
+		}
 
-				for (int w = 0; w < nTrisToAdd; w++)
-					listTriangles.push_back(clipped[w]);
-			}
+		size_t nVerts = d.pMesh->VertexCount();
+		for (size_t v = 0; v < nVerts; v += GEOMETRY_VERTEX_BLOCK)
+			vecVertexJobs.push_back({ nDraw, v, (std::min)(v + GEOMETRY_VERTEX_BLOCK, nVerts) });
+		size_t nTriangles = d.pMesh->TriangleCount();
+		for (size_t t = 0; t < nTriangles; t += GEOMETRY_FACE_CHUNK)
+			vecFaceJobs.push_back({ nDraw, t, (std::min)(t + GEOMETRY_FACE_CHUNK, nTriangles) });
 
-			nNewTriangles = listTriangles.size();
+		vecDraws.push_back(d);
+		nTotalVerts += nVerts;
+	}
 
-			for (auto& t : listTriangles)
-			{
-				//Rasterize triangle
-				FillTriangle(t.p[0].x, t.p[0].y, t.p[1].x, t.p[1].y, t.p[2].x, t.p[2].y, t.sym, t.col);
-			}
-		}		
+	DrawBatch(nTotalVerts, nSort);
+
+	// Counters go in the title bar only once I is pressed, the plain title is the default.
+	// The optional parts are formatted on their own and the line in one call, so a
+	// piece that doesn't fit can't throw off where the next one is written
+	m_sAppStats[0] = L'\0';
+	if (bShowStats)
+	{
+		wchar_t sClusters[48] = { 0 }, sPicked[32] = { 0 };
+		if (nClustersTotal > 0)
+			swprintf_s(sClusters, 48, L" - clusters %u/%u culled", nClustersCulled.load(), nClustersTotal);
+		if (nPickedObject != UINT32_MAX)
+			swprintf_s(sPicked, 32, L" - picked %u", nPickedObject);
+		swprintf_s(m_sAppStats, 128, L" - objects %u/%u culled%ls - %u tris%ls", nObjectsCulled, sceneMain.ObjectCount(), sClusters, nTrianglesSubmitted, sPicked);
 	}
-	return true;
+
+	if (bBenchmark)
+	{
+		vecBenchmarkSubmitted.push_back(nTrianglesSubmitted);
+		vecBenchmarkRasterized.push_back(nTrianglesRasterized);
+	}
+
+	nHiZRejected += TakeHiZRejectedCount();
+	return !bBenchmarkDone;
 }
\ No newline at end of file
@@ -2,25 +2,188 @@
 
 #include "ConsoleGameEngine.h"
 #include "engine_utils.h"
+#include "mesh_cache.h"
+#include "thread_pool.h"
+#include "raster_bins.h"
+#include "frame_arena.h"
+#include "clipper.h"
+#include "scene.h"
+#include "depth_sort.h"
+#include "bsp.h"
+#include "camera_path.h"
+#include "timing_stats.h"
 
 class Engine3D : public ConsoleGameEngine
 {
+public:
+	// Order triangles are handed to the rasterizer in. With the depth buffer on, sorting is
+	// only an optimisation: front to back lets the depth test reject hidden cells early
+	enum SORT_MODE
+	{
+		SORT_NONE,
+		SORT_FRONT_TO_BACK,
+		SORT_BACK_TO_FRONT,		// painter's algorithm, needed with the depth test off
+	};
 
 private:
-	mesh	meshCube;
+	indexed_mesh	meshCube;
+	mesh_load_info	infoLoad;
+	scene			sceneMain;
+	indexed_mesh	meshLevel;		// static level geometry, world space
+	bsp_tree		bspLevel;
+	uint32_t		nLevelObject = UINT32_MAX;	// the level's place in sceneMain, if there is one
+	int				nSceneGrid = 1;		// demo scene is nSceneGrid x nSceneGrid copies of the mesh
+
+	// Per frame state of one object that survived culling, what the geometry stage works from
+	struct object_draw
+	{
+		const indexed_mesh* pMesh;
+		mat4x4	matWorldViewProj;
+		vec3d	vCameraObject;		// camera and light direction in the object's own space
+		vec3d	vLightObject;
+		size_t	nVertexBase;		// where its vertices start in vecClipVerts
+		const meshlet_mesh* pMeshlets;	// set when drawn by clusters, then nothing is in vecClipVerts
+		frustum	frustumObject;		// view frustum in the object's space, for its clusters
+		const uint32_t* pFaceOrder;	// set when faces are drawn in a given order, jobs then index into it
+	};
+
+	// A run of one object's vertices, faces or meshlets, the unit the geometry stage is parallelised over
+	struct geometry_job
+	{
+		uint32_t	nDraw;
+		size_t		nFirst;
+		size_t		nEnd;
+	};
+
+	// Everything below is rebuilt every frame from arenaFrame, reset as a frame starts
+	frame_arena	arenaFrame;
+	arena_vector<uint32_t>	vecVisibleObjects;	// scene objects inside the frustum
+	arena_vector<uint32_t>	vecLevelOrder;		// level faces from the BSP walk, in drawing order
+	arena_vector<object_draw>	vecDraws;
+	arena_vector<geometry_job>	vecVertexJobs;
+	arena_vector<geometry_job>	vecFaceJobs;
+	arena_vector<vec3d>	vecClipVerts;		// after world * view * projection, before the divide, all drawn objects back to back
+	arena_vector<uint16_t>	vecOutcodes;		// CLIP_PLANE bits per clip space vertex, view volume | guard band << 8
+	arena_vector<triangle>	vecTrianglesToRaster;	// screen space, in object then face order unless sorted
+	arena_vector<arena_vector<triangle>>	vecChunkTriangles;	// per face chunk geometry output
+	arena_vector<size_t>	vecChunkOffsets;
+
 	mat4x4	matProj;
 	vec3d	vCamera;
 	vec3d   vLookDir;
 
-	float	fTheta;
-	float	fYaw;
+	float	fYaw = 0.0f;
+	float	fTime = 0.0f;
+
+	bool		bDepthTest = true;
+	bool		bHiZ = true;
+	bool		bEdgeRaster = true;	// half-space rasterizer instead of the scanline one
+	bool		bTiledRaster = true;	// rasterize screen tiles in parallel, edge rasterizer only
+	bool		bGuardBand = true;		// only clip triangles reaching past the guard band
+	bool		bMeshlets = true;		// cull and transform meshes per cluster
+	bool		bLod = true;			// draw distant objects from simplified levels
+	bool		bBsp = true;			// draw the level in BSP order, left out of the sort
+	bool		bShowStats = false;	// culling counters in the title bar
+	float		fGuardX = 1.0f;			// guard band side planes this frame, in units of w
+	float		fGuardY = 1.0f;
+	SORT_MODE	nSortMode = SORT_NONE;
+	int			nHiZRejected = 0;	// triangles and objects skipped by the HiZ test last frame
+	uint32_t	nObjectsCulled = 0;	// objects outside the view frustum last frame
+	uint32_t	nPickedObject = UINT32_MAX;	// last object clicked on
+	uint32_t	nTrianglesSubmitted = 0;	// triangles of every object handed to the geometry stage last frame
+	uint32_t	nTrianglesRasterized = 0;	// triangles that reached the rasterizer last frame
+	std::atomic<uint32_t>	nClustersCulled{ 0 };	// meshlets dropped by their frustum or cone test this frame
+
+	// Benchmark runs, see EnableBenchmark
+	bool		bBenchmark = false;
+	bool		bBenchmarkDone = false;		// the last frame of the path has been drawn
+	std::string	sBenchmarkPath;
+	camera_path	pathBenchmark;
+	int			nBenchmarkWarmup = 0;
+	int			nBenchmarkFrame = 0;
+	std::vector<uint32_t>	vecBenchmarkSubmitted;	// triangles per frame, as nTrianglesSubmitted
+	std::vector<uint32_t>	vecBenchmarkRasterized;	// triangles per frame that reached the rasterizer
+
+	// Walk down an aisle of the grid, look around, then rise and fly back out
+	void BuildBenchmarkPath(camera_path& path);
 
 	// Taken From Command Line Webcam Video
 	CHAR_INFO GetColour(float lum);
 
+	// Project a view space point to screen cells, z keeps the post-projection depth
+	vec3d ProjectToScreen(const vec3d& vView);
+
+	// Perspective divide and viewport transform of a clip space point
+	vec3d ClipToScreen(const vec3d& vClip);
+
+	// True if the mesh's bounding box lies behind everything drawn so far this frame
+	bool IsObjectOccluded(const indexed_mesh& m, mat4x4& matWorldView);
+
+	// World matrix of the demo scene's object at grid cell (x, z)
+	mat4x4 GridTransform(int x, int z, float fTime);
+
+	// Floor under the object grid with pillars standing through it, in world space
+	void BuildLevel(indexed_mesh& m);
+
+	// Move the camera by vMove, stopping short of any surface in the way
+	void MoveCamera(const vec3d& vMove);
+
+	// World space direction through the cell under the mouse
+	vec3d MouseRay(const mat4x4& matCamera);
+
+	// Bin screen space triangles into tiles and rasterize the tiles on the worker pool.
+	// Each tile is owned by one worker and sees its triangles in list order, so the
+	// result matches rasterizing the list front to back on one thread
+	void RasterTrianglesTiled(const arena_vector<triangle>& vecTriangles);
+
+	// Transform, project, sort and rasterize what the draw and job lists hold, vertices
+	// numbered from 0 up to nTotalVerts, then empty them for the next batch
+	void DrawBatch(size_t nTotalVerts, SORT_MODE nSort);
+
+	// Object space backface test, outcode rejection, lighting, clipping against the view
+	// volume and projection to the screen for faces [nFirst, nEnd) of a drawn object,
+	// appending what survives to vecOut. Reads only the per frame vertex arrays, so
+	// disjoint ranges can run concurrently
+	void ProjectTriangles(const object_draw& d, size_t nFirst, size_t nEnd, arena_vector<triangle>& vecOut);
+
+	// Same for meshlets [nFirst, nEnd) of a clustered object. Each meshlet is first tested
+	// whole against the frustum and its normal cone; only the survivors have their
+	// vertices transformed, into stack arrays
+	void ProjectMeshlets(const object_draw& d, size_t nFirst, size_t nEnd, arena_vector<triangle>& vecOut);
+
+	// The per face work shared by both: pClipVerts and pOutcodes are indexed by i0-i2,
+	// p0 is the first corner in object space for the backface test
+	void ProjectFace(const object_draw& d, const vec3d* pClipVerts, const uint16_t* pOutcodes, uint32_t i0, uint32_t i1, uint32_t i2, const vec3d& normal, const vec3d& p0, arena_vector<triangle>& vecOut);
+
+	depth_sorter	sorterDepth;
+	thread_pool	poolWorkers;
+	raster_bins	binsRaster;
+	static const int RASTER_TILE_W = 32;
+	static const int RASTER_TILE_H = 16;
+	static const size_t GEOMETRY_VERTEX_BLOCK = 16384;
+	static const size_t GEOMETRY_FACE_CHUNK = 4096;
+	static const size_t GEOMETRY_MESHLET_CHUNK = 32;	// about as many triangles as a face chunk
+	static constexpr float CAMERA_RADIUS = 0.5f;	// closest the camera gets to a surface
+	static constexpr float LOD_TRIANGLES_PER_CELL = 2.0f;	// detail wanted per screen cell an object covers
+
 public:
 	Engine3D();
 
+	// Replays a camera path instead of taking input, from a keyframe file (see
+	// camera_path) or the built in one if sPathFile is empty. The first nWarmup frames
+	// hold the path's first view and are left out of the report. The run ends after the
+	// path's last frame, so construct it headless with no frame count
+	void EnableBenchmark(const std::string& sPathFile, int nWarmup);
+
+	// Replaces the single mesh with nSize x nSize copies of it, the back row moving, on a
+	// floor with pillars standing through it. Call before construction
+	void EnableSceneGrid(int nSize);
+
+	// Frame time statistics and triangle throughput of a finished benchmark run, and how
+	// the mesh was loaded, as JSON.
+	// False if the run never started or the file can't be written
+	bool WriteBenchmarkReport(const std::string& sFilename);
+
 	bool OnUserCreate() override;
 	bool OnUserUpdate(float fElapsedTime) override;
 };
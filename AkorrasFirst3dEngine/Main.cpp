@@ -1,10 +1,111 @@
+#include <sstream>
+
 #include "Engine3d.h"
 
-int main()
+#ifdef ENGINE_COUNT_HEAP
+// Count every heap allocation for heap_allocation_check, see frame_arena.h
+void* operator new(size_t nSize)
 {
+	HeapAllocationCounter().fetch_add(1, std::memory_order_relaxed);
+	void* p = std::malloc(nSize ? nSize : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t nSize) { return operator new(nSize); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+#endif
+
+// With no arguments the demo runs in the console. For machines without one:
+//   --headless <frames>	render that many frames in memory, as fast as they go
+//   --dump <n>[,<n>...]	write these frames out as images, numbered from 0
+//   --out <pattern>		their file names, one %d, %Nd or %0Nd for the number, .png or .ppm (frame_%04d.png)
+//   --scale <pixels>		pixels per cell in the images (1)
+//   --benchmark <file>		replay a camera path headless, frame time statistics to file as JSON
+//   --path <file>			camera keyframes for the benchmark, see camera_path.h
+//   --warmup <frames>		frames at the path's start left out of the statistics (10)
+//   --grid <n>				n x n copies of the mesh on a level instead of the single one (1)
+int main(int argc, char* argv[])
+{
+	int nHeadlessFrames = 0;
+	std::vector<int> vecDumpFrames;
+	std::string sDumpPattern = "frame_%04d.png";
+	int nDumpScale = 1;
+	std::string sBenchmarkReport, sBenchmarkPath;
+	int nBenchmarkWarmup = 10;
+	int nSceneGrid = 1;
+	for (int i = 1; i < argc; i += 2)
+	{
+		std::string sOption = argv[i];
+		if (i + 1 == argc)
+		{
+			fprintf(stderr, "Option %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if (sOption == "--headless")
+			nHeadlessFrames = atoi(argv[i + 1]);
+		else if (sOption == "--dump")
+		{
+			std::stringstream ss(argv[i + 1]);
+			std::string sFrame;
+			while (std::getline(ss, sFrame, ','))
+				vecDumpFrames.push_back(atoi(sFrame.c_str()));
+		}
+		else if (sOption == "--out")
+		{
+			sDumpPattern = argv[i + 1];
+			std::string sName;
+			if (!FormatFrameName(sDumpPattern, 0, sName))
+			{
+				fprintf(stderr, "Frame name pattern %s needs exactly one %%d\n", argv[i + 1]);
+				return 1;
+			}
+		}
+		else if (sOption == "--scale")
+			nDumpScale = (std::max)(1, atoi(argv[i + 1]));
+		else if (sOption == "--benchmark")
+			sBenchmarkReport = argv[i + 1];
+		else if (sOption == "--path")
+			sBenchmarkPath = argv[i + 1];
+		else if (sOption == "--warmup")
+			nBenchmarkWarmup = atoi(argv[i + 1]);
+		else if (sOption == "--grid")
+			nSceneGrid = atoi(argv[i + 1]);
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
 	Engine3D demo;
-	if (demo.ConstructConsole(256, 240, 4, 4))
+	demo.EnableSceneGrid(nSceneGrid);
+	if (!sBenchmarkReport.empty())
+	{
+		demo.EnableBenchmark(sBenchmarkPath, nBenchmarkWarmup);
+		demo.DumpFrames(vecDumpFrames, sDumpPattern, nDumpScale);
+		if (demo.ConstructHeadless(256, 240, nHeadlessFrames))
+		{
+			demo.Start();
+			if (!demo.WriteBenchmarkReport(sBenchmarkReport))
+			{
+				fprintf(stderr, "No benchmark report written to %s\n", sBenchmarkReport.c_str());
+				return 1;
+			}
+		}
+	}
+	else if (nHeadlessFrames > 0)
+	{
+		demo.DumpFrames(vecDumpFrames, sDumpPattern, nDumpScale);
+		if (demo.ConstructHeadless(256, 240, nHeadlessFrames))
+			demo.Start();
+	}
+	else if (demo.ConstructConsole(256, 240, 4, 4))
 		demo.Start();
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,545 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+
+#include "dirty_spans.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "console_posix.h"
+
+// termios.h names its baud rates B0, B50 and so on; B0 is too common a name to
+// leave defined, and nothing here needs it
+#undef B0
+#endif
+
+// Presents a CHAR_INFO screen buffer on a terminal speaking ANSI escape codes,
+// the way the engine runs on POSIX systems and over ssh. Glyphs go out as UTF-8
+// and console attributes as 16 colour SGR codes.
+//
+// Every frame is compared against the last one sent and only cells that changed
+// are written. The cursor is moved to each changed run by whichever is shortest:
+// writing over the unchanged cells in between, a relative move, a line feed or an
+// absolute position. Colours are only sent when they differ from the ones the
+// terminal is already set to, so a run of same coloured cells costs its glyphs and
+// nothing else. Over a remote link bytes per frame are what limits the frame rate,
+// LastFrameBytes() reports them.
+//
+// The terminal also provides input: keys and xterm mouse reports are read from the
+// same tty. Terminals send no key releases, so a key counts as held for a moment
+// after each byte of it, long enough to bridge the gap to the auto repeat.
+class ansi_terminal
+{
+public:
+	~ansi_terminal()
+	{
+#ifndef _WIN32
+		Close();
+#endif
+	}
+
+	void Create(int nWidth, int nHeight)
+	{
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+		m_nColumns = nWidth;
+		m_nRows = nHeight;
+		m_vecPrevious.assign((size_t)nWidth * nHeight, CHAR_INFO());
+		m_vecOut.reserve((size_t)nWidth * nHeight * 16);
+		Invalidate();
+	}
+
+	// The next frame is sent whole, after clearing the terminal
+	void Invalidate()
+	{
+		m_bInvalid = true;
+	}
+
+	// Cells beyond the terminal's own size are left out
+	void SetVisibleSize(int nColumns, int nRows)
+	{
+		nColumns = (std::min)(nColumns, m_nWidth);
+		nRows = (std::min)(nRows, m_nHeight);
+		if (nColumns != m_nColumns || nRows != m_nRows)
+			Invalidate();
+		m_nColumns = nColumns;
+		m_nRows = nRows;
+	}
+
+	// The bytes taking the terminal from the last frame to pScreen, and any title
+	// set since. Valid until the next call. With pDirty only its spans are compared,
+	// everything else is taken to be as it was last frame
+	const std::vector<char>& Encode(const CHAR_INFO* pScreen, const dirty_spans* pDirty = nullptr)
+	{
+		m_vecOut.clear();
+		m_vecOut.insert(m_vecOut.end(), m_vecTitle.begin(), m_vecTitle.end());
+		m_vecTitle.clear();
+		if (m_bInvalid)
+		{
+			Append("\x1b[0m\x1b[2J");
+			m_nCursorX = m_nCursorY = -1;
+			m_nAttributes = -1;
+		}
+
+		for (int y = 0; y < m_nRows; y++)
+		{
+			const CHAR_INFO* pRow = pScreen + (size_t)y * m_nWidth;
+			CHAR_INFO* pPrevious = &m_vecPrevious[(size_t)y * m_nWidth];
+			int x0 = 0, x1 = m_nColumns - 1;
+			if (pDirty && !m_bInvalid)
+			{
+				if (!pDirty->Row(y, x0, x1))
+					continue;
+				x1 = (std::min)(x1, m_nColumns - 1);
+			}
+			for (int x = x0; x <= x1; x++)
+			{
+				if (!m_bInvalid && SameCell(pRow[x], pPrevious[x]))
+					continue;
+
+				MoveTo(x, y, pRow);
+				SetAttributes(pRow[x].Attributes);
+				AppendGlyph(pRow[x].Char.UnicodeChar);
+				pPrevious[x] = pRow[x];
+
+				// Past the last column the cursor waits to wrap, where it is then
+				// depends on the terminal
+				m_nCursorX = x + 1 < m_nColumns ? x + 1 : -1;
+			}
+		}
+		m_bInvalid = false;
+		m_nLastFrameBytes = m_vecOut.size();
+		return m_vecOut;
+	}
+
+	size_t LastFrameBytes() const { return m_nLastFrameBytes; }
+
+	// The title changes with every frame's FPS, so it is only sent every
+	// TITLE_INTERVAL seconds. It goes out with the next frame
+	void SetTitle(const wchar_t* sTitle)
+	{
+		auto tpNow = std::chrono::steady_clock::now();
+		if (m_bTitleSent && std::chrono::duration<float>(tpNow - m_tpTitle).count() < TITLE_INTERVAL)
+			return;
+		m_bTitleSent = true;
+		m_tpTitle = tpNow;
+
+		m_vecOut.swap(m_vecTitle);
+		m_vecOut.clear();
+		Append("\x1b]0;");
+		for (const wchar_t* p = sTitle; *p; p++)
+			AppendGlyph(*p);
+		Append("\x07");
+		m_vecOut.swap(m_vecTitle);
+	}
+
+#ifndef _WIN32
+	// Takes over the tty on standard input and output: raw input, the alternate
+	// screen, no cursor, mouse reports. False if either is not a terminal
+	bool Open(int nWidth, int nHeight)
+	{
+		if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+			return false;
+		if (tcgetattr(STDIN_FILENO, &m_termOriginal) != 0)
+			return false;
+
+		// No line buffering or echo, and reads return at once with whatever is there.
+		// Ctrl+C still raises SIGINT
+		termios termRaw = m_termOriginal;
+		termRaw.c_iflag &= ~(tcflag_t)(IXON | ICRNL | INLCR | IGNCR);
+		termRaw.c_lflag &= ~(tcflag_t)(ICANON | ECHO | IEXTEN);
+		termRaw.c_cc[VMIN] = 0;
+		termRaw.c_cc[VTIME] = 0;
+		if (tcsetattr(STDIN_FILENO, TCSANOW, &termRaw) != 0)
+			return false;
+		m_bOpen = true;
+
+		Create(nWidth, nHeight);
+		UpdateVisibleSize();
+		const char* sSetup = "\x1b[?1049h\x1b[?25l\x1b[?1003h\x1b[?1006h";
+		WriteAll(sSetup, strlen(sSetup));
+		return true;
+	}
+
+	void Close()
+	{
+		if (!m_bOpen)
+			return;
+		const char* sRestore = "\x1b[0m\x1b[?1006l\x1b[?1003l\x1b[?25h\x1b[?1049l";
+		WriteAll(sRestore, strlen(sRestore));
+		tcsetattr(STDIN_FILENO, TCSANOW, &m_termOriginal);
+		m_bOpen = false;
+	}
+
+	void Present(const CHAR_INFO* pScreen, const dirty_spans* pDirty = nullptr)
+	{
+		UpdateVisibleSize();
+		const std::vector<char>& vecBytes = Encode(pScreen, pDirty);
+		WriteAll(vecBytes.data(), vecBytes.size());
+	}
+
+	// Reads whatever input has arrived, call once per frame before asking for keys.
+	// A sequence cut off at the end of what has arrived waits for its rest, across
+	// calls if need be
+	void PollInput()
+	{
+		float fNow = Seconds();
+		ssize_t nRead;
+		while (m_nPending < sizeof(m_bufInput) && (nRead = read(STDIN_FILENO, m_bufInput + m_nPending, sizeof(m_bufInput) - m_nPending)) > 0)
+		{
+			if (m_nPending == 0)
+				m_fPendingSince = fNow;
+			size_t nBytes = m_nPending + (size_t)nRead;
+			size_t nUsed = Parse(m_bufInput, nBytes, fNow);
+			m_nPending = nBytes - nUsed;
+			memmove(m_bufInput, m_bufInput + nUsed, m_nPending);
+		}
+
+		// Terminals send a sequence in one write, so if nothing completed it in
+		// ESCAPE_TIMEOUT a lone escape was the key itself, and anything longer is a
+		// fragment that is not going to make sense and is dropped
+		if (m_nPending > 0 && fNow - m_fPendingSince >= ESCAPE_TIMEOUT)
+		{
+			if (m_nPending == 1)
+				PressKey(VK_ESCAPE, fNow);
+			m_nPending = 0;
+		}
+	}
+
+	bool KeyHeld(int nKey) const { return nKey >= 0 && nKey < 256 && Seconds() < m_fKeyUntil[nKey]; }
+	int MouseX() const { return m_nMouseX; }
+	int MouseY() const { return m_nMouseY; }
+	bool MouseButton(int nButton) const { return (m_nMouseButtons >> nButton) & 1; }
+#endif
+
+private:
+	static constexpr float TITLE_INTERVAL = 0.5f;
+	static constexpr float KEY_HOLD_FIRST = 0.5f;	// typical auto repeat delay
+	static constexpr float KEY_HOLD_REPEAT = 0.1f;	// comfortably over the repeat interval
+	static constexpr float ESCAPE_TIMEOUT = 0.05f;	// for the rest of an escape sequence to arrive
+
+	static bool SameCell(const CHAR_INFO& a, const CHAR_INFO& b)
+	{
+		return a.Char.UnicodeChar == b.Char.UnicodeChar && a.Attributes == b.Attributes;
+	}
+
+	void Append(const char* s)
+	{
+		m_vecOut.insert(m_vecOut.end(), s, s + strlen(s));
+	}
+
+	void AppendNumber(int n)
+	{
+		char buf[12];
+		int nDigits = 0;
+		do
+		{
+			buf[nDigits++] = (char)('0' + n % 10);
+			n /= 10;
+		} while (n > 0);
+		while (nDigits > 0)
+			m_vecOut.push_back(buf[--nDigits]);
+	}
+
+	static int Digits(int n)
+	{
+		return n < 10 ? 1 : n < 100 ? 2 : n < 1000 ? 3 : n < 10000 ? 4 : 5;
+	}
+
+	// Control codes and the zeroed cells of a fresh buffer show as blanks
+	static uint32_t CodePoint(wchar_t c)
+	{
+		uint32_t n = (uint32_t)c;
+		return n < 0x20 || n == 0x7f ? ' ' : n;
+	}
+
+	static int GlyphBytes(wchar_t c)
+	{
+		uint32_t n = CodePoint(c);
+		return n < 0x80 ? 1 : n < 0x800 ? 2 : n < 0x10000 ? 3 : 4;
+	}
+
+	void AppendGlyph(wchar_t c)
+	{
+		uint32_t n = CodePoint(c);
+		if (n < 0x80)
+			m_vecOut.push_back((char)n);
+		else if (n < 0x800)
+		{
+			m_vecOut.push_back((char)(0xC0 | (n >> 6)));
+			m_vecOut.push_back((char)(0x80 | (n & 0x3F)));
+		}
+		else if (n < 0x10000)
+		{
+			m_vecOut.push_back((char)(0xE0 | (n >> 12)));
+			m_vecOut.push_back((char)(0x80 | ((n >> 6) & 0x3F)));
+			m_vecOut.push_back((char)(0x80 | (n & 0x3F)));
+		}
+		else
+		{
+			m_vecOut.push_back((char)(0xF0 | (n >> 18)));
+			m_vecOut.push_back((char)(0x80 | ((n >> 12) & 0x3F)));
+			m_vecOut.push_back((char)(0x80 | ((n >> 6) & 0x3F)));
+			m_vecOut.push_back((char)(0x80 | (n & 0x3F)));
+		}
+	}
+
+	// Console colours are intensity, red, green, blue from the top bit down, ANSI
+	// ones blue, green, red
+	static int AnsiColour(int nConsole)
+	{
+		return ((nConsole & 1) << 2) | (nConsole & 2) | ((nConsole & 4) >> 2);
+	}
+
+	void SetAttributes(WORD nAttributes)
+	{
+		int nFg = nAttributes & 0x0F, nBg = (nAttributes >> 4) & 0x0F;
+		bool bFg = m_nAttributes < 0 || nFg != (m_nAttributes & 0x0F);
+		bool bBg = m_nAttributes < 0 || nBg != ((m_nAttributes >> 4) & 0x0F);
+		if (!bFg && !bBg)
+			return;
+
+		Append("\x1b[");
+		if (bFg)
+			AppendNumber((nFg & 8 ? 90 : 30) + AnsiColour(nFg));
+		if (bFg && bBg)
+			m_vecOut.push_back(';');
+		if (bBg)
+			AppendNumber((nBg & 8 ? 100 : 40) + AnsiColour(nBg));
+		m_vecOut.push_back('m');
+		m_nAttributes = nAttributes & 0xFF;
+	}
+
+	// Cheapest way from the cursor to (x, y). pRow is the new frame's row y, for
+	// writing over unchanged cells on the way
+	void MoveTo(int x, int y, const CHAR_INFO* pRow)
+	{
+		if (m_nCursorX == x && m_nCursorY == y)
+			return;
+
+		// Absolute, the column can be left out for the first one
+		int nBest = x == 0 ? 3 + Digits(y + 1) : 4 + Digits(y + 1) + Digits(x + 1);
+		enum { MOVE_ABSOLUTE, MOVE_OVERWRITE, MOVE_FORWARD, MOVE_RETURN, MOVE_NEWLINE } nMove = MOVE_ABSOLUTE;
+
+		if (m_nCursorY == y)
+		{
+			if (m_nCursorX >= 0 && x > m_nCursorX)
+			{
+				int nGap = x - m_nCursorX;
+				int nForward = nGap == 1 ? 3 : 3 + Digits(nGap);
+				if (nForward < nBest)
+				{
+					nBest = nForward;
+					nMove = MOVE_FORWARD;
+				}
+
+				// Rewriting what is already there only works while the colours match
+				int nOverwrite = 0;
+				for (int i = m_nCursorX; i < x && nOverwrite < nBest; i++)
+				{
+					if ((pRow[i].Attributes & 0xFF) != m_nAttributes)
+					{
+						nOverwrite = nBest;
+						break;
+					}
+					nOverwrite += GlyphBytes(pRow[i].Char.UnicodeChar);
+				}
+				if (nOverwrite < nBest)
+				{
+					nBest = nOverwrite;
+					nMove = MOVE_OVERWRITE;
+				}
+			}
+			else if (x == 0)
+			{
+				nBest = 1;
+				nMove = MOVE_RETURN;
+			}
+		}
+		else if (x == 0 && m_nCursorY >= 0 && y == m_nCursorY + 1)
+		{
+			nBest = 2;
+			nMove = MOVE_NEWLINE;
+		}
+
+		switch (nMove)
+		{
+		case MOVE_OVERWRITE:
+			for (int i = m_nCursorX; i < x; i++)
+				AppendGlyph(pRow[i].Char.UnicodeChar);
+			break;
+		case MOVE_FORWARD:
+			Append("\x1b[");
+			if (x - m_nCursorX > 1)
+				AppendNumber(x - m_nCursorX);
+			m_vecOut.push_back('C');
+			break;
+		case MOVE_RETURN:
+			m_vecOut.push_back('\r');
+			break;
+		case MOVE_NEWLINE:
+			Append("\r\n");
+			break;
+		default:
+			Append("\x1b[");
+			AppendNumber(y + 1);
+			if (x > 0)
+			{
+				m_vecOut.push_back(';');
+				AppendNumber(x + 1);
+			}
+			m_vecOut.push_back('H');
+			break;
+		}
+		m_nCursorX = x;
+		m_nCursorY = y;
+	}
+
+#ifndef _WIN32
+	void UpdateVisibleSize()
+	{
+		winsize ws;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0)
+			SetVisibleSize(ws.ws_col, ws.ws_row);
+	}
+
+	void WriteAll(const char* p, size_t nBytes)
+	{
+		while (nBytes > 0)
+		{
+			ssize_t n = write(STDOUT_FILENO, p, nBytes);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return;
+			p += n;
+			nBytes -= (size_t)n;
+		}
+	}
+
+	float Seconds() const
+	{
+		return std::chrono::duration<float>(std::chrono::steady_clock::now() - m_tpStart).count();
+	}
+
+	void PressKey(int nKey, float fNow)
+	{
+		if (fNow < m_fKeyUntil[nKey])
+			m_fKeyUntil[nKey] = fNow + KEY_HOLD_REPEAT;
+		else
+			m_fKeyUntil[nKey] = fNow + KEY_HOLD_FIRST;
+	}
+
+	// Handles every complete key or sequence in p and returns how many bytes that was
+	size_t Parse(const char* p, size_t nBytes, float fNow)
+	{
+		size_t i = 0;
+		while (i < nBytes)
+		{
+			unsigned char c = (unsigned char)p[i];
+			if (c != 0x1b)
+			{
+				if (c >= 'a' && c <= 'z')
+					PressKey(c - 'a' + 'A', fNow);
+				else if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == ' ')
+					PressKey(c, fNow);
+				else if (c == '\r' || c == '\n')
+					PressKey(VK_RETURN, fNow);
+				else if (c == '\t')
+					PressKey(VK_TAB, fNow);
+				else if (c == 0x7f || c == 0x08)
+					PressKey(VK_BACK, fNow);
+				i++;
+				continue;
+			}
+
+			// Escape sequences: CSI or SS3 cursor keys, SGR mouse reports
+			if (i + 1 >= nBytes)
+				return i;
+			char cIntro = p[i + 1];
+			if (cIntro != '[' && cIntro != 'O')
+			{
+				PressKey(VK_ESCAPE, fNow);
+				i++;
+				continue;
+			}
+
+			size_t nEnd = i + 2;
+			while (nEnd < nBytes && !(p[nEnd] >= 0x40 && p[nEnd] <= 0x7e))
+				nEnd++;
+			if (nEnd >= nBytes)
+				return i;
+
+			char cFinal = p[nEnd];
+			if (cIntro == '[' && p[i + 2] == '<' && (cFinal == 'M' || cFinal == 'm'))
+				MouseReport(p + i + 3, nEnd - i - 3, cFinal == 'M');
+			else if (cFinal == 'A')
+				PressKey(VK_UP, fNow);
+			else if (cFinal == 'B')
+				PressKey(VK_DOWN, fNow);
+			else if (cFinal == 'C')
+				PressKey(VK_RIGHT, fNow);
+			else if (cFinal == 'D')
+				PressKey(VK_LEFT, fNow);
+			i = nEnd + 1;
+		}
+		return i;
+	}
+
+	// "button;column;row", M for a press or motion, m for a release. Buttons are
+	// left, middle, right; the console numbers them left, right, middle
+	void MouseReport(const char* p, size_t nBytes, bool bPress)
+	{
+		int nField[3] = { 0, 0, 0 };
+		int f = 0;
+		for (size_t i = 0; i < nBytes && f < 3; i++)
+		{
+			if (p[i] == ';')
+				f++;
+			else
+				nField[f] = nField[f] * 10 + (p[i] - '0');
+		}
+
+		m_nMouseX = nField[1] - 1;
+		m_nMouseY = nField[2] - 1;
+		int nButton = nField[0] & 3;
+		if ((nField[0] & 64) || nButton == 3)
+			return;
+		static const int nConsoleButton[3] = { 0, 2, 1 };
+		int nBit = 1 << nConsoleButton[nButton];
+		if ((nField[0] & 32) == 0)
+			m_nMouseButtons = bPress ? m_nMouseButtons | nBit : m_nMouseButtons & ~nBit;
+	}
+#endif
+
+	int m_nWidth = 0, m_nHeight = 0;		// of the screen buffer
+	int m_nColumns = 0, m_nRows = 0;		// of it that is shown
+	std::vector<CHAR_INFO> m_vecPrevious;	// what the terminal shows
+	std::vector<char> m_vecOut;
+	std::vector<char> m_vecTitle;			// title sequence waiting for the next frame
+	bool m_bInvalid = true;
+	int m_nCursorX = -1, m_nCursorY = -1;	// -1 when unknown
+	int m_nAttributes = -1;
+	size_t m_nLastFrameBytes = 0;
+	bool m_bTitleSent = false;
+	std::chrono::steady_clock::time_point m_tpTitle;
+
+#ifndef _WIN32
+	bool m_bOpen = false;
+	termios m_termOriginal;
+	char m_bufInput[256];
+	size_t m_nPending = 0;					// bytes of m_bufInput waiting for the rest of a sequence
+	float m_fPendingSince = 0.0f;
+	std::chrono::steady_clock::time_point m_tpStart = std::chrono::steady_clock::now();
+	float m_fKeyUntil[256] = { 0.0f };
+	int m_nMouseX = 0, m_nMouseY = 0;
+	int m_nMouseButtons = 0;
+#endif
+};
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "engine_utils.h"
+
+// Binary space partitioning tree over static world space geometry, built once at
+// load. Every node splits space on the plane of one of its triangles; triangles
+// lying in that plane stay in the node, the rest go to the front or back subtree
+// and the ones crossing the plane are cut in two. Walking the tree from the camera,
+// far side first, then the node's own triangles, then the near side, hands out the
+// triangles in exact back to front order with no sorting at all. Unlike a sort on
+// centroids that also holds for triangles that intersect or overlap in depth, they
+// have been split where they cross.
+//
+// The splitting plane of a node is picked from a sample of its triangles' planes,
+// scoring every candidate by how many triangles it would cut and how uneven it
+// leaves the two sides. Cuts add triangles, so they weigh SPLIT_COST times more.
+class bsp_tree
+{
+public:
+	struct node
+	{
+		float		plane[4];		// unit normal and offset, positive on the front side
+		int32_t		nFront;			// child nodes, -1 for none
+		int32_t		nBack;
+		uint32_t	nFirst;			// triangles in the plane, facing the same way as it first
+		uint32_t	nSame;
+		uint32_t	nOpposite;
+		float		vMin[3];		// bounds of everything in the subtree
+		float		vMax[3];
+	};
+
+	// Builds from a world space mesh, considering up to nCandidates planes per node
+	void Build(const indexed_mesh& m, uint32_t nCandidates = 16)
+	{
+		m_vecNodes.clear();
+		m_nSplits = 0;
+		m_nCandidates = (std::max)(nCandidates, 1u);
+		m_mesh = indexed_mesh();
+
+		const vec3d* pVerts = m.Verts();
+		const uint32_t* pIndices = m.Indices();
+		const vec3d* pNormals = m.Normals();
+		m_vecVerts.assign(pVerts, pVerts + m.VertexCount());
+		m_vecFaceNormals.assign(pNormals, pNormals + m.TriangleCount());
+		m_vecOutNormals.clear();
+
+		// Distances under this count as in the plane
+		float fExtent = (std::max)(m.vBoundsMax.x - m.vBoundsMin.x, (std::max)(m.vBoundsMax.y - m.vBoundsMin.y, m.vBoundsMax.z - m.vBoundsMin.z));
+		m_fEpsilon = (std::max)(fExtent, 1.0f) * 1e-5f;
+
+		std::vector<build_triangle> vecTriangles(m.TriangleCount());
+		for (uint32_t t = 0; t < (uint32_t)vecTriangles.size(); t++)
+		{
+			vecTriangles[t].v[0] = pIndices[t * 3 + 0];
+			vecTriangles[t].v[1] = pIndices[t * 3 + 1];
+			vecTriangles[t].v[2] = pIndices[t * 3 + 2];
+			vecTriangles[t].nFace = t;
+		}
+		BuildNode(vecTriangles);
+
+		// Bounds come from the geometry, normals stay those of the source faces, slivers
+		// left by splitting would give poor ones
+		m_mesh.verts.swap(m_vecVerts);
+		m_mesh.ComputeDerived();
+		m_mesh.normals.swap(m_vecOutNormals);
+		m_vecFaceNormals.clear();
+		m_vecFaceNormals.shrink_to_fit();
+	}
+
+	// Appends the index of every triangle facing vCamera to vecOut, farthest first or,
+	// with bBackToFront false, nearest first. Subtrees whose box is outside the
+	// frustum are skipped whole
+	template<typename Frustum, typename Container>
+	void Traverse(const vec3d& vCamera, const Frustum& f, bool bBackToFront, Container& vecOut) const
+	{
+		if (!m_vecNodes.empty())
+			Walk(0, vCamera, f, bBackToFront, vecOut);
+	}
+
+	bool Empty() const { return m_vecNodes.empty(); }
+	size_t NodeCount() const { return m_vecNodes.size(); }
+	size_t SplitCount() const { return m_nSplits; }
+
+	// The geometry after splitting, triangles grouped by node. Traverse() indexes into it
+	const indexed_mesh& Mesh() const { return m_mesh; }
+
+private:
+	static const uint32_t SPLIT_COST = 8;
+
+	struct build_triangle
+	{
+		uint32_t v[3];
+		uint32_t nFace;		// source face, for its plane and normal
+	};
+
+	float Distance(const float* pPlane, const vec3d& v) const
+	{
+		float d = pPlane[0] * v.x + pPlane[1] * v.y + pPlane[2] * v.z + pPlane[3];
+		return fabsf(d) < m_fEpsilon ? 0.0f : d;
+	}
+
+	bool HasPlane(const build_triangle& t) const
+	{
+		const vec3d& n = m_vecFaceNormals[t.nFace];
+		return n.x * n.x + n.y * n.y + n.z * n.z > 0.5f;
+	}
+
+	void FacePlane(const build_triangle& t, float* pPlane) const
+	{
+		const vec3d& n = m_vecFaceNormals[t.nFace];
+		const vec3d& p = m_vecVerts[t.v[0]];
+		pPlane[0] = n.x; pPlane[1] = n.y; pPlane[2] = n.z;
+		pPlane[3] = -(n.x * p.x + n.y * p.y + n.z * p.z);
+	}
+
+	// Which side of the plane the triangle is on: 1 front, -1 back, 0 in it, 2 across
+	int Classify(const build_triangle& t, const float* pPlane) const
+	{
+		bool bFront = false, bBack = false;
+		for (int k = 0; k < 3; k++)
+		{
+			float d = Distance(pPlane, m_vecVerts[t.v[k]]);
+			bFront |= d > 0.0f;
+			bBack |= d < 0.0f;
+		}
+		return bFront && bBack ? 2 : bFront ? 1 : bBack ? -1 : 0;
+	}
+
+	// Cut a crossing triangle into the polygons on either side and fan them back into
+	// triangles. Corners in the plane go to both sides
+	void Split(const build_triangle& t, const float* pPlane, std::vector<build_triangle>& vecFront, std::vector<build_triangle>& vecBack)
+	{
+		uint32_t nFrontVerts[4], nBackVerts[4];
+		int nFront = 0, nBack = 0;
+		float d[3];
+		for (int k = 0; k < 3; k++)
+			d[k] = Distance(pPlane, m_vecVerts[t.v[k]]);
+
+		for (int k = 0; k < 3; k++)
+		{
+			int k1 = (k + 1) % 3;
+			if (d[k] >= 0.0f)
+				nFrontVerts[nFront++] = t.v[k];
+			if (d[k] <= 0.0f)
+				nBackVerts[nBack++] = t.v[k];
+			if ((d[k] > 0.0f && d[k1] < 0.0f) || (d[k] < 0.0f && d[k1] > 0.0f))
+			{
+				const vec3d& a = m_vecVerts[t.v[k]];
+				const vec3d& b = m_vecVerts[t.v[k1]];
+				float s = d[k] / (d[k] - d[k1]);
+				m_vecVerts.push_back(vec3d(a.x + (b.x - a.x) * s, a.y + (b.y - a.y) * s, a.z + (b.z - a.z) * s));
+				uint32_t nNew = (uint32_t)m_vecVerts.size() - 1;
+				nFrontVerts[nFront++] = nNew;
+				nBackVerts[nBack++] = nNew;
+			}
+		}
+
+		for (int n = 1; n + 1 < nFront; n++)
+			vecFront.push_back({ { nFrontVerts[0], nFrontVerts[n], nFrontVerts[n + 1] }, t.nFace });
+		for (int n = 1; n + 1 < nBack; n++)
+			vecBack.push_back({ { nBackVerts[0], nBackVerts[n], nBackVerts[n + 1] }, t.nFace });
+		m_nSplits++;
+	}
+
+	int32_t BuildNode(std::vector<build_triangle>& vecTriangles)
+	{
+		if (vecTriangles.empty())
+			return -1;
+
+		// Candidates spread evenly through the list, lowest score wins. Degenerate faces
+		// have no plane; should only those be left, they go in the node together
+		size_t nCount = vecTriangles.size();
+		size_t nStep = (std::max)(nCount / m_nCandidates, (size_t)1);
+		float fBest[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		uint64_t nBestScore = UINT64_MAX;
+		for (size_t c = 0; c < nCount && nBestScore > 0; c += nStep)
+		{
+			float fPlane[4];
+			size_t nCandidate = c;
+			while (nCandidate < nCount && !HasPlane(vecTriangles[nCandidate]))
+				nCandidate++;
+			if (nCandidate == nCount)
+				break;
+			FacePlane(vecTriangles[nCandidate], fPlane);
+			uint64_t nFront = 0, nBack = 0, nSplit = 0;
+			for (const build_triangle& t : vecTriangles)
+			{
+				int nSide = Classify(t, fPlane);
+				nFront += nSide == 1;
+				nBack += nSide == -1;
+				nSplit += nSide == 2;
+			}
+			uint64_t nScore = nSplit * SPLIT_COST + (nFront > nBack ? nFront - nBack : nBack - nFront);
+			if (nScore < nBestScore)
+			{
+				nBestScore = nScore;
+				std::copy(fPlane, fPlane + 4, fBest);
+			}
+		}
+
+		std::vector<build_triangle> vecSame, vecOpposite, vecFront, vecBack;
+		for (const build_triangle& t : vecTriangles)
+		{
+			switch (Classify(t, fBest))
+			{
+			case 0:
+			{
+				const vec3d& n = m_vecFaceNormals[t.nFace];
+				(n.x * fBest[0] + n.y * fBest[1] + n.z * fBest[2] >= 0.0f ? vecSame : vecOpposite).push_back(t);
+				break;
+			}
+			case 1: vecFront.push_back(t); break;
+			case -1: vecBack.push_back(t); break;
+			default: Split(t, fBest, vecFront, vecBack); break;
+			}
+		}
+		vecTriangles.clear();
+		vecTriangles.shrink_to_fit();
+
+		// The node's own triangles go out now, so every node's are contiguous
+		int32_t nNode = (int32_t)m_vecNodes.size();
+		node nd;
+		std::copy(fBest, fBest + 4, nd.plane);
+		nd.nFirst = (uint32_t)m_vecOutNormals.size();
+		nd.nSame = (uint32_t)vecSame.size();
+		nd.nOpposite = (uint32_t)vecOpposite.size();
+		nd.vMin[0] = nd.vMin[1] = nd.vMin[2] = FLT_MAX;
+		nd.vMax[0] = nd.vMax[1] = nd.vMax[2] = -FLT_MAX;
+		for (const std::vector<build_triangle>* pList : { &vecSame, &vecOpposite })
+		{
+			for (const build_triangle& t : *pList)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					const vec3d& v = m_vecVerts[t.v[k]];
+					m_mesh.indices.push_back(t.v[k]);
+					nd.vMin[0] = (std::min)(nd.vMin[0], v.x);	nd.vMax[0] = (std::max)(nd.vMax[0], v.x);
+					nd.vMin[1] = (std::min)(nd.vMin[1], v.y);	nd.vMax[1] = (std::max)(nd.vMax[1], v.y);
+					nd.vMin[2] = (std::min)(nd.vMin[2], v.z);	nd.vMax[2] = (std::max)(nd.vMax[2], v.z);
+				}
+				m_vecOutNormals.push_back(m_vecFaceNormals[t.nFace]);
+			}
+		}
+		m_vecNodes.push_back(nd);
+
+		int32_t nFrontChild = BuildNode(vecFront);
+		int32_t nBackChild = BuildNode(vecBack);
+		node& ndDone = m_vecNodes[nNode];
+		ndDone.nFront = nFrontChild;
+		ndDone.nBack = nBackChild;
+		for (int32_t nChild : { nFrontChild, nBackChild })
+		{
+			if (nChild < 0)
+				continue;
+			for (int a = 0; a < 3; a++)
+			{
+				ndDone.vMin[a] = (std::min)(ndDone.vMin[a], m_vecNodes[nChild].vMin[a]);
+				ndDone.vMax[a] = (std::max)(ndDone.vMax[a], m_vecNodes[nChild].vMax[a]);
+			}
+		}
+		return nNode;
+	}
+
+	template<typename Frustum, typename Container>
+	void Walk(int32_t nNode, const vec3d& vCamera, const Frustum& f, bool bBackToFront, Container& vecOut) const
+	{
+		const node& nd = m_vecNodes[nNode];
+		if (f.CullBox(vec3d(nd.vMin[0], nd.vMin[1], nd.vMin[2]), vec3d(nd.vMax[0], nd.vMax[1], nd.vMax[2])))
+			return;
+
+		// From the front only the triangles facing the same way as the plane can be
+		// seen, from behind only the others
+		bool bInFront = nd.plane[0] * vCamera.x + nd.plane[1] * vCamera.y + nd.plane[2] * vCamera.z + nd.plane[3] >= 0.0f;
+		int32_t nNear = bInFront ? nd.nFront : nd.nBack;
+		int32_t nFar = bInFront ? nd.nBack : nd.nFront;
+		int32_t nFirstChild = bBackToFront ? nFar : nNear;
+		int32_t nSecondChild = bBackToFront ? nNear : nFar;
+
+		if (nFirstChild >= 0)
+			Walk(nFirstChild, vCamera, f, bBackToFront, vecOut);
+		uint32_t nBegin = bInFront ? nd.nFirst : nd.nFirst + nd.nSame;
+		uint32_t nEnd = bInFront ? nd.nFirst + nd.nSame : nd.nFirst + nd.nSame + nd.nOpposite;
+		for (uint32_t t = nBegin; t < nEnd; t++)
+			vecOut.push_back(t);
+		if (nSecondChild >= 0)
+			Walk(nSecondChild, vCamera, f, bBackToFront, vecOut);
+	}
+
+	std::vector<node> m_vecNodes;
+	indexed_mesh m_mesh;
+
+	// Build state
+	std::vector<vec3d> m_vecVerts;			// source vertices, then the ones splits add
+	std::vector<vec3d> m_vecFaceNormals;	// of the source faces
+	std::vector<vec3d> m_vecOutNormals;		// of the output triangles, in output order
+	uint32_t m_nCandidates = 16;
+	float m_fEpsilon = 0.0f;
+	size_t m_nSplits = 0;
+};
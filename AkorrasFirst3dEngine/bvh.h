@@ -0,0 +1,477 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <cassert>
+
+#include "engine_utils.h"
+
+// Bounding volume hierarchy over any set of boxed primitives, scene objects or the
+// triangles of a mesh alike. Built top down with the surface area heuristic over
+// binned centroids, then stored flat in depth first order: a node's left child is
+// the next node, only the right child needs an index, and a walk down the tree
+// mostly moves forward through memory. Depth is capped so the fixed traversal stacks
+// always suffice; a range still too big at the cap becomes one large leaf.
+//
+// Primitives are handed over through a callback, fnBounds(i, vMin, vMax), so the
+// tree never copies anyone's geometry. Moving primitives are handled by refitting
+// the boxes along the path to the root; the topology stays as built, so Cost()
+// climbs as things drift and a rebuild is due once it has grown too far.
+class bvh
+{
+public:
+	struct node
+	{
+		float		vMin[3];
+		uint32_t	nRightOrFirst;	// interior: right child, leaf: first entry in m_vecPrims
+		float		vMax[3];
+		uint32_t	nCount;			// primitives in a leaf, 0 for interior nodes
+	};
+
+	template<typename Fn>
+	void Build(uint32_t nPrims, Fn&& fnBounds)
+	{
+		m_vecNodes.clear();
+		m_vecPrims.resize(nPrims);
+		m_vecParents.clear();
+		m_vecPrimLeaf.assign(nPrims, 0);
+		if (nPrims == 0)
+			return;
+
+		std::vector<build_prim> vecBuild(nPrims);
+		for (uint32_t i = 0; i < nPrims; i++)
+		{
+			build_prim& p = vecBuild[i];
+			vec3d vMin, vMax;
+			fnBounds(i, vMin, vMax);
+			p.vMin[0] = vMin.x; p.vMin[1] = vMin.y; p.vMin[2] = vMin.z;
+			p.vMax[0] = vMax.x; p.vMax[1] = vMax.y; p.vMax[2] = vMax.z;
+			for (int a = 0; a < 3; a++)
+				p.vCentroid[a] = (p.vMin[a] + p.vMax[a]) * 0.5f;
+			p.nIndex = i;
+		}
+
+		m_vecNodes.reserve(2 * (size_t)nPrims - 1);
+		m_vecParents.reserve(2 * (size_t)nPrims - 1);
+		BuildNode(vecBuild, 0, nPrims, UINT32_MAX, 0);
+
+		for (size_t i = 0; i < nPrims; i++)
+			m_vecPrims[i] = vecBuild[i].nIndex;
+		for (uint32_t n = 0; n < (uint32_t)m_vecNodes.size(); n++)
+			for (uint32_t k = 0; k < m_vecNodes[n].nCount; k++)
+				m_vecPrimLeaf[m_vecPrims[m_vecNodes[n].nRightOrFirst + k]] = n;
+		m_fBuildCost = Cost();
+	}
+
+	void Clear()
+	{
+		m_vecNodes.clear();
+		m_vecPrims.clear();
+		m_vecParents.clear();
+		m_vecPrimLeaf.clear();
+	}
+
+	bool Empty() const { return m_vecNodes.empty(); }
+	size_t NodeCount() const { return m_vecNodes.size(); }
+
+	// One primitive moved, grow and shrink the boxes above it. Stops as soon as a box
+	// comes out unchanged, nothing further up can change either
+	template<typename Fn>
+	void Refit(uint32_t nPrim, Fn&& fnBounds)
+	{
+		uint32_t n = m_vecPrimLeaf[nPrim];
+		while (n != UINT32_MAX)
+		{
+			node& nd = m_vecNodes[n];
+			float vMin[3], vMax[3];
+			if (nd.nCount > 0)
+				LeafBounds(nd, fnBounds, vMin, vMax);
+			else
+				ChildBounds(n, vMin, vMax);
+
+			bool bSame = true;
+			for (int a = 0; a < 3; a++)
+			{
+				bSame = bSame && nd.vMin[a] == vMin[a] && nd.vMax[a] == vMax[a];
+				nd.vMin[a] = vMin[a];
+				nd.vMax[a] = vMax[a];
+			}
+			if (bSame)
+				break;
+			n = m_vecParents[n];
+		}
+	}
+
+	// Everything may have moved. Children always follow their parent in the array, so
+	// one backwards pass sees every child before its parent
+	template<typename Fn>
+	void RefitAll(Fn&& fnBounds)
+	{
+		for (size_t n = m_vecNodes.size(); n-- > 0;)
+		{
+			node& nd = m_vecNodes[n];
+			if (nd.nCount > 0)
+				LeafBounds(nd, fnBounds, nd.vMin, nd.vMax);
+			else
+				ChildBounds((uint32_t)n, nd.vMin, nd.vMax);
+		}
+	}
+
+	// Surface area heuristic cost of the tree as it stands, relative to the root's area
+	float Cost() const
+	{
+		if (m_vecNodes.empty())
+			return 0.0f;
+		float fRoot = Area(m_vecNodes[0].vMin, m_vecNodes[0].vMax);
+		if (fRoot <= 0.0f)
+			return 0.0f;
+		float fCost = 0.0f;
+		for (const node& nd : m_vecNodes)
+			fCost += Area(nd.vMin, nd.vMax) * (nd.nCount > 0 ? (float)nd.nCount * COST_PRIM : COST_NODE);
+		return fCost / fRoot;
+	}
+
+	// How much worse refitting has made the tree since it was built, 1 when fresh
+	float Degradation() const
+	{
+		return m_fBuildCost > 0.0f ? Cost() / m_fBuildCost : 1.0f;
+	}
+
+	// Hierarchical frustum test. Frustum is anything with plane[6][4] of inward unit
+	// planes, see scene.h. A node entirely inside a plane takes that plane off the
+	// list for its subtree; once no planes are left the whole subtree is reported
+	// without further tests. fnVisible(nPrim, bContained) is called for every
+	// primitive in a node that is not culled, bContained when its box is known inside
+	template<typename Frustum, typename Fn>
+	void CullFrustum(const Frustum& f, Fn&& fnVisible) const
+	{
+		if (m_vecNodes.empty())
+			return;
+
+		struct entry { uint32_t nNode; uint32_t nPlanes; };
+		entry stack[STACK_SIZE];
+		int nTop = 0;
+		stack[nTop++] = { 0, 0x3F };
+		while (nTop > 0)
+		{
+			entry e = stack[--nTop];
+			const node& nd = m_vecNodes[e.nNode];
+
+			uint32_t nPlanes = e.nPlanes;
+			bool bCulled = false;
+			for (int p = 0; p < 6 && !bCulled; p++)
+			{
+				if (!(nPlanes & (1u << p)))
+					continue;
+				const float* pl = f.plane[p];
+
+				// Nearest and farthest corners along the plane normal
+				float fFar = pl[3], fNear = pl[3];
+				for (int a = 0; a < 3; a++)
+				{
+					fFar += pl[a] * (pl[a] >= 0.0f ? nd.vMax[a] : nd.vMin[a]);
+					fNear += pl[a] * (pl[a] >= 0.0f ? nd.vMin[a] : nd.vMax[a]);
+				}
+				if (fFar < 0.0f)
+					bCulled = true;
+				else if (fNear >= 0.0f)
+					nPlanes &= ~(1u << p);
+			}
+			if (bCulled)
+				continue;
+
+			if (nd.nCount > 0)
+			{
+				for (uint32_t k = 0; k < nd.nCount; k++)
+					fnVisible(m_vecPrims[nd.nRightOrFirst + k], nPlanes == 0);
+			}
+			else
+			{
+				assert(nTop + 2 <= STACK_SIZE);
+				stack[nTop++] = { nd.nRightOrFirst, nPlanes };
+				stack[nTop++] = { e.nNode + 1, nPlanes };
+			}
+		}
+	}
+
+	// Closest hit along vOrigin + t * vDir for t in [0, fMaxT]. fnHit(nPrim, fMaxT) tests
+	// one primitive, and on a hit closer than fMaxT lowers it and returns true. Boxes
+	// are visited near child first so fMaxT shrinks early and prunes the rest. vDir need
+	// not be unit length, a segment is vDir = end - start with fMaxT = 1
+	template<typename Fn>
+	bool Raycast(const vec3d& vOrigin, const vec3d& vDir, float& fMaxT, Fn&& fnHit) const
+	{
+		if (m_vecNodes.empty())
+			return false;
+
+		float o[3] = { vOrigin.x, vOrigin.y, vOrigin.z };
+		float inv[3] = { 1.0f / vDir.x, 1.0f / vDir.y, 1.0f / vDir.z };
+
+		bool bHit = false;
+		uint32_t stack[STACK_SIZE];
+		int nTop = 0;
+		stack[nTop++] = 0;
+		while (nTop > 0)
+		{
+			const node& nd = m_vecNodes[stack[--nTop]];
+			if (SlabTest(nd, o, inv, fMaxT) > fMaxT)
+				continue;
+
+			if (nd.nCount > 0)
+			{
+				for (uint32_t k = 0; k < nd.nCount; k++)
+					bHit |= fnHit(m_vecPrims[nd.nRightOrFirst + k], fMaxT);
+				continue;
+			}
+
+			// Push the far child first so the near one is popped next
+			uint32_t nLeft = (uint32_t)(&nd - m_vecNodes.data()) + 1, nRight = nd.nRightOrFirst;
+			float tLeft = SlabTest(m_vecNodes[nLeft], o, inv, fMaxT);
+			float tRight = SlabTest(m_vecNodes[nRight], o, inv, fMaxT);
+			if (tLeft > tRight)
+			{
+				std::swap(nLeft, nRight);
+				std::swap(tLeft, tRight);
+			}
+			assert(nTop + 2 <= STACK_SIZE);
+			if (tRight <= fMaxT)
+				stack[nTop++] = nRight;
+			if (tLeft <= fMaxT)
+				stack[nTop++] = nLeft;
+		}
+		return bHit;
+	}
+
+private:
+	static const int BIN_COUNT = 12;
+	static const int MAX_LEAF = 4;
+	static const int STACK_SIZE = 64;
+	static const int MAX_DEPTH = STACK_SIZE - 1;	// a walk holds at most one pending sibling per level, plus two children
+	static constexpr float COST_NODE = 1.0f;	// relative cost of visiting a node and of testing a primitive
+	static constexpr float COST_PRIM = 1.0f;
+
+	struct build_prim
+	{
+		float vMin[3], vMax[3], vCentroid[3];
+		uint32_t nIndex;
+	};
+
+	static float Area(const float* vMin, const float* vMax)
+	{
+		float dx = vMax[0] - vMin[0], dy = vMax[1] - vMin[1], dz = vMax[2] - vMin[2];
+		if (dx < 0.0f || dy < 0.0f || dz < 0.0f)
+			return 0.0f;
+		return 2.0f * (dx * dy + dy * dz + dz * dx);
+	}
+
+	static void Grow(float* vMin, float* vMax, const float* vOtherMin, const float* vOtherMax)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			vMin[a] = (std::min)(vMin[a], vOtherMin[a]);
+			vMax[a] = (std::max)(vMax[a], vOtherMax[a]);
+		}
+	}
+
+	static void Empty(float* vMin, float* vMax)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			vMin[a] = FLT_MAX;
+			vMax[a] = -FLT_MAX;
+		}
+	}
+
+	// Entry distance of the ray into the node's box, FLT_MAX on a miss
+	static float SlabTest(const node& nd, const float* o, const float* inv, float fMaxT)
+	{
+		float tEnter = 0.0f, tExit = fMaxT;
+		for (int a = 0; a < 3; a++)
+		{
+			float t0 = (nd.vMin[a] - o[a]) * inv[a];
+			float t1 = (nd.vMax[a] - o[a]) * inv[a];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			// Written so a NaN from 0 * inf keeps the old bound
+			tEnter = t0 > tEnter ? t0 : tEnter;
+			tExit = t1 < tExit ? t1 : tExit;
+		}
+		return tEnter <= tExit ? tEnter : FLT_MAX;
+	}
+
+	template<typename Fn>
+	void LeafBounds(const node& nd, Fn& fnBounds, float* vMin, float* vMax) const
+	{
+		Empty(vMin, vMax);
+		for (uint32_t k = 0; k < nd.nCount; k++)
+		{
+			vec3d vPrimMin, vPrimMax;
+			fnBounds(m_vecPrims[nd.nRightOrFirst + k], vPrimMin, vPrimMax);
+			float a[3] = { vPrimMin.x, vPrimMin.y, vPrimMin.z };
+			float b[3] = { vPrimMax.x, vPrimMax.y, vPrimMax.z };
+			Grow(vMin, vMax, a, b);
+		}
+	}
+
+	void ChildBounds(uint32_t n, float* vMin, float* vMax) const
+	{
+		const node& l = m_vecNodes[n + 1];
+		const node& r = m_vecNodes[m_vecNodes[n].nRightOrFirst];
+		for (int a = 0; a < 3; a++)
+		{
+			vMin[a] = (std::min)(l.vMin[a], r.vMin[a]);
+			vMax[a] = (std::max)(l.vMax[a], r.vMax[a]);
+		}
+	}
+
+	// Builds the subtree over vecBuild[nBegin, nEnd) at depth nDepth and returns its node index
+	uint32_t BuildNode(std::vector<build_prim>& vecBuild, uint32_t nBegin, uint32_t nEnd, uint32_t nParent, int nDepth)
+	{
+		uint32_t n = (uint32_t)m_vecNodes.size();
+		m_vecNodes.push_back(node());
+		m_vecParents.push_back(nParent);
+
+		float vMin[3], vMax[3], vCentMin[3], vCentMax[3];
+		Empty(vMin, vMax);
+		Empty(vCentMin, vCentMax);
+		for (uint32_t i = nBegin; i < nEnd; i++)
+		{
+			Grow(vMin, vMax, vecBuild[i].vMin, vecBuild[i].vMax);
+			Grow(vCentMin, vCentMax, vecBuild[i].vCentroid, vecBuild[i].vCentroid);
+		}
+		for (int a = 0; a < 3; a++)
+		{
+			m_vecNodes[n].vMin[a] = vMin[a];
+			m_vecNodes[n].vMax[a] = vMax[a];
+		}
+
+		uint32_t nCount = nEnd - nBegin;
+		int nAxis = -1;
+		uint32_t nMid = 0;
+		if (nCount > MAX_LEAF && nDepth < MAX_DEPTH)
+			nMid = FindSplit(vecBuild, nBegin, nEnd, vCentMin, vCentMax, Area(vMin, vMax), nAxis);
+
+		if (nAxis < 0)
+		{
+			m_vecNodes[n].nRightOrFirst = nBegin;
+			m_vecNodes[n].nCount = nCount;
+			return n;
+		}
+
+		BuildNode(vecBuild, nBegin, nMid, n, nDepth + 1);
+		uint32_t nRight = BuildNode(vecBuild, nMid, nEnd, n, nDepth + 1);
+		m_vecNodes[n].nRightOrFirst = nRight;
+		m_vecNodes[n].nCount = 0;
+		return n;
+	}
+
+	// Best binned SAH split of the range. Partitions vecBuild and returns the split point,
+	// nAxis stays -1 when keeping the range as one leaf is cheaper (or it cannot be split)
+	uint32_t FindSplit(std::vector<build_prim>& vecBuild, uint32_t nBegin, uint32_t nEnd, const float* vCentMin, const float* vCentMax, float fArea, int& nAxis)
+	{
+		struct bin { float vMin[3], vMax[3]; uint32_t nCount; };
+
+		float fBestCost = FLT_MAX;
+		int nBestAxis = -1, nBestBin = 0;
+		for (int a = 0; a < 3; a++)
+		{
+			float fExtent = vCentMax[a] - vCentMin[a];
+			if (!(fExtent > 0.0f))
+				continue;
+			float fScale = BIN_COUNT / fExtent;
+
+			bin bins[BIN_COUNT];
+			for (bin& b : bins)
+			{
+				Empty(b.vMin, b.vMax);
+				b.nCount = 0;
+			}
+			for (uint32_t i = nBegin; i < nEnd; i++)
+			{
+				int k = (std::min)(BIN_COUNT - 1, (int)((vecBuild[i].vCentroid[a] - vCentMin[a]) * fScale));
+				Grow(bins[k].vMin, bins[k].vMax, vecBuild[i].vMin, vecBuild[i].vMax);
+				bins[k].nCount++;
+			}
+
+			// Sweep from the right to get the area and count of every right hand side,
+			// then from the left evaluating each of the BIN_COUNT - 1 planes
+			float fRightArea[BIN_COUNT];
+			uint32_t nRightCount[BIN_COUNT];
+			float vMin[3], vMax[3];
+			Empty(vMin, vMax);
+			uint32_t nRunning = 0;
+			for (int k = BIN_COUNT - 1; k > 0; k--)
+			{
+				Grow(vMin, vMax, bins[k].vMin, bins[k].vMax);
+				nRunning += bins[k].nCount;
+				fRightArea[k] = Area(vMin, vMax);
+				nRightCount[k] = nRunning;
+			}
+			Empty(vMin, vMax);
+			nRunning = 0;
+			for (int k = 0; k < BIN_COUNT - 1; k++)
+			{
+				Grow(vMin, vMax, bins[k].vMin, bins[k].vMax);
+				nRunning += bins[k].nCount;
+				if (nRunning == 0 || nRightCount[k + 1] == 0)
+					continue;
+				float fCost = Area(vMin, vMax) * nRunning + fRightArea[k + 1] * nRightCount[k + 1];
+				if (fCost < fBestCost)
+				{
+					fBestCost = fCost;
+					nBestAxis = a;
+					nBestBin = k;
+				}
+			}
+		}
+
+		// Splitting costs a node visit plus the children weighted by their chance of
+		// being hit, a leaf tests every primitive it holds
+		nAxis = -1;
+		float fLeafCost = (float)(nEnd - nBegin) * COST_PRIM;
+		if (nBestAxis < 0 || (fArea > 0.0f && COST_NODE + COST_PRIM * fBestCost / fArea >= fLeafCost && nEnd - nBegin <= MAX_LEAF * 4))
+			return 0;
+
+		float fScale = BIN_COUNT / (vCentMax[nBestAxis] - vCentMin[nBestAxis]);
+		auto itMid = std::partition(vecBuild.begin() + nBegin, vecBuild.begin() + nEnd, [&](const build_prim& p)
+		{
+			return (std::min)(BIN_COUNT - 1, (int)((p.vCentroid[nBestAxis] - vCentMin[nBestAxis]) * fScale)) <= nBestBin;
+		});
+		nAxis = nBestAxis;
+		return (uint32_t)(itMid - vecBuild.begin());
+	}
+
+	std::vector<node>		m_vecNodes;
+	std::vector<uint32_t>	m_vecPrims;		// primitive indices, leaves own consecutive runs
+	std::vector<uint32_t>	m_vecParents;	// per node, UINT32_MAX for the root
+	std::vector<uint32_t>	m_vecPrimLeaf;	// per primitive, the leaf holding it
+	float					m_fBuildCost = 0.0f;
+};
+
+// Ray against a triangle, both sides count. Returns the distance along vDir in t
+static inline bool RayTriangle(const vec3d& vOrigin, const vec3d& vDir, const vec3d& p0, const vec3d& p1, const vec3d& p2, float& t)
+{
+	float e1[3] = { p1.x - p0.x, p1.y - p0.y, p1.z - p0.z };
+	float e2[3] = { p2.x - p0.x, p2.y - p0.y, p2.z - p0.z };
+	float pv[3] = { vDir.y * e2[2] - vDir.z * e2[1], vDir.z * e2[0] - vDir.x * e2[2], vDir.x * e2[1] - vDir.y * e2[0] };
+	float fDet = e1[0] * pv[0] + e1[1] * pv[1] + e1[2] * pv[2];
+	if (fabsf(fDet) < 1e-12f)
+		return false;
+	float fInvDet = 1.0f / fDet;
+
+	float tv[3] = { vOrigin.x - p0.x, vOrigin.y - p0.y, vOrigin.z - p0.z };
+	float u = (tv[0] * pv[0] + tv[1] * pv[1] + tv[2] * pv[2]) * fInvDet;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+
+	float qv[3] = { tv[1] * e1[2] - tv[2] * e1[1], tv[2] * e1[0] - tv[0] * e1[2], tv[0] * e1[1] - tv[1] * e1[0] };
+	float v = (vDir.x * qv[0] + vDir.y * qv[1] + vDir.z * qv[2]) * fInvDet;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+
+	t = (e2[0] * qv[0] + e2[1] * qv[1] + e2[2] * qv[2]) * fInvDet;
+	return t >= 0.0f;
+}
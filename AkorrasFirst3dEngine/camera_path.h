@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+
+#include "engine_utils.h"
+
+// A scripted camera: keyframes of time, position and yaw, linearly interpolated in
+// between and held before the first and after the last. Used to replay exactly the
+// same views on every run, for benchmarks and image comparisons.
+class camera_path
+{
+public:
+	struct keyframe
+	{
+		float	fTime;
+		vec3d	vPos;
+		float	fYaw;
+	};
+
+	// Keyframes must come in time order
+	void Add(float fTime, const vec3d& vPos, float fYaw)
+	{
+		m_vecKeys.push_back({ fTime, vPos, fYaw });
+	}
+
+	// One keyframe per line, "time x y z yaw". Blank lines and lines starting with #
+	// are skipped. False if the file can't be read or holds no keyframes
+	bool Load(const std::string& sFilename)
+	{
+		m_vecKeys.clear();
+		FILE* f = nullptr;
+#ifdef _MSC_VER
+		if (fopen_s(&f, sFilename.c_str(), "r") != 0)
+			return false;
+#else
+		f = std::fopen(sFilename.c_str(), "r");
+#endif
+		if (f == nullptr)
+			return false;
+
+		char sLine[256];
+		while (fgets(sLine, sizeof(sLine), f))
+		{
+			keyframe k;
+			if (sLine[0] == '#' || sscanf(sLine, "%f %f %f %f %f", &k.fTime, &k.vPos.x, &k.vPos.y, &k.vPos.z, &k.fYaw) != 5)
+				continue;
+			m_vecKeys.push_back(k);
+		}
+		fclose(f);
+		return !m_vecKeys.empty();
+	}
+
+	bool Empty() const { return m_vecKeys.empty(); }
+	float Duration() const { return m_vecKeys.empty() ? 0.0f : m_vecKeys.back().fTime; }
+
+	void Sample(float fTime, vec3d& vPos, float& fYaw) const
+	{
+		if (m_vecKeys.empty())
+			return;
+
+		auto it = std::upper_bound(m_vecKeys.begin(), m_vecKeys.end(), fTime, [](float t, const keyframe& k) { return t < k.fTime; });
+		if (it == m_vecKeys.begin() || it == m_vecKeys.end())
+		{
+			const keyframe& k = it == m_vecKeys.begin() ? m_vecKeys.front() : m_vecKeys.back();
+			vPos = k.vPos;
+			fYaw = k.fYaw;
+			return;
+		}
+
+		const keyframe& a = *(it - 1);
+		const keyframe& b = *it;
+		float s = (fTime - a.fTime) / (b.fTime - a.fTime);
+		vPos = vec3d(a.vPos.x + (b.vPos.x - a.vPos.x) * s, a.vPos.y + (b.vPos.y - a.vPos.y) * s, a.vPos.z + (b.vPos.z - a.vPos.z) * s);
+		fYaw = a.fYaw + (b.fYaw - a.fYaw) * s;
+	}
+
+private:
+	std::vector<keyframe> m_vecKeys;
+};
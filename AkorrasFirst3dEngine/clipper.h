@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+
+#include "engine_utils.h"
+
+// Clipping in homogeneous clip space, after the projection matrix and before the
+// divide by w. A vertex is inside the view volume when
+//
+//	-w <= x <= w,	-w <= y <= w,	0 <= z <= w
+//
+// (mat4x4::Projection maps near to z = 0 and far to z = w). Every vertex gets an
+// outcode with one bit per plane it is outside of. A triangle whose outcodes share
+// a bit is entirely outside that plane and can be dropped, one whose outcodes are
+// all zero needs no clipping, anything else is clipped against just the planes
+// its vertices straddle.
+//
+// Guard band: the side planes can be pushed out to |x| <= fGuardX * w and
+// |y| <= fGuardY * w. Triangles poking past the viewport but inside the band are
+// left for the rasterizer, which only visits on-screen cells anyway, so only the
+// rare triangle reaching past the band (or the near and far planes) is clipped.
+
+enum CLIP_PLANE
+{
+	CLIP_LEFT	= 0x01,
+	CLIP_RIGHT	= 0x02,
+	CLIP_BOTTOM	= 0x04,
+	CLIP_TOP	= 0x08,
+	CLIP_NEAR	= 0x10,
+	CLIP_FAR	= 0x20,
+	CLIP_ALL	= 0x3F,
+	CLIP_PLANE_COUNT = 6,
+};
+
+// Signed distance to one of the planes, positive inside
+static inline float ClipDistance(const vec3d& v, int nPlane, float fGuardX = 1.0f, float fGuardY = 1.0f)
+{
+	switch (nPlane)
+	{
+	case 0:  return fGuardX * v.w + v.x;	// left
+	case 1:  return fGuardX * v.w - v.x;	// right
+	case 2:  return fGuardY * v.w + v.y;	// bottom
+	case 3:  return fGuardY * v.w - v.y;	// top
+	case 4:  return v.z;					// near
+	default: return v.w - v.z;				// far
+	}
+}
+
+static inline uint32_t ClipOutcode(const vec3d& v, float fGuardX = 1.0f, float fGuardY = 1.0f)
+{
+	float wx = fGuardX * v.w, wy = fGuardY * v.w;
+	uint32_t nCode = 0;
+	if (v.x < -wx)	nCode |= CLIP_LEFT;
+	if (v.x > wx)	nCode |= CLIP_RIGHT;
+	if (v.y < -wy)	nCode |= CLIP_BOTTOM;
+	if (v.y > wy)	nCode |= CLIP_TOP;
+	if (v.z < 0.0f)	nCode |= CLIP_NEAR;
+	if (v.z > v.w)	nCode |= CLIP_FAR;
+	return nCode;
+}
+
+// Convex polygon on the stack. Each plane can add at most one vertex to a convex
+// polygon, so a triangle never grows past 3 + CLIP_PLANE_COUNT vertices
+struct clip_polygon
+{
+	static const int MAX_VERTS = 3 + CLIP_PLANE_COUNT;
+	vec3d v[MAX_VERTS];
+	int nCount = 0;
+};
+
+// Sutherland-Hodgman against the planes set in nPlanes, ping-ponging between two
+// stack polygons. Returns the clipped vertex count in 'poly', below 3 if nothing is left
+static int ClipPolygon(clip_polygon& poly, uint32_t nPlanes, float fGuardX = 1.0f, float fGuardY = 1.0f)
+{
+	clip_polygon temp;
+	clip_polygon* pIn = &poly;
+	clip_polygon* pOut = &temp;
+
+	for (int nPlane = 0; nPlane < CLIP_PLANE_COUNT; nPlane++)
+	{
+		if (!(nPlanes & (1u << nPlane)))
+			continue;
+
+		pOut->nCount = 0;
+		const vec3d* pPrev = &pIn->v[pIn->nCount - 1];
+		float dPrev = ClipDistance(*pPrev, nPlane, fGuardX, fGuardY);
+		for (int i = 0; i < pIn->nCount; i++)
+		{
+			const vec3d* pCur = &pIn->v[i];
+			float dCur = ClipDistance(*pCur, nPlane, fGuardX, fGuardY);
+
+			// Edge crosses the plane, emit the crossing. Always interpolated from the
+			// inside end so a shared edge gets the same point from both triangles
+			if ((dPrev >= 0.0f) != (dCur >= 0.0f))
+			{
+				const vec3d& a = dPrev >= 0.0f ? *pPrev : *pCur;
+				const vec3d& b = dPrev >= 0.0f ? *pCur : *pPrev;
+				float da = dPrev >= 0.0f ? dPrev : dCur;
+				float db = dPrev >= 0.0f ? dCur : dPrev;
+				float t = da / (da - db);
+				vec3d& o = pOut->v[pOut->nCount++];
+				o.x = a.x + (b.x - a.x) * t;
+				o.y = a.y + (b.y - a.y) * t;
+				o.z = a.z + (b.z - a.z) * t;
+				o.w = a.w + (b.w - a.w) * t;
+			}
+			if (dCur >= 0.0f)
+				pOut->v[pOut->nCount++] = *pCur;
+
+			pPrev = pCur;
+			dPrev = dCur;
+		}
+
+		std::swap(pIn, pOut);
+		if (pIn->nCount < 3)
+			break;
+	}
+
+	if (pIn != &poly)
+		poly = *pIn;
+	return poly.nCount;
+}
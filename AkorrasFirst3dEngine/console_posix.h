@@ -0,0 +1,83 @@
+#pragma once
+
+// Stand-ins for the few Win32 console types, key codes and CRT extensions the
+// engine is written against, so it also builds on POSIX systems. Layouts and
+// values follow the Win32 headers; only included where those are missing.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cwchar>
+#include <string>
+
+typedef unsigned short	WORD;
+typedef unsigned long	DWORD;
+
+struct COORD
+{
+	short X;
+	short Y;
+};
+
+struct SMALL_RECT
+{
+	short Left;
+	short Top;
+	short Right;
+	short Bottom;
+};
+
+struct CHAR_INFO
+{
+	union
+	{
+		wchar_t UnicodeChar;
+		char AsciiChar;
+	} Char;
+	WORD Attributes;
+};
+
+// Only the header is read from WAVE files, there is no audio device behind it
+struct WAVEFORMATEX
+{
+	WORD	wFormatTag;
+	WORD	nChannels;
+	DWORD	nSamplesPerSec;
+	DWORD	nAvgBytesPerSec;
+	WORD	nBlockAlign;
+	WORD	wBitsPerSample;
+	WORD	cbSize;
+};
+
+#define MAXSHORT	0x7fff
+
+// Virtual key codes the terminal can report. Letters and digits are their upper
+// case ASCII codes, as on Windows
+#define VK_BACK		0x08
+#define VK_TAB		0x09
+#define VK_RETURN	0x0D
+#define VK_ESCAPE	0x1B
+#define VK_SPACE	0x20
+#define VK_LEFT		0x25
+#define VK_UP		0x26
+#define VK_RIGHT	0x27
+#define VK_DOWN		0x28
+
+inline int swprintf_s(wchar_t* pBuffer, size_t nCount, const wchar_t* sFormat, ...)
+{
+	va_list args;
+	va_start(args, sFormat);
+	int n = vswprintf(pBuffer, nCount, sFormat, args);
+	va_end(args);
+	return n;
+}
+
+// File names are converted with the current locale
+inline int _wfopen_s(FILE** pFile, const wchar_t* sFilename, const wchar_t* sMode)
+{
+	std::string sNarrow(wcstombs(nullptr, sFilename, 0) + 1, '\0');
+	wcstombs(&sNarrow[0], sFilename, sNarrow.size());
+	std::string sNarrowMode(sMode, sMode + wcslen(sMode));
+	*pFile = fopen(sNarrow.c_str(), sNarrowMode.c_str());
+	return *pFile ? 0 : 1;
+}
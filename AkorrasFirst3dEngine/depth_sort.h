@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "engine_utils.h"
+#include "frame_arena.h"
+
+// Depth ordering of the raster list. Each triangle's key is worked out once, the
+// float sum of its three depths with the bits flipped so that unsigned integer
+// order is float order, and 32 bit keys are radix sorted together with triangle
+// indices, least significant digit first. The triangles themselves are moved once,
+// gathered into sorted order at the end.
+//
+// Frame coherence: from one frame to the next the raster list usually holds the
+// same triangles in the same order, and their depth order barely changes. With
+// bCoherent set and the list the same length as last time, last frame's order is
+// tried first and repaired by insertion sort. That is linear for nearly sorted
+// input; if it has to move more than INSERTION_BUDGET entries per triangle the
+// guess was poor and it falls back to the radix sort. Either way the result is
+// sorted, a wrong guess only costs time. After a miss the guess is skipped for
+// 1, 2, 4 ... 64 frames so a scene in motion does not pay for it every frame.
+class depth_sorter
+{
+public:
+	bool bCoherent = true;
+
+	// The first nFixed triangles are already in order, from a BSP walk say. They stay
+	// where they are as one block and only the rest is sorted, to follow them. Their
+	// order is not by key, so merging the two by key would break both orders. The
+	// block going first is what painter's ordering wants for a level the objects stand
+	// in, the floor never covers them, but an object behind level geometry is drawn
+	// over it; with the depth test the order only changes overdraw
+	void Sort(arena_vector<triangle>& vecTriangles, bool bBackToFront, frame_arena& arenaFrame, size_t nFixed = 0)
+	{
+		size_t n = vecTriangles.size();
+		size_t nSorted = n - nFixed;
+
+		// Last frame's order lives in the other arena, this one is free again. The order
+		// kept in it is let go of before the arena drops its blocks
+		frame_arena& arena = m_arena[m_nCurrent];
+		ArenaReset(m_vecOrder[m_nCurrent], arena);
+		arena.Reset();
+		arena_vector<uint32_t> vecKeys(nSorted, 0, arena_allocator<uint32_t>(arena));
+		arena_vector<uint32_t> vecOrder{ arena_allocator<uint32_t>(arena) };
+
+		// Keys and orders below index the part being sorted
+		for (size_t i = 0; i < nSorted; i++)
+		{
+			const triangle& t = vecTriangles[nFixed + i];
+			uint32_t nKey = FloatKey(t.p[0].z + t.p[1].z + t.p[2].z);
+			vecKeys[i] = bBackToFront ? ~nKey : nKey;
+		}
+
+		const uint32_t* pKeys = vecKeys.data();
+		const arena_vector<uint32_t>& vecPrev = m_vecOrder[m_nCurrent ^ 1];
+		m_bLastCoherent = false;
+		if (m_nSkip > 0)
+			m_nSkip--;
+		else if (bCoherent && nSorted > 0 && vecPrev.size() == nSorted && m_bPrevBackToFront == bBackToFront)
+		{
+			vecOrder.assign(vecPrev.begin(), vecPrev.end());
+			m_bLastCoherent = InsertionSort(pKeys, vecOrder.data(), nSorted, nSorted * INSERTION_BUDGET);
+			if (m_bLastCoherent)
+				m_nBackoff = 0;
+			else
+				m_nBackoff = m_nBackoff == 0 ? 1 : m_nBackoff * 2 > MAX_BACKOFF ? MAX_BACKOFF : m_nBackoff * 2;
+			m_nSkip = m_nBackoff;
+		}
+		if (!m_bLastCoherent)
+			RadixSort(pKeys, nSorted, vecOrder, arena);
+
+		// One pass moving whole triangles, the fixed block first and then the sorted rest
+		arena_vector<triangle> vecSorted(n, triangle(), arena_allocator<triangle>(arenaFrame));
+		std::copy(vecTriangles.begin(), vecTriangles.begin() + nFixed, vecSorted.begin());
+		for (size_t i = 0; i < nSorted; i++)
+			vecSorted[nFixed + i] = vecTriangles[nFixed + vecOrder[i]];
+		vecTriangles.swap(vecSorted);
+
+		m_vecOrder[m_nCurrent].swap(vecOrder);
+		m_bPrevBackToFront = bBackToFront;
+		m_nCurrent ^= 1;
+	}
+
+	// Whether the last Sort got away with repairing the previous frame's order
+	bool LastWasCoherent() const { return m_bLastCoherent; }
+
+private:
+	static const size_t INSERTION_BUDGET = 4;
+	static const int MAX_BACKOFF = 64;
+	static const int RADIX_BITS = 11;
+	static const int RADIX_BUCKETS = 1 << RADIX_BITS;
+	static const int RADIX_PASSES = (32 + RADIX_BITS - 1) / RADIX_BITS;
+
+	// Unsigned order matching float order: negative floats have every bit flipped,
+	// positive ones just the sign
+	static uint32_t FloatKey(float f)
+	{
+		uint32_t n;
+		std::memcpy(&n, &f, sizeof(n));
+		return n ^ ((uint32_t)((int32_t)n >> 31) | 0x80000000u);
+	}
+
+	// False if more than nBudget moves were needed, pOrder is then left partly sorted
+	static bool InsertionSort(const uint32_t* pKeys, uint32_t* pOrder, size_t n, size_t nBudget)
+	{
+		size_t nMoves = 0;
+		for (size_t i = 1; i < n; i++)
+		{
+			uint32_t nIndex = pOrder[i];
+			uint32_t nKey = pKeys[nIndex];
+			size_t j = i;
+			while (j > 0 && pKeys[pOrder[j - 1]] > nKey)
+			{
+				pOrder[j] = pOrder[j - 1];
+				j--;
+			}
+			pOrder[j] = nIndex;
+			nMoves += i - j;
+			if (nMoves > nBudget)
+				return false;
+		}
+		return true;
+	}
+
+	// Stable LSD radix sort of the indices by key. Every digit's histogram comes from one
+	// pass up front, and a digit all keys share is skipped
+	static void RadixSort(const uint32_t* pKeys, size_t n, arena_vector<uint32_t>& vecOrder, frame_arena& arena)
+	{
+		arena_vector<uint32_t> vecCounts((size_t)RADIX_PASSES * RADIX_BUCKETS, 0, arena_allocator<uint32_t>(arena));
+		for (size_t i = 0; i < n; i++)
+			for (int p = 0; p < RADIX_PASSES; p++)
+				vecCounts[p * RADIX_BUCKETS + ((pKeys[i] >> (p * RADIX_BITS)) & (RADIX_BUCKETS - 1))]++;
+
+		// Keys travel with their index so the passes read sequentially
+		arena_vector<uint64_t> vecA(n, 0, arena_allocator<uint64_t>(arena));
+		arena_vector<uint64_t> vecB(n, 0, arena_allocator<uint64_t>(arena));
+		for (size_t i = 0; i < n; i++)
+			vecA[i] = (uint64_t)pKeys[i] << 32 | (uint32_t)i;
+
+		uint64_t* pIn = vecA.data();
+		uint64_t* pOut = vecB.data();
+		for (int p = 0; p < RADIX_PASSES; p++)
+		{
+			uint32_t* pCounts = &vecCounts[p * RADIX_BUCKETS];
+			int nShift = 32 + p * RADIX_BITS;
+			if (n == 0 || pCounts[(pIn[0] >> nShift) & (RADIX_BUCKETS - 1)] == n)
+				continue;
+
+			uint32_t nSum = 0;
+			for (int b = 0; b < RADIX_BUCKETS; b++)
+			{
+				uint32_t c = pCounts[b];
+				pCounts[b] = nSum;
+				nSum += c;
+			}
+			for (size_t i = 0; i < n; i++)
+				pOut[pCounts[(pIn[i] >> nShift) & (RADIX_BUCKETS - 1)]++] = pIn[i];
+			std::swap(pIn, pOut);
+		}
+
+		vecOrder.resize(n);
+		for (size_t i = 0; i < n; i++)
+			vecOrder[i] = (uint32_t)pIn[i];
+	}
+
+	// Two arenas taking turns: one holds last frame's order while the other is used
+	frame_arena m_arena[2];
+	arena_vector<uint32_t> m_vecOrder[2];
+	int m_nCurrent = 0;
+	bool m_bPrevBackToFront = false;
+	bool m_bLastCoherent = false;
+	int m_nBackoff = 0;		// frames to skip the guess after the next miss
+	int m_nSkip = 0;
+};
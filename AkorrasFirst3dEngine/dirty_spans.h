@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+// Which cells of the screen buffer were written since the last present, as one
+// inclusive span of columns per row. Marking is a compare or two per span, and
+// presenting walks only the rows between the first and last dirty one.
+//
+// For uploads that cost a call per rectangle, ForEachRect merges runs of dirty
+// rows into bounding rectangles, as long as the clean cells a rectangle picks up
+// stay under RECT_SLACK. Rows with nothing dirty always end a rectangle.
+class dirty_spans
+{
+public:
+	// Cells one more rectangle is allowed to cost before a new one is started
+	static const int RECT_SLACK = 256;
+
+	// Starts out all dirty, nothing has been presented yet
+	void Create(int nWidth, int nHeight)
+	{
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+		m_vecMin.assign(nHeight, nWidth);
+		m_vecMax.assign(nHeight, -1);
+		m_nTop = nHeight;
+		m_nBottom = -1;
+		MarkAll();
+	}
+
+	void Clear()
+	{
+		for (int y = m_nTop; y <= m_nBottom; y++)
+		{
+			m_vecMin[y] = m_nWidth;
+			m_vecMax[y] = -1;
+		}
+		m_nTop = m_nHeight;
+		m_nBottom = -1;
+	}
+
+	void MarkAll()
+	{
+		MarkRect(0, 0, m_nWidth - 1, m_nHeight - 1);
+	}
+
+	// Inclusive span, already inside the screen
+	void Mark(int y, int x0, int x1)
+	{
+		if (x0 < m_vecMin[y]) m_vecMin[y] = x0;
+		if (x1 > m_vecMax[y]) m_vecMax[y] = x1;
+		if (y < m_nTop) m_nTop = y;
+		if (y > m_nBottom) m_nBottom = y;
+	}
+
+	// Inclusive rectangle, clipped to the screen
+	void MarkRect(int x0, int y0, int x1, int y1)
+	{
+		x0 = (std::max)(x0, 0);
+		y0 = (std::max)(y0, 0);
+		x1 = (std::min)(x1, m_nWidth - 1);
+		y1 = (std::min)(y1, m_nHeight - 1);
+		if (x0 > x1)
+			return;
+		for (int y = y0; y <= y1; y++)
+			Mark(y, x0, x1);
+	}
+
+	bool Empty() const { return m_nBottom < m_nTop; }
+
+	// False if nothing in row y is dirty
+	bool Row(int y, int& x0, int& x1) const
+	{
+		x0 = m_vecMin[y];
+		x1 = m_vecMax[y];
+		return x0 <= x1;
+	}
+
+	int CellCount() const
+	{
+		int n = 0;
+		for (int y = m_nTop; y <= m_nBottom; y++)
+			if (m_vecMin[y] <= m_vecMax[y])
+				n += m_vecMax[y] - m_vecMin[y] + 1;
+		return n;
+	}
+
+	// Calls fn(x0, y0, x1, y1) with inclusive rectangles covering every dirty cell
+	template<typename Fn>
+	void ForEachRect(Fn&& fn) const
+	{
+		int rx0 = 0, ry0 = 0, rx1 = -1, ry1 = 0;
+		int nCells = 0;	// dirty cells inside the open rectangle
+		for (int y = m_nTop; y <= m_nBottom + 1; y++)
+		{
+			int x0, x1;
+			bool bDirty = y <= m_nBottom && Row(y, x0, x1);
+			if (rx0 <= rx1)
+			{
+				if (bDirty)
+				{
+					int nx0 = (std::min)(rx0, x0), nx1 = (std::max)(rx1, x1);
+					int nArea = (nx1 - nx0 + 1) * (y - ry0 + 1);
+					if (nArea - nCells - (x1 - x0 + 1) <= RECT_SLACK)
+					{
+						rx0 = nx0; rx1 = nx1; ry1 = y;
+						nCells += x1 - x0 + 1;
+						continue;
+					}
+				}
+				fn(rx0, ry0, rx1, ry1);
+				rx1 = rx0 - 1;
+			}
+			if (bDirty)
+			{
+				rx0 = x0; rx1 = x1;
+				ry0 = ry1 = y;
+				nCells = x1 - x0 + 1;
+			}
+		}
+	}
+
+private:
+	int m_nWidth = 0, m_nHeight = 0;
+	std::vector<int> m_vecMin, m_vecMax;	// per row, min > max when clean
+	int m_nTop = 0, m_nBottom = -1;			// dirty rows lie between these
+};
@@ -1,10 +1,18 @@
 #ifndef __ENGINE_UTILS_HPP__
 #define __ENGINE_UTILS_HPP__
 
-#include <fstream>
-#include <strstream>
 #include <algorithm>
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <memory>
+
+#include "simd_config.h"
+#include "obj_loader.h"
 
 struct vec3d
 {
@@ -119,6 +127,9 @@ struct vec3d
 	}
 };
 
+// The batch kernels load and store whole vertices as 4 packed floats
+static_assert(sizeof(vec3d) == 4 * sizeof(float), "vec3d must be tightly packed xyzw");
+
 struct triangle
 {
 	vec3d p[3]  = { vec3d(), vec3d(), vec3d() };
@@ -144,6 +155,41 @@ struct triangle
 	}
 };
 
+#if ENGINE_SIMD_SSE
+// Checks (once) that the CPU has AVX and that the OS saves the YMM registers
+static bool SimdSupportsAVX()
+{
+	static const bool bSupported = []()
+	{
+		unsigned int ecx = 0;
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		ecx = (unsigned int)info[2];
+#else
+		unsigned int eax, ebx, edx;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			return false;
+#endif
+		bool bOSXSave = (ecx & (1u << 27)) != 0;
+		bool bAVX     = (ecx & (1u << 28)) != 0;
+		if (!bOSXSave || !bAVX)
+			return false;
+
+		unsigned long long xcr0 = 0;
+#if defined(_MSC_VER)
+		xcr0 = _xgetbv(0);
+#else
+		unsigned int lo, hi;
+		__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		xcr0 = ((unsigned long long)hi << 32) | lo;
+#endif
+		return (xcr0 & 0x6) == 0x6; // XMM and YMM state enabled
+	}();
+	return bSupported;
+}
+#endif
+
 struct mat4x4
 {
 	float m[4][4] = { 0.0f };
@@ -161,7 +207,8 @@ struct mat4x4
 		m[3][3] = d;
 	}
 
-	vec3d operator*(vec3d v) {
+	vec3d operator*(const vec3d& v) const
+	{
 		vec3d o;
 		o.x = v.x * m[0][0] + v.y * m[1][0] + v.z * m[2][0] + v.w * m[3][0];
 		o.y = v.x * m[0][1] + v.y * m[1][1] + v.z * m[2][1] + v.w * m[3][1];
@@ -171,6 +218,93 @@ struct mat4x4
 		return o;
 	}
 
+	// Transforms nCount vertices from pIn into pOut, 'pIn' and 'pOut' may be the same array.
+	// Picks the widest kernel available, the result matches operator*(vec3d) for every vertex
+	void TransformBatch(const vec3d* pIn, vec3d* pOut, size_t nCount) const
+	{
+#if ENGINE_SIMD_SSE
+		if (SimdSupportsAVX())
+			TransformBatchAVX(pIn, pOut, nCount);
+		else
+			TransformBatchSSE(pIn, pOut, nCount);
+#else
+		TransformBatchScalar(pIn, pOut, nCount);
+#endif
+	}
+
+	void TransformBatchScalar(const vec3d* pIn, vec3d* pOut, size_t nCount) const
+	{
+		for (size_t i = 0; i < nCount; i++)
+			pOut[i] = *this * pIn[i];
+	}
+
+#if ENGINE_SIMD_SSE
+	// Row vector convention: o = v.x * row0 + v.y * row1 + v.z * row2 + v.w * row3
+	void TransformBatchSSE(const vec3d* pIn, vec3d* pOut, size_t nCount) const
+	{
+		const __m128 r0 = _mm_loadu_ps(m[0]);
+		const __m128 r1 = _mm_loadu_ps(m[1]);
+		const __m128 r2 = _mm_loadu_ps(m[2]);
+		const __m128 r3 = _mm_loadu_ps(m[3]);
+
+		const float* src = &pIn[0].x;
+		float* dst = &pOut[0].x;
+		for (size_t i = 0; i < nCount; i++, src += 4, dst += 4)
+		{
+			__m128 v = _mm_loadu_ps(src);
+			__m128 o = _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)), r0);
+			o = _mm_add_ps(o, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)), r1));
+			o = _mm_add_ps(o, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)), r2));
+			o = _mm_add_ps(o, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)), r3));
+			_mm_storeu_ps(dst, o);
+		}
+	}
+
+	// Two vertices per 256 bit register, the matrix rows are duplicated into both lanes
+	// so the in-lane permutes broadcast each vertex's own components
+	ENGINE_TARGET_AVX void TransformBatchAVX(const vec3d* pIn, vec3d* pOut, size_t nCount) const
+	{
+		const __m256 r0 = _mm256_broadcast_ps((const __m128*)m[0]);
+		const __m256 r1 = _mm256_broadcast_ps((const __m128*)m[1]);
+		const __m256 r2 = _mm256_broadcast_ps((const __m128*)m[2]);
+		const __m256 r3 = _mm256_broadcast_ps((const __m128*)m[3]);
+
+		const float* src = &pIn[0].x;
+		float* dst = &pOut[0].x;
+		size_t i = 0;
+
+		// Four vertices per iteration keeps two independent dependency chains in flight
+		for (; i + 4 <= nCount; i += 4, src += 16, dst += 16)
+		{
+			__m256 a = _mm256_loadu_ps(src);
+			__m256 b = _mm256_loadu_ps(src + 8);
+			__m256 oa = _mm256_mul_ps(_mm256_permute_ps(a, 0x00), r0);
+			__m256 ob = _mm256_mul_ps(_mm256_permute_ps(b, 0x00), r0);
+			oa = _mm256_add_ps(oa, _mm256_mul_ps(_mm256_permute_ps(a, 0x55), r1));
+			ob = _mm256_add_ps(ob, _mm256_mul_ps(_mm256_permute_ps(b, 0x55), r1));
+			oa = _mm256_add_ps(oa, _mm256_mul_ps(_mm256_permute_ps(a, 0xAA), r2));
+			ob = _mm256_add_ps(ob, _mm256_mul_ps(_mm256_permute_ps(b, 0xAA), r2));
+			oa = _mm256_add_ps(oa, _mm256_mul_ps(_mm256_permute_ps(a, 0xFF), r3));
+			ob = _mm256_add_ps(ob, _mm256_mul_ps(_mm256_permute_ps(b, 0xFF), r3));
+			_mm256_storeu_ps(dst, oa);
+			_mm256_storeu_ps(dst + 8, ob);
+		}
+
+		for (; i + 2 <= nCount; i += 2, src += 8, dst += 8)
+		{
+			__m256 a = _mm256_loadu_ps(src);
+			__m256 oa = _mm256_mul_ps(_mm256_permute_ps(a, 0x00), r0);
+			oa = _mm256_add_ps(oa, _mm256_mul_ps(_mm256_permute_ps(a, 0x55), r1));
+			oa = _mm256_add_ps(oa, _mm256_mul_ps(_mm256_permute_ps(a, 0xAA), r2));
+			oa = _mm256_add_ps(oa, _mm256_mul_ps(_mm256_permute_ps(a, 0xFF), r3));
+			_mm256_storeu_ps(dst, oa);
+		}
+
+		if (i < nCount)
+			TransformBatchSSE(pIn + i, pOut + i, nCount - i);
+	}
+#endif
+
 	triangle operator*(triangle tri)
 	{
 		triangle o;
@@ -180,7 +314,7 @@ struct mat4x4
 		return o;
 	}
 
-	mat4x4 operator*(mat4x4 m)
+	mat4x4 operator*(const mat4x4& m) const
 	{
 		mat4x4 matrix(0.0f);
 		for (int c = 0; c < 4; c++)
@@ -189,7 +323,7 @@ struct mat4x4
 		return matrix;
 	}
 	
-	mat4x4 Inverse()
+	mat4x4 Inverse() const
 	{
 		//Should only be used for rotation/translation matrices
 		mat4x4 matrix(0.0f);
@@ -284,55 +418,439 @@ struct mat4x4
 	}
 };
 
+// Parse an OBJ buffer into a vertex array and a triangle index buffer. Polygons are
+// fan triangulated, negative (relative) indices are resolved, faces that reference
+// missing vertices are dropped and counted in the stats
+static void ParseObjIndexed(const char* begin, const char* end, std::vector<vec3d>& verts, std::vector<uint32_t>& indices, obj_parse_stats& stats)
+{
+	verts.clear();
+	indices.clear();
+
+	ObjParseBuffer(begin, end,
+		[&](float x, float y, float z)
+		{
+			verts.push_back(vec3d(x, y, z));
+		},
+		[&](const int* corners, int nCorners, size_t nVertsSoFar)
+		{
+			stats.nFaces++;
+			for (int k = 0; k < nCorners; k++)
+			{
+				int64_t idx = ObjResolveIndex(corners[k], nVertsSoFar);
+				if (idx < 0 || idx >= (int64_t)nVertsSoFar)
+				{
+					stats.nSkippedFaces++;
+					return;
+				}
+			}
+
+			uint32_t i0 = (uint32_t)ObjResolveIndex(corners[0], nVertsSoFar);
+			for (int k = 1; k + 1 < nCorners; k++)
+			{
+				indices.push_back(i0);
+				indices.push_back((uint32_t)ObjResolveIndex(corners[k], nVertsSoFar));
+				indices.push_back((uint32_t)ObjResolveIndex(corners[k + 1], nVertsSoFar));
+			}
+		});
+
+	stats.nVerts = verts.size();
+	stats.nTriangles = indices.size() / 3;
+}
+
+// Same result as ParseObjIndexed, but the buffer is cut into one chunk per thread at
+// line boundaries and the chunks are parsed concurrently. Each chunk numbers its
+// vertices from zero and keeps, for every face, how many vertices came before it.
+// Once every chunk is done the vertex counts are prefix summed, indices relative to
+// the chunk are shifted to global ones, and each face is checked against the
+// vertices before it in the whole file, exactly as the serial parse does: a face
+// with any corner out of range is dropped whole and counted once. Small buffers are
+// not worth the threads and parse serially.
+static void ParseObjIndexedParallel(const char* begin, const char* end, std::vector<vec3d>& verts, std::vector<uint32_t>& indices, obj_parse_stats& stats, unsigned int nThreads = 0)
+{
+	if (nThreads == 0)
+		nThreads = std::thread::hardware_concurrency();
+
+	const size_t nMinChunkBytes = 1 << 20;
+	size_t nSize = (size_t)(end - begin);
+	size_t nChunks = (std::min)((size_t)(std::max)(nThreads, 1u), nSize / nMinChunkBytes);
+
+	if (nChunks <= 1)
+	{
+		ParseObjIndexed(begin, end, verts, indices, stats);
+		return;
+	}
+
+	// A face's triangles, and the vertices of its chunk parsed before it
+	struct obj_face
+	{
+		size_t nFirstIndex;
+		size_t nVertsSoFar;
+		int nTriangles;
+	};
+
+	struct obj_chunk
+	{
+		const char* begin;
+		const char* end;
+		std::vector<vec3d> verts;
+		std::vector<uint32_t> indices;
+		std::vector<obj_face> faces;
+		std::vector<size_t> vecRelativeSlots;	// entries of 'indices' that are relative to this chunk's first vertex
+		size_t nVertexBase = 0;
+		size_t nIndexBase = 0;
+		obj_parse_stats stats;
+	};
+
+	auto runParallel = [&](std::vector<obj_chunk>& chunks, const std::function<void(obj_chunk&)>& fn)
+	{
+		std::vector<std::thread> vecThreads;
+		for (size_t c = 1; c < chunks.size(); c++)
+			vecThreads.emplace_back([&, c]() { fn(chunks[c]); });
+		fn(chunks[0]);
+		for (auto& t : vecThreads)
+			t.join();
+	};
+
+	// Split at line boundaries
+	std::vector<obj_chunk> chunks(nChunks);
+	const char* p = begin;
+	for (size_t c = 0; c < nChunks; c++)
+	{
+		const char* q = (c + 1 == nChunks) ? end : begin + nSize * (c + 1) / nChunks;
+		if (q < p) q = p;
+		const char* eol = (const char*)std::memchr(q, '\n', end - q);
+		q = (eol == nullptr || c + 1 == nChunks) ? end : eol + 1;
+		chunks[c].begin = p;
+		chunks[c].end = q;
+		p = q;
+	}
+
+	// 1. Parse. Positive indices are global in the file and stored as they are, negative
+	//    ones are stored chunk-relative (possibly "negative", wrapping in uint32, when
+	//    they reach back into an earlier chunk). Nothing can be range checked yet
+	runParallel(chunks, [](obj_chunk& chunk)
+	{
+		ObjParseBuffer(chunk.begin, chunk.end,
+			[&](float x, float y, float z)
+			{
+				chunk.verts.push_back(vec3d(x, y, z));
+			},
+			[&](const int* corners, int nCorners, size_t nVertsSoFar)
+			{
+				chunk.stats.nFaces++;
+				for (int k = 0; k < nCorners; k++)
+				{
+					if (corners[k] == 0)
+					{
+						chunk.stats.nSkippedFaces++;
+						return;
+					}
+				}
+
+				auto emit = [&](int nCorner)
+				{
+					if (nCorner < 0)
+					{
+						chunk.vecRelativeSlots.push_back(chunk.indices.size());
+						chunk.indices.push_back((uint32_t)((int64_t)nVertsSoFar + nCorner));
+					}
+					else
+						chunk.indices.push_back((uint32_t)(nCorner - 1));
+				};
+
+				chunk.faces.push_back({ chunk.indices.size(), nVertsSoFar, nCorners - 2 });
+				for (int k = 1; k + 1 < nCorners; k++)
+				{
+					emit(corners[0]);
+					emit(corners[k]);
+					emit(corners[k + 1]);
+				}
+			});
+	});
+
+	size_t nTotalVerts = 0;
+	for (auto& chunk : chunks)
+	{
+		chunk.nVertexBase = nTotalVerts;
+		nTotalVerts += chunk.verts.size();
+	}
+
+	// 2. Shift relative indices to global ones, then drop every face reaching a vertex
+	//    not defined before it. A relative index reaching in front of the file wraps to
+	//    a huge value and fails the same test. The fan holds every corner of the face
+	runParallel(chunks, [](obj_chunk& chunk)
+	{
+		for (size_t slot : chunk.vecRelativeSlots)
+			chunk.indices[slot] += (uint32_t)chunk.nVertexBase;
+
+		size_t nKept = 0;
+		for (const obj_face& face : chunk.faces)
+		{
+			size_t nLimit = chunk.nVertexBase + face.nVertsSoFar;
+			const uint32_t* pFace = &chunk.indices[face.nFirstIndex];
+			size_t nIndices = (size_t)face.nTriangles * 3;
+			bool bValid = true;
+			for (size_t i = 0; i < nIndices && bValid; i++)
+				bValid = pFace[i] < nLimit;
+			if (!bValid)
+			{
+				chunk.stats.nSkippedFaces++;
+				continue;
+			}
+			std::memmove(&chunk.indices[nKept], pFace, nIndices * sizeof(uint32_t));
+			nKept += nIndices;
+		}
+		chunk.indices.resize(nKept);
+	});
+
+	size_t nTotalIndices = 0;
+	for (auto& chunk : chunks)
+	{
+		chunk.nIndexBase = nTotalIndices;
+		nTotalIndices += chunk.indices.size();
+		stats.nFaces += chunk.stats.nFaces;
+		stats.nSkippedFaces += chunk.stats.nSkippedFaces;
+	}
+
+	// 3. Gather into the output arrays
+	verts.resize(nTotalVerts);
+	indices.resize(nTotalIndices);
+	runParallel(chunks, [&](obj_chunk& chunk)
+	{
+		if (!chunk.verts.empty())
+			std::memcpy(&verts[chunk.nVertexBase], chunk.verts.data(), chunk.verts.size() * sizeof(vec3d));
+		if (!chunk.indices.empty())
+			std::memcpy(&indices[chunk.nIndexBase], chunk.indices.data(), chunk.indices.size() * sizeof(uint32_t));
+	});
+
+	stats.nVerts = verts.size();
+	stats.nTriangles = indices.size() / 3;
+}
+
+static bool LoadObjIndexedParallel(const std::string& sFilename, std::vector<vec3d>& verts, std::vector<uint32_t>& indices, obj_parse_stats* pStats = nullptr, unsigned int nThreads = 0)
+{
+	auto tp1 = std::chrono::steady_clock::now();
+
+	mapped_file file;
+	if (!file.Open(sFilename))
+		return false;
+
+	obj_parse_stats stats;
+	stats.nBytes = file.Size();
+	ParseObjIndexedParallel(file.Data(), file.Data() + file.Size(), verts, indices, stats, nThreads);
+
+	stats.fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tp1).count();
+	if (pStats)
+		*pStats = stats;
+	return true;
+}
+
 struct mesh
 {
 	std::vector<triangle> tris;
 
-	bool LoadFromObjectFile(std::string sFilename)
+	bool LoadFromObjectFile(std::string sFilename, obj_parse_stats* pStats = nullptr)
 	{
-		std::ifstream f(sFilename);
-		if (!f.is_open())
+		std::vector<vec3d> verts;
+		std::vector<uint32_t> indices;
+		if (!LoadObjIndexedParallel(sFilename, verts, indices, pStats))
 			return false;
 
-		// Local cache of vertices
-		std::vector<vec3d> verts;
-		while (!f.eof())
+		tris.resize(indices.size() / 3);
+		for (size_t t = 0; t < tris.size(); t++)
+		{
+			tris[t].p[0] = verts[indices[t * 3 + 0]];
+			tris[t].p[1] = verts[indices[t * 3 + 1]];
+			tris[t].p[2] = verts[indices[t * 3 + 2]];
+		}
+
+		return true;
+	}
+};
+
+// Mesh with a unique vertex array and a triangle index buffer (3 indices per face).
+// Shared vertices are stored, and transformed, only once
+struct indexed_mesh
+{
+	// Owned geometry, filled by the loaders and builders below
+	std::vector<vec3d>    verts;
+	std::vector<uint32_t> indices;
+	std::vector<vec3d>    normals;	// one unit face normal per triangle
+
+	// Object space bounds
+	vec3d vBoundsMin;
+	vec3d vBoundsMax;
+	vec3d vSphereCenter;
+	float fSphereRadius = 0.0f;
+
+	// When loaded from a mesh cache the geometry is used in place from the mapping
+	// and the vectors above stay empty. Always read through the accessors
+	std::shared_ptr<mapped_file> pMapping;
+	const vec3d*    pMappedVerts = nullptr;
+	const uint32_t* pMappedIndices = nullptr;
+	const vec3d*    pMappedNormals = nullptr;
+	size_t nMappedVerts = 0;
+	size_t nMappedIndices = 0;
+
+	const vec3d*    Verts() const	{ return pMapping ? pMappedVerts : verts.data(); }
+	const uint32_t* Indices() const	{ return pMapping ? pMappedIndices : indices.data(); }
+	const vec3d*    Normals() const	{ return pMapping ? pMappedNormals : normals.data(); }
+	size_t VertexCount() const		{ return pMapping ? nMappedVerts : verts.size(); }
+	size_t IndexCount() const		{ return pMapping ? nMappedIndices : indices.size(); }
+
+	size_t TriangleCount() const
+	{
+		return IndexCount() / 3;
+	}
+
+	bool LoadFromObjectFile(std::string sFilename, obj_parse_stats* pStats = nullptr)
+	{
+		pMapping.reset();
+		if (!LoadObjIndexedParallel(sFilename, verts, indices, pStats))
+			return false;
+
+		Weld();
+		ComputeDerived();
+		return true;
+	}
+
+	// Face normals, bounding box and bounding sphere, for owned geometry
+	void ComputeDerived()
+	{
+		normals.resize(indices.size() / 3);
+		for (size_t t = 0; t < normals.size(); t++)
 		{
-			char line[128]; // assuming file has no line with more than 128 characters
-			f.getline(line, 128);
+			vec3d p0 = verts[indices[t * 3 + 0]];
+			vec3d line1 = verts[indices[t * 3 + 1]] - p0;
+			vec3d line2 = verts[indices[t * 3 + 2]] - p0;
+			normals[t] = line1.cross(line2).normalise();
+			normals[t].w = 0.0f;
+		}
+
+		vBoundsMin = vBoundsMax = vec3d();
+		if (!verts.empty())
+		{
+			vBoundsMin = vBoundsMax = verts[0];
+			for (const auto& v : verts)
+			{
+				vBoundsMin.x = (std::min)(vBoundsMin.x, v.x);	vBoundsMax.x = (std::max)(vBoundsMax.x, v.x);
+				vBoundsMin.y = (std::min)(vBoundsMin.y, v.y);	vBoundsMax.y = (std::max)(vBoundsMax.y, v.y);
+				vBoundsMin.z = (std::min)(vBoundsMin.z, v.z);	vBoundsMax.z = (std::max)(vBoundsMax.z, v.z);
+			}
+		}
+
+		// Sphere around the box centre reaching the farthest vertex, tighter than the
+		// box's own circumsphere for round meshes
+		vSphereCenter = vec3d((vBoundsMin.x + vBoundsMax.x) * 0.5f, (vBoundsMin.y + vBoundsMax.y) * 0.5f, (vBoundsMin.z + vBoundsMax.z) * 0.5f);
+		float fRadiusSq = 0.0f;
+		for (const auto& v : verts)
+		{
+			float dx = v.x - vSphereCenter.x, dy = v.y - vSphereCenter.y, dz = v.z - vSphereCenter.z;
+			fRadiusSq = (std::max)(fRadiusSq, dx * dx + dy * dy + dz * dz);
+		}
+		fSphereRadius = sqrtf(fRadiusSq);
+	}
+
+	// Build from a triangle soup, every corner becomes a vertex and Weld() merges them
+	void FromTriangles(const mesh& soup)
+	{
+		verts.clear();
+		indices.clear();
+		verts.reserve(soup.tris.size() * 3);
+		indices.reserve(soup.tris.size() * 3);
+
+		for (const auto& tri : soup.tris)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				indices.push_back((uint32_t)verts.size());
+				verts.push_back(tri.p[k]);
+			}
+		}
+
+		pMapping.reset();
+		Weld();
+		ComputeDerived();
+	}
 
-			std::strstream s;
-			s << line;
+	// Expand back into a triangle soup
+	void ToTriangles(mesh& soup) const
+	{
+		const vec3d* pVerts = Verts();
+		const uint32_t* pIndices = Indices();
+		soup.tris.resize(TriangleCount());
+		for (size_t t = 0; t < soup.tris.size(); t++)
+		{
+			soup.tris[t].p[0] = pVerts[pIndices[t * 3 + 0]];
+			soup.tris[t].p[1] = pVerts[pIndices[t * 3 + 1]];
+			soup.tris[t].p[2] = pVerts[pIndices[t * 3 + 2]];
+		}
+	}
 
-			char junk;
-			if (line[0] == 'v')
+	// Merge vertices with bit-identical positions and remap the index buffer (owned
+	// geometry only). OBJ exporters often duplicate positions along UV and smoothing seams
+	void Weld()
+	{
+		struct position_key
+		{
+			uint32_t x, y, z;
+			bool operator==(const position_key& rhs) const { return x == rhs.x && y == rhs.y && z == rhs.z; }
+		};
+
+		struct position_hash
+		{
+			size_t operator()(const position_key& k) const
 			{
-				vec3d v;
-				s >> junk >> v.x >> v.y >> v.z;
-				verts.push_back(v);
+				// FNV-1a style mix of the three coordinate bit patterns
+				size_t h = 2166136261u;
+				h = (h ^ k.x) * 16777619u;
+				h = (h ^ k.y) * 16777619u;
+				h = (h ^ k.z) * 16777619u;
+				return h;
 			}
-			else if (line[0] == 'f')
+		};
+
+		auto bits = [](float f)
+		{
+			if (f == 0.0f) f = 0.0f; // fold -0 onto +0
+			uint32_t u;
+			std::memcpy(&u, &f, sizeof(u));
+			return u;
+		};
+
+		std::unordered_map<position_key, uint32_t, position_hash> mapUnique;
+		mapUnique.reserve(verts.size());
+
+		std::vector<uint32_t> vecRemap(verts.size());
+		std::vector<vec3d> vecUnique;
+		vecUnique.reserve(verts.size());
+
+		for (size_t i = 0; i < verts.size(); i++)
+		{
+			position_key key = { bits(verts[i].x), bits(verts[i].y), bits(verts[i].z) };
+			auto it = mapUnique.find(key);
+			if (it == mapUnique.end())
 			{
-				int f[3];
-				s >> junk >> f[0] >> f[1] >> f[2];
-
-				triangle new_t;
-				new_t.p[0] = verts[f[0] - 1];
-				new_t.p[1] = verts[f[1] - 1];
-				new_t.p[2] = verts[f[2] - 1];
-			
-				tris.push_back(new_t);
+				uint32_t id = (uint32_t)vecUnique.size();
+				mapUnique.emplace(key, id);
+				vecUnique.push_back(verts[i]);
+				vecRemap[i] = id;
 			}
+			else
+				vecRemap[i] = it->second;
 		}
 
-		return true;
+		for (auto& idx : indices)
+			idx = vecRemap[idx];
+
+		verts.swap(vecUnique);
 	}
 };
 
 static vec3d IntersectPlane(vec3d& plane_p, vec3d& plane_n, vec3d& line_start, vec3d& line_end)
 {
 	plane_n = plane_n.normalise();
-	float plane_d = -plane_n.dot(plane_n);
+	float plane_d = -plane_n.dot(plane_p);
 	float ad = line_start.dot(plane_n);
 	float bd = line_end.dot(plane_n);
 
@@ -348,7 +866,7 @@ static vec3d IntersectPlane(vec3d& plane_p, vec3d& plane_n, vec3d& line_start, v
 static int ClipTriangleAgainstPlane(vec3d plane_p, vec3d plane_n, triangle& in_tri, triangle& out_tri1, triangle& out_tri2)
 {
 	// ensure plane normal is normal
-	plane_p = plane_p.normalise();
+	plane_n = plane_n.normalise();
 
 	// Return signed shortest distance from point to plane, plane normal must be normalised
 	auto dist = [&](vec3d& p)
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cassert>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <list>
+#include <new>
+#include <algorithm>
+#include <type_traits>
+
+// Linear allocator for data that only lives for one frame. Allocation bumps an
+// offset into the current block, freeing does nothing and Reset() drops everything
+// at once. Any thread may allocate; the only lock is taken when a block runs out.
+// Reset() folds the blocks a frame needed into one, so once the working set has
+// been seen the arena stops touching the heap.
+class frame_arena
+{
+public:
+	explicit frame_arena(size_t nInitialSize = 1 << 20) : m_nInitialSize(nInitialSize) {}
+	~frame_arena() { FreeBlocks(); }
+
+	frame_arena(const frame_arena&) = delete;
+	frame_arena& operator=(const frame_arena&) = delete;
+
+	void* Allocate(size_t nBytes, size_t nAlign = alignof(std::max_align_t))
+	{
+		size_t nNeed = nBytes + nAlign - 1;
+		while (true)
+		{
+			block* b = m_pCurrent.load(std::memory_order_acquire);
+			if (b)
+			{
+				size_t nOffset = b->nUsed.fetch_add(nNeed, std::memory_order_relaxed);
+				if (nOffset + nNeed <= b->nSize)
+				{
+					uintptr_t p = (uintptr_t)(b->pData + nOffset);
+					return (void*)((p + nAlign - 1) & ~(uintptr_t)(nAlign - 1));
+				}
+			}
+
+			// Out of room. Whoever gets the lock first adds a block, the rest retry in it
+			std::lock_guard<std::mutex> lock(m_muxGrow);
+			if (m_pCurrent.load(std::memory_order_relaxed) != b)
+				continue;
+			size_t nSize = (std::max)(b ? b->nSize * 2 : m_nInitialSize, nNeed);
+			m_pCurrent.store(NewBlock(nSize, b), std::memory_order_release);
+		}
+	}
+
+	// Everything allocated since the last Reset becomes invalid. Not thread safe
+	void Reset()
+	{
+		m_nHighWater = (std::max)(m_nHighWater, BytesUsed());
+		block* b = m_pCurrent.load(std::memory_order_relaxed);
+		if (b && b->pPrev)
+		{
+			size_t nTotal = 0;
+			for (; b; b = b->pPrev)
+				nTotal += b->nSize;
+			FreeBlocks();
+			m_pCurrent.store(NewBlock(nTotal, nullptr), std::memory_order_relaxed);
+		}
+		else if (b)
+			b->nUsed.store(0, std::memory_order_relaxed);
+	}
+
+	size_t BytesUsed() const
+	{
+		size_t n = 0;
+		for (block* b = m_pCurrent.load(std::memory_order_relaxed); b; b = b->pPrev)
+			n += (std::min)(b->nUsed.load(std::memory_order_relaxed), b->nSize);
+		return n;
+	}
+
+	size_t HighWater() const { return m_nHighWater; }
+
+	// Blocks taken from the heap, ever. Should stop rising after the first frames
+	size_t BlockAllocations() const { return m_nBlockAllocations; }
+
+private:
+	// Header and data share one malloc, blocks chain back to the ones filled before
+	struct block
+	{
+		block* pPrev;
+		char* pData;
+		size_t nSize;
+		std::atomic<size_t> nUsed;
+	};
+
+	block* NewBlock(size_t nSize, block* pPrev)
+	{
+		void* p = std::malloc(sizeof(block) + nSize);
+		if (p == nullptr)
+			throw std::bad_alloc();
+		block* b = new (p) block;
+		b->pPrev = pPrev;
+		b->pData = (char*)p + sizeof(block);
+		b->nSize = nSize;
+		b->nUsed.store(0, std::memory_order_relaxed);
+		m_nBlockAllocations++;
+		return b;
+	}
+
+	void FreeBlocks()
+	{
+		block* b = m_pCurrent.load(std::memory_order_relaxed);
+		while (b)
+		{
+			block* pPrev = b->pPrev;
+			b->~block();
+			std::free(b);
+			b = pPrev;
+		}
+		m_pCurrent.store(nullptr, std::memory_order_relaxed);
+	}
+
+	size_t m_nInitialSize;
+	std::atomic<block*> m_pCurrent{ nullptr };
+	std::mutex m_muxGrow;
+	size_t m_nHighWater = 0;
+	size_t m_nBlockAllocations = 0;
+};
+
+// Standard allocator on top of a frame_arena, for std containers whose contents
+// are thrown away with the frame. Deallocation is a no-op
+template<typename T>
+struct arena_allocator
+{
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	frame_arena* pArena;
+
+	// Unbound until the container is rebound with ArenaReset, allocating before that is a bug
+	arena_allocator() : pArena(nullptr) {}
+	arena_allocator(frame_arena& arena) : pArena(&arena) {}
+	template<typename U>
+	arena_allocator(const arena_allocator<U>& other) : pArena(other.pArena) {}
+
+	T* allocate(size_t n)
+	{
+		assert(pArena != nullptr);
+		return (T*)pArena->Allocate(n * sizeof(T), alignof(T));
+	}
+	void deallocate(T*, size_t) {}
+
+	template<typename U>
+	bool operator==(const arena_allocator<U>& other) const { return pArena == other.pArena; }
+	template<typename U>
+	bool operator!=(const arena_allocator<U>& other) const { return pArena != other.pArena; }
+};
+
+template<typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+
+template<typename T>
+using arena_list = std::list<T, arena_allocator<T>>;
+
+// Empty an arena container and point it at the arena again. Needed for containers that
+// outlive a Reset. The old object is abandoned, not destroyed: after a Reset its storage
+// is gone, and destroying it would read it, e.g. the inner vectors of a vector of
+// vectors. Rebind before or after Reset, either is safe, but nothing may touch the
+// container in between
+template<typename Container>
+void ArenaReset(Container& c, frame_arena& arena)
+{
+	new (&c) Container(typename Container::allocator_type(arena));
+}
+
+// Count of global operator new calls. Main.cpp replaces operator new to bump it
+// when ENGINE_COUNT_HEAP is defined, which debug builds do by default
+#if defined(_DEBUG) && !defined(ENGINE_COUNT_HEAP)
+#define ENGINE_COUNT_HEAP
+#endif
+
+inline std::atomic<size_t>& HeapAllocationCounter()
+{
+	static std::atomic<size_t> nCount(0);
+	return nCount;
+}
+
+// Scope guard asserting that no operator new happened while it was alive, on any
+// thread. The arena grows with malloc and is not counted
+class heap_allocation_check
+{
+public:
+	heap_allocation_check() : m_nStart(HeapAllocationCounter().load()) {}
+
+	~heap_allocation_check()
+	{
+#ifdef ENGINE_COUNT_HEAP
+		assert(HeapAllocationCounter().load() == m_nStart && "heap allocation in the frame loop, use the frame arena");
+#endif
+	}
+
+	size_t Count() const { return HeapAllocationCounter().load() - m_nStart; }
+
+private:
+	size_t m_nStart;
+};
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+#ifndef _WIN32
+#include "console_posix.h"
+#endif
+
+// Screen buffers as images, for looking at frames rendered without a console and
+// comparing them against known good ones. Every cell becomes nScale x nScale pixels
+// of one colour: the shade glyphs and the full block mix the foreground colour over
+// the background by how much of the cell they fill, anything else printable counts
+// as half filled and blanks show the background. All integer, so the same buffer
+// always gives the same bytes.
+//
+// Files ending in .png are written as PNG, stored without compression so no zlib is
+// needed, anything else as binary PPM.
+
+// The classic console colours, indexed by attribute nibble
+static const uint8_t CONSOLE_PALETTE[16][3] =
+{
+	{ 0, 0, 0 },		{ 0, 0, 128 },		{ 0, 128, 0 },		{ 0, 128, 128 },
+	{ 128, 0, 0 },		{ 128, 0, 128 },	{ 128, 128, 0 },	{ 192, 192, 192 },
+	{ 128, 128, 128 },	{ 0, 0, 255 },		{ 0, 255, 0 },		{ 0, 255, 255 },
+	{ 255, 0, 0 },		{ 255, 0, 255 },	{ 255, 255, 0 },	{ 255, 255, 255 },
+};
+
+// Quarters of the cell the glyph covers
+static int GlyphCoverage(wchar_t c)
+{
+	switch (c)
+	{
+	case 0x2588: return 4;		// PIXEL_SOLID
+	case 0x2593: return 3;		// PIXEL_THREEQUARTERS
+	case 0x2592: return 2;		// PIXEL_HALF
+	case 0x2591: return 1;		// PIXEL_QUARTER
+	default: return (uint32_t)c <= 0x20 || c == 0x7f ? 0 : 2;
+	}
+}
+
+// nWidth * nScale by nHeight * nScale pixels, RGB, top row first
+static std::vector<uint8_t> ScreenToRGB(const CHAR_INFO* pScreen, int nWidth, int nHeight, int nScale = 1)
+{
+	int nPixelsX = nWidth * nScale;
+	std::vector<uint8_t> vecRGB((size_t)nPixelsX * nHeight * nScale * 3);
+	for (int y = 0; y < nHeight; y++)
+	{
+		uint8_t* pRow = &vecRGB[(size_t)y * nScale * nPixelsX * 3];
+		for (int x = 0; x < nWidth; x++)
+		{
+			const CHAR_INFO& ci = pScreen[y * nWidth + x];
+			const uint8_t* pFg = CONSOLE_PALETTE[ci.Attributes & 0x0F];
+			const uint8_t* pBg = CONSOLE_PALETTE[(ci.Attributes >> 4) & 0x0F];
+			int nCover = GlyphCoverage(ci.Char.UnicodeChar);
+			uint8_t rgb[3];
+			for (int k = 0; k < 3; k++)
+				rgb[k] = (uint8_t)((pFg[k] * nCover + pBg[k] * (4 - nCover) + 2) / 4);
+			for (int i = 0; i < nScale; i++)
+				for (int k = 0; k < 3; k++)
+					pRow[(x * nScale + i) * 3 + k] = rgb[k];
+		}
+
+		// The cell's other pixel rows are copies of its first
+		for (int j = 1; j < nScale; j++)
+			std::copy(pRow, pRow + nPixelsX * 3, pRow + (size_t)j * nPixelsX * 3);
+	}
+	return vecRGB;
+}
+
+static uint32_t Crc32(const uint8_t* p, size_t n, uint32_t nCrc = 0)
+{
+	struct crc_table
+	{
+		uint32_t n[256];
+		crc_table()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				n[i] = c;
+			}
+		}
+	};
+	static const crc_table table;
+
+	nCrc = ~nCrc;
+	for (size_t i = 0; i < n; i++)
+		nCrc = table.n[(nCrc ^ p[i]) & 0xFF] ^ (nCrc >> 8);
+	return ~nCrc;
+}
+
+static void AppendBigEndian(std::vector<uint8_t>& vec, uint32_t n)
+{
+	for (int i = 3; i >= 0; i--)
+		vec.push_back((uint8_t)(n >> (i * 8)));
+}
+
+static void AppendPngChunk(std::vector<uint8_t>& vecFile, const char* sType, const std::vector<uint8_t>& vecData)
+{
+	AppendBigEndian(vecFile, (uint32_t)vecData.size());
+	size_t nStart = vecFile.size();
+	vecFile.insert(vecFile.end(), sType, sType + 4);
+	vecFile.insert(vecFile.end(), vecData.begin(), vecData.end());
+	AppendBigEndian(vecFile, Crc32(&vecFile[nStart], vecFile.size() - nStart));
+}
+
+static std::vector<uint8_t> EncodePNG(const std::vector<uint8_t>& vecRGB, int nWidth, int nHeight)
+{
+	std::vector<uint8_t> vecFile = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+	std::vector<uint8_t> vecHeader;
+	AppendBigEndian(vecHeader, (uint32_t)nWidth);
+	AppendBigEndian(vecHeader, (uint32_t)nHeight);
+	vecHeader.insert(vecHeader.end(), { 8, 2, 0, 0, 0 });	// 8 bit RGB, no interlace
+	AppendPngChunk(vecFile, "IHDR", vecHeader);
+
+	// Scanlines with filter type 0, as a zlib stream of stored deflate blocks
+	std::vector<uint8_t> vecRaw;
+	size_t nStride = (size_t)nWidth * 3;
+	vecRaw.reserve((nStride + 1) * nHeight);
+	for (int y = 0; y < nHeight; y++)
+	{
+		vecRaw.push_back(0);
+		vecRaw.insert(vecRaw.end(), vecRGB.begin() + y * nStride, vecRGB.begin() + (y + 1) * nStride);
+	}
+
+	std::vector<uint8_t> vecZlib = { 0x78, 0x01 };
+	size_t nPos = 0;
+	do
+	{
+		size_t nBlock = (std::min)(vecRaw.size() - nPos, (size_t)65535);
+		vecZlib.push_back(nPos + nBlock == vecRaw.size() ? 1 : 0);
+		vecZlib.push_back((uint8_t)nBlock);
+		vecZlib.push_back((uint8_t)(nBlock >> 8));
+		vecZlib.push_back((uint8_t)~nBlock);
+		vecZlib.push_back((uint8_t)(~nBlock >> 8));
+		vecZlib.insert(vecZlib.end(), vecRaw.begin() + nPos, vecRaw.begin() + nPos + nBlock);
+		nPos += nBlock;
+	} while (nPos < vecRaw.size());
+
+	uint32_t a = 1, b = 0;
+	for (uint8_t v : vecRaw)
+	{
+		a = (a + v) % 65521;
+		b = (b + a) % 65521;
+	}
+	AppendBigEndian(vecZlib, b << 16 | a);
+	AppendPngChunk(vecFile, "IDAT", vecZlib);
+	AppendPngChunk(vecFile, "IEND", std::vector<uint8_t>());
+	return vecFile;
+}
+
+// File name for frame nFrame: sPattern with its one %d, %Nd or %0Nd replaced by the
+// number and %% by a percent sign. False if the pattern holds any other conversion,
+// or not exactly one number. Done by hand, the pattern comes from the command line
+// and must never be a printf format
+static bool FormatFrameName(const std::string& sPattern, int nFrame, std::string& sName)
+{
+	sName.clear();
+	int nNumbers = 0;
+	for (size_t i = 0; i < sPattern.size(); i++)
+	{
+		if (sPattern[i] != '%')
+		{
+			sName += sPattern[i];
+			continue;
+		}
+		if (i + 1 < sPattern.size() && sPattern[i + 1] == '%')
+		{
+			sName += '%';
+			i++;
+			continue;
+		}
+
+		size_t j = i + 1;
+		bool bZeros = j < sPattern.size() && sPattern[j] == '0';
+		int nWidth = 0;
+		while (j < sPattern.size() && sPattern[j] >= '0' && sPattern[j] <= '9' && nWidth < 100)
+			nWidth = nWidth * 10 + (sPattern[j++] - '0');
+		if (j >= sPattern.size() || sPattern[j] != 'd' || nWidth >= 100)
+			return false;
+
+		std::string sNumber = std::to_string(nFrame);
+		if ((int)sNumber.size() < nWidth)
+			sName.append(nWidth - sNumber.size(), bZeros ? '0' : ' ');
+		sName += sNumber;
+		nNumbers++;
+		i = j;
+	}
+	return nNumbers == 1;
+}
+
+static bool WriteScreenImage(const std::string& sFilename, const CHAR_INFO* pScreen, int nWidth, int nHeight, int nScale = 1)
+{
+	std::vector<uint8_t> vecRGB = ScreenToRGB(pScreen, nWidth, nHeight, nScale);
+	int nPixelsX = nWidth * nScale, nPixelsY = nHeight * nScale;
+
+	std::vector<uint8_t> vecFile;
+	bool bPng = sFilename.size() >= 4 && sFilename.compare(sFilename.size() - 4, 4, ".png") == 0;
+	if (bPng)
+		vecFile = EncodePNG(vecRGB, nPixelsX, nPixelsY);
+	else
+	{
+		char sHeader[32];
+		int n = snprintf(sHeader, sizeof(sHeader), "P6\n%d %d\n255\n", nPixelsX, nPixelsY);
+		vecFile.assign(sHeader, sHeader + n);
+		vecFile.insert(vecFile.end(), vecRGB.begin(), vecRGB.end());
+	}
+
+	FILE* f = nullptr;
+#ifdef _MSC_VER
+	if (fopen_s(&f, sFilename.c_str(), "wb") != 0)
+		return false;
+#else
+	f = std::fopen(sFilename.c_str(), "wb");
+#endif
+	if (f == nullptr)
+		return false;
+	bool bOk = fwrite(vecFile.data(), 1, vecFile.size(), f) == vecFile.size();
+	return fclose(f) == 0 && bOk;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+
+// Hierarchical depth: a pyramid of min/max depth over tiles of the full resolution
+// depth buffer. Level 0 covers TILE_W x TILE_H cells per node, every level above
+// halves the node count in each direction down to a single node. A rectangle whose
+// nearest depth is farther than the max of every node it overlaps is hidden, and a
+// rectangle nearer than the min of every node it overlaps is fully visible.
+class hiz_buffer
+{
+public:
+	static const int TILE_W = 8;
+	static const int TILE_H = 8;
+
+	void Create(int nWidth, int nHeight)
+	{
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+		m_vecLevels.clear();
+
+		int w = (nWidth + TILE_W - 1) / TILE_W;
+		int h = (nHeight + TILE_H - 1) / TILE_H;
+		while (true)
+		{
+			level l;
+			l.w = w;
+			l.h = h;
+			l.vecMin.resize(w * h);
+			l.vecMax.resize(w * h);
+			m_vecLevels.push_back(l);
+			if (w == 1 && h == 1)
+				break;
+			w = (w + 1) / 2;
+			h = (h + 1) / 2;
+		}
+	}
+
+	void Clear(float fDepth = FLT_MAX)
+	{
+		for (auto& l : m_vecLevels)
+		{
+			std::fill(l.vecMin.begin(), l.vecMin.end(), fDepth);
+			std::fill(l.vecMax.begin(), l.vecMax.end(), fDepth);
+		}
+	}
+
+	// Recompute every level over the inclusive cell rectangle after it was drawn into
+	void Update(const float* pDepth, int x0, int y0, int x1, int y1)
+	{
+		if (!ClipRect(x0, y0, x1, y1))
+			return;
+
+		int tx0 = x0 / TILE_W, ty0 = y0 / TILE_H;
+		int tx1 = x1 / TILE_W, ty1 = y1 / TILE_H;
+
+		level& l0 = m_vecLevels[0];
+		for (int ty = ty0; ty <= ty1; ty++)
+		{
+			int cy0 = ty * TILE_H, cy1 = (std::min)(cy0 + TILE_H, m_nHeight);
+			for (int tx = tx0; tx <= tx1; tx++)
+			{
+				int cx0 = tx * TILE_W, cx1 = (std::min)(cx0 + TILE_W, m_nWidth);
+				float fMin = FLT_MAX, fMax = -FLT_MAX;
+				for (int y = cy0; y < cy1; y++)
+				{
+					const float* pRow = pDepth + y * m_nWidth;
+					for (int x = cx0; x < cx1; x++)
+					{
+						fMin = (std::min)(fMin, pRow[x]);
+						fMax = (std::max)(fMax, pRow[x]);
+					}
+				}
+				l0.vecMin[ty * l0.w + tx] = fMin;
+				l0.vecMax[ty * l0.w + tx] = fMax;
+			}
+		}
+
+		for (size_t n = 1; n < m_vecLevels.size(); n++)
+		{
+			const level& c = m_vecLevels[n - 1];
+			level& l = m_vecLevels[n];
+			tx0 /= 2; ty0 /= 2; tx1 /= 2; ty1 /= 2;
+			for (int ty = ty0; ty <= ty1; ty++)
+			{
+				for (int tx = tx0; tx <= tx1; tx++)
+				{
+					float fMin = FLT_MAX, fMax = -FLT_MAX;
+					for (int cy = ty * 2; cy < (std::min)(ty * 2 + 2, c.h); cy++)
+					{
+						for (int cx = tx * 2; cx < (std::min)(tx * 2 + 2, c.w); cx++)
+						{
+							fMin = (std::min)(fMin, c.vecMin[cy * c.w + cx]);
+							fMax = (std::max)(fMax, c.vecMax[cy * c.w + cx]);
+						}
+					}
+					l.vecMin[ty * l.w + tx] = fMin;
+					l.vecMax[ty * l.w + tx] = fMax;
+				}
+			}
+		}
+	}
+
+	// True if nothing at depth fMinZ or farther inside the rectangle can pass a less-than test
+	bool IsOccluded(int x0, int y0, int x1, int y1, float fMinZ) const
+	{
+		if (!ClipRect(x0, y0, x1, y1))
+			return true; // Off screen entirely
+		return Test(x0 / TILE_W, y0 / TILE_H, x1 / TILE_W, y1 / TILE_H, fMinZ, true);
+	}
+
+	// True if everything at depth fMaxZ or nearer inside the rectangle passes the depth test
+	bool IsFullyVisible(int x0, int y0, int x1, int y1, float fMaxZ) const
+	{
+		if (!ClipRect(x0, y0, x1, y1))
+			return false;
+		return Test(x0 / TILE_W, y0 / TILE_H, x1 / TILE_W, y1 / TILE_H, fMaxZ, false);
+	}
+
+private:
+	struct level
+	{
+		int w = 0, h = 0;
+		std::vector<float> vecMin;
+		std::vector<float> vecMax;
+	};
+
+	bool ClipRect(int& x0, int& y0, int& x1, int& y1) const
+	{
+		x0 = (std::max)(x0, 0);	y0 = (std::max)(y0, 0);
+		x1 = (std::min)(x1, m_nWidth - 1);	y1 = (std::min)(y1, m_nHeight - 1);
+		return !m_vecLevels.empty() && x0 <= x1 && y0 <= y1;
+	}
+
+	// Walk down from the root, only refining nodes the coarse bound can not decide.
+	// Rect is in level 0 tile coordinates
+	bool Test(int tx0, int ty0, int tx1, int ty1, float z, bool bOcclusion) const
+	{
+		int nTop = (int)m_vecLevels.size() - 1;
+		return TestNode(nTop, 0, 0, tx0, ty0, tx1, ty1, z, bOcclusion);
+	}
+
+	bool TestNode(int nLevel, int nx, int ny, int tx0, int ty0, int tx1, int ty1, float z, bool bOcclusion) const
+	{
+		const level& l = m_vecLevels[nLevel];
+		int i = ny * l.w + nx;
+		if (bOcclusion ? (l.vecMax[i] < z) : (z < l.vecMin[i]))
+			return true;
+		if (nLevel == 0)
+			return false;
+
+		// Children overlapping the rect, all must pass
+		const level& c = m_vecLevels[nLevel - 1];
+		int nShift = nLevel - 1;
+		for (int cy = ny * 2; cy < (std::min)(ny * 2 + 2, c.h); cy++)
+		{
+			for (int cx = nx * 2; cx < (std::min)(nx * 2 + 2, c.w); cx++)
+			{
+				// Extent of the child in level 0 tiles
+				int cx0 = cx << nShift, cx1 = ((cx + 1) << nShift) - 1;
+				int cy0 = cy << nShift, cy1 = ((cy + 1) << nShift) - 1;
+				if (cx1 < tx0 || cx0 > tx1 || cy1 < ty0 || cy0 > ty1)
+					continue;
+				if (!TestNode(nLevel - 1, cx, cy, tx0, ty0, tx1, ty1, z, bOcclusion))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	int m_nWidth = 0;
+	int m_nHeight = 0;
+	std::vector<level> m_vecLevels;
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "engine_utils.h"
+
+// Binary mesh cache, written next to the source as "<file>.akmc" the first time
+// an OBJ is loaded. Layout:
+//
+//	mesh_cache_header
+//	vertices	nVerts     x vec3d		(aligned to MESH_CACHE_ALIGN)
+//	indices		nTriangles x 3 uint32	(aligned)
+//	normals		nTriangles x vec3d		(aligned)
+//
+// The blocks are used in place from the mapping, nothing is parsed or copied.
+// A cache is valid while the source's size and modification time match; if only
+// the time changed (fresh checkout, touch) the source bytes are hashed and
+// compared before falling back to a full parse.
+
+#define MESH_CACHE_VERSION	2
+#define MESH_CACHE_ALIGN	64
+
+struct mesh_cache_header
+{
+	char		magic[4];		// "AKMC"
+	uint32_t	nVersion;
+	uint32_t	nHeaderSize;	// sizeof(mesh_cache_header), guards against layout changes
+	uint32_t	nReserved;
+
+	uint64_t	nSourceSize;
+	int64_t		nSourceTime;
+	uint64_t	nSourceHash;
+
+	uint64_t	nVerts;
+	uint64_t	nTriangles;
+	uint64_t	nVertexOffset;
+	uint64_t	nIndexOffset;
+	uint64_t	nNormalOffset;
+
+	float		vBoundsMin[3];
+	float		vBoundsMax[3];
+	float		vSphere[4];		// centre and radius
+};
+
+struct mesh_load_info
+{
+	bool bFromCache = false;
+	obj_parse_stats stats;	// filled when the source was parsed
+	double fSeconds = 0.0;	// total, including validation and writing the cache
+};
+
+static bool MeshCacheSourceInfo(const std::string& sFilename, uint64_t& nSize, int64_t& nTime)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(sFilename.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(sFilename.c_str(), &st) != 0)
+		return false;
+#endif
+	nSize = (uint64_t)st.st_size;
+	nTime = (int64_t)st.st_mtime;
+	return true;
+}
+
+// 64 bit FNV-1a over 8 byte words, far cheaper than parsing the source again
+static uint64_t MeshCacheHash(const char* pData, size_t nSize)
+{
+	uint64_t h = 14695981039346656037ull;
+	size_t i = 0;
+	for (; i + 8 <= nSize; i += 8)
+	{
+		uint64_t w;
+		std::memcpy(&w, pData + i, sizeof(w));
+		h = (h ^ w) * 1099511628211ull;
+	}
+	for (; i < nSize; i++)
+		h = (h ^ (uint8_t)pData[i]) * 1099511628211ull;
+	return h;
+}
+
+static bool MeshCacheHashFile(const std::string& sFilename, uint64_t& nHash)
+{
+	mapped_file file;
+	if (!file.Open(sFilename))
+		return false;
+	nHash = MeshCacheHash(file.Data(), file.Size());
+	return true;
+}
+
+static FILE* MeshCacheOpen(const std::string& sFilename, const char* sMode)
+{
+#ifdef _MSC_VER
+	FILE* f = nullptr;
+	if (fopen_s(&f, sFilename.c_str(), sMode) != 0)
+		return nullptr;
+	return f;
+#else
+	return std::fopen(sFilename.c_str(), sMode);
+#endif
+}
+
+static uint64_t MeshCacheAlign(uint64_t n)
+{
+	return (n + MESH_CACHE_ALIGN - 1) & ~(uint64_t)(MESH_CACHE_ALIGN - 1);
+}
+
+static bool WriteMeshCache(const std::string& sCacheFile, const indexed_mesh& m, uint64_t nSourceSize, int64_t nSourceTime, uint64_t nSourceHash)
+{
+	mesh_cache_header h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, "AKMC", 4);
+	h.nVersion = MESH_CACHE_VERSION;
+	h.nHeaderSize = sizeof(mesh_cache_header);
+	h.nSourceSize = nSourceSize;
+	h.nSourceTime = nSourceTime;
+	h.nSourceHash = nSourceHash;
+	h.nVerts = m.VertexCount();
+	h.nTriangles = m.TriangleCount();
+	h.nVertexOffset = MeshCacheAlign(sizeof(h));
+	h.nIndexOffset = MeshCacheAlign(h.nVertexOffset + h.nVerts * sizeof(vec3d));
+	h.nNormalOffset = MeshCacheAlign(h.nIndexOffset + h.nTriangles * 3 * sizeof(uint32_t));
+	h.vBoundsMin[0] = m.vBoundsMin.x; h.vBoundsMin[1] = m.vBoundsMin.y; h.vBoundsMin[2] = m.vBoundsMin.z;
+	h.vBoundsMax[0] = m.vBoundsMax.x; h.vBoundsMax[1] = m.vBoundsMax.y; h.vBoundsMax[2] = m.vBoundsMax.z;
+	h.vSphere[0] = m.vSphereCenter.x; h.vSphere[1] = m.vSphereCenter.y; h.vSphere[2] = m.vSphereCenter.z; h.vSphere[3] = m.fSphereRadius;
+
+	// Write to a temporary and swap it in, so a crash never leaves a half written cache
+	std::string sTemp = sCacheFile + ".tmp";
+	FILE* f = MeshCacheOpen(sTemp, "wb");
+	if (f == nullptr)
+		return false;
+
+	static const char padding[MESH_CACHE_ALIGN] = { 0 };
+	uint64_t nPos = sizeof(h);
+	auto writeBlock = [&](uint64_t nOffset, const void* pData, size_t nBytes)
+	{
+		size_t nPad = (size_t)(nOffset - nPos);
+		if (std::fwrite(padding, 1, nPad, f) != nPad)
+			return false;
+		if (nBytes != 0 && std::fwrite(pData, 1, nBytes, f) != nBytes)
+			return false;
+		nPos = nOffset + nBytes;
+		return true;
+	};
+
+	bool bOk = std::fwrite(&h, sizeof(h), 1, f) == 1
+		&& writeBlock(h.nVertexOffset, m.Verts(), (size_t)h.nVerts * sizeof(vec3d))
+		&& writeBlock(h.nIndexOffset, m.Indices(), (size_t)h.nTriangles * 3 * sizeof(uint32_t))
+		&& writeBlock(h.nNormalOffset, m.Normals(), (size_t)h.nTriangles * sizeof(vec3d));
+	bOk = (std::fclose(f) == 0) && bOk;
+
+	if (bOk)
+	{
+		std::remove(sCacheFile.c_str());
+		bOk = std::rename(sTemp.c_str(), sCacheFile.c_str()) == 0;
+	}
+	if (!bOk)
+		std::remove(sTemp.c_str());
+	return bOk;
+}
+
+// Map a cache file and point the mesh at its blocks. Fails if the file is not a cache
+// of this version, is truncated or indexes past its vertices, which leaves the caller
+// to parse the source; source validation is up to the caller as well
+static bool MapMeshCache(const std::string& sCacheFile, indexed_mesh& m, mesh_cache_header& h)
+{
+	auto pFile = std::make_shared<mapped_file>();
+	if (!pFile->Open(sCacheFile) || pFile->Size() < sizeof(mesh_cache_header))
+		return false;
+
+	std::memcpy(&h, pFile->Data(), sizeof(h));
+	if (std::memcmp(h.magic, "AKMC", 4) != 0 || h.nVersion != MESH_CACHE_VERSION || h.nHeaderSize != sizeof(mesh_cache_header))
+		return false;
+
+	// Counts come from the file, so they are checked by dividing the room left rather
+	// than multiplying them out, which a corrupt count could overflow
+	uint64_t nSize = pFile->Size();
+	auto fits = [nSize](uint64_t nOffset, uint64_t nCount, uint64_t nElementSize)
+	{
+		return nOffset % MESH_CACHE_ALIGN == 0 && nOffset <= nSize && nCount <= (nSize - nOffset) / nElementSize;
+	};
+	if (!fits(h.nVertexOffset, h.nVerts, sizeof(vec3d))
+		|| !fits(h.nIndexOffset, h.nTriangles, 3 * sizeof(uint32_t))
+		|| !fits(h.nNormalOffset, h.nTriangles, sizeof(vec3d)))
+		return false;
+
+	// One pass over the indices is still far cheaper than a parse, and everything
+	// downstream indexes the vertices without checking
+	const uint32_t* pIndices = (const uint32_t*)(pFile->Data() + h.nIndexOffset);
+	for (uint64_t i = 0; i < h.nTriangles * 3; i++)
+		if (pIndices[i] >= h.nVerts)
+			return false;
+
+	m.verts.clear();
+	m.indices.clear();
+	m.normals.clear();
+	m.pMappedVerts = (const vec3d*)(pFile->Data() + h.nVertexOffset);
+	m.pMappedIndices = pIndices;
+	m.pMappedNormals = (const vec3d*)(pFile->Data() + h.nNormalOffset);
+	m.nMappedVerts = (size_t)h.nVerts;
+	m.nMappedIndices = (size_t)h.nTriangles * 3;
+	m.vBoundsMin = vec3d(h.vBoundsMin[0], h.vBoundsMin[1], h.vBoundsMin[2]);
+	m.vBoundsMax = vec3d(h.vBoundsMax[0], h.vBoundsMax[1], h.vBoundsMax[2]);
+	m.vSphereCenter = vec3d(h.vSphere[0], h.vSphere[1], h.vSphere[2]);
+	m.fSphereRadius = h.vSphere[3];
+	m.pMapping = pFile;
+	return true;
+}
+
+// Load an OBJ through its binary cache, parsing the source and (re)writing the
+// cache only when the cache is missing or stale
+static bool LoadMeshCached(const std::string& sFilename, indexed_mesh& m, mesh_load_info* pInfo = nullptr)
+{
+	auto tp1 = std::chrono::steady_clock::now();
+	mesh_load_info info;
+
+	uint64_t nSourceSize = 0;
+	int64_t nSourceTime = 0;
+	bool bHaveSource = MeshCacheSourceInfo(sFilename, nSourceSize, nSourceTime);
+
+	std::string sCacheFile = sFilename + ".akmc";
+	mesh_cache_header h;
+	bool bValid = false;
+	uint64_t nSourceHash = 0;
+	bool bHashed = false;
+
+	if (MapMeshCache(sCacheFile, m, h))
+	{
+		if (!bHaveSource)
+			bValid = true; // Shipped without the source, trust the cache
+		else if (h.nSourceSize == nSourceSize && h.nSourceTime == nSourceTime)
+			bValid = true;
+		else if (h.nSourceSize == nSourceSize && MeshCacheHashFile(sFilename, nSourceHash))
+		{
+			bHashed = true;
+			bValid = h.nSourceHash == nSourceHash;
+		}
+
+		if (!bValid)
+			m.pMapping.reset();
+		else if (bHashed)
+		{
+			// Same content under a new timestamp, refresh the header so the next run skips
+			// the hash. Unmapped first, Windows will not write to a mapped file
+			m.pMapping.reset();
+			h.nSourceTime = nSourceTime;
+			FILE* f = MeshCacheOpen(sCacheFile, "r+b");
+			if (f)
+			{
+				std::fwrite(&h, sizeof(h), 1, f);
+				std::fclose(f);
+			}
+			bValid = MapMeshCache(sCacheFile, m, h);
+		}
+	}
+
+	if (!bValid)
+	{
+		if (!bHaveSource || !m.LoadFromObjectFile(sFilename, &info.stats))
+			return false;
+
+		if (!bHashed)
+			MeshCacheHashFile(sFilename, nSourceHash);
+
+		// A failed write only costs the next startup a parse
+		WriteMeshCache(sCacheFile, m, nSourceSize, nSourceTime, nSourceHash);
+	}
+
+	info.bFromCache = bValid;
+	info.fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tp1).count();
+	if (pInfo)
+		*pInfo = info;
+	return true;
+}
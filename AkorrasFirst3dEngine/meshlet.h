@@ -0,0 +1,209 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "engine_utils.h"
+
+// Meshlets: a mesh cut into small clusters of neighbouring triangles, each with at
+// most MESHLET_MAX_VERTS unique vertices and MESHLET_MAX_TRIANGLES triangles. A
+// cluster carries its own vertex list and triangles indexing into it with bytes, so
+// it can be transformed and assembled on its own from a few stack arrays.
+//
+// Every cluster has a bounding sphere and a normal cone (the average face normal
+// and how far the faces stray from it). Per frame, a cluster outside the frustum
+// or facing entirely away from the camera is dropped before any of its vertices
+// are transformed.
+
+#define MESHLET_MAX_VERTS		64
+#define MESHLET_MAX_TRIANGLES	124
+
+struct meshlet
+{
+	uint32_t nVertexOffset;		// into meshlet_mesh::vecVertices
+	uint32_t nTriangleOffset;	// into meshlet_mesh::vecFaces, and times three into vecTriangles
+	uint32_t nVertexCount;
+	uint32_t nTriangleCount;
+
+	// Object space bounding sphere
+	vec3d vCenter;
+	float fRadius;
+
+	// Normal cone: every face normal is within the cone's half angle of vConeAxis.
+	// fConeSin is the sine of that angle, FLT_MAX when the faces spread too far to ever cull
+	vec3d vConeAxis;
+	float fConeSin;
+
+	// Whole cluster faces away from a camera at vCamera (object space). Conservative:
+	// holds for every point of the bounding sphere, so every face would also fail the
+	// per-triangle backface test
+	bool IsBackfacing(const vec3d& vCamera) const
+	{
+		float dx = vCenter.x - vCamera.x, dy = vCenter.y - vCamera.y, dz = vCenter.z - vCamera.z;
+		float fDist = sqrtf(dx * dx + dy * dy + dz * dz);
+		return dx * vConeAxis.x + dy * vConeAxis.y + dz * vConeAxis.z >= fConeSin * fDist + fRadius;
+	}
+};
+
+struct meshlet_mesh
+{
+	std::vector<meshlet>	vecMeshlets;
+	std::vector<uint32_t>	vecVertices;	// mesh vertex index of every cluster's local vertices
+	std::vector<uint8_t>	vecTriangles;	// three local vertex indices per triangle
+	std::vector<uint32_t>	vecFaces;		// mesh face each triangle came from, for its normal
+
+	size_t TriangleCount() const { return vecFaces.size(); }
+};
+
+// Greedy clustering. A cluster grows from a seed triangle over its neighbours,
+// always taking the candidate adding the fewest new vertices so clusters stay
+// compact and share as few vertices as possible; it closes when full or when no
+// neighbour fits. Seeds are taken in face order, which keeps clusters of nearby
+// faces close in memory too
+static void BuildMeshlets(const indexed_mesh& m, meshlet_mesh& out)
+{
+	const vec3d* pVerts = m.Verts();
+	const uint32_t* pIndices = m.Indices();
+	const vec3d* pNormals = m.Normals();
+	uint32_t nTriangles = (uint32_t)m.TriangleCount();
+	uint32_t nVerts = (uint32_t)m.VertexCount();
+
+	out.vecMeshlets.clear();
+	out.vecVertices.clear();
+	out.vecTriangles.clear();
+	out.vecFaces.clear();
+	out.vecTriangles.reserve((size_t)nTriangles * 3);
+	out.vecFaces.reserve(nTriangles);
+
+	// Triangles around each vertex, packed
+	std::vector<uint32_t> vecAdjOffsets(nVerts + 1, 0);
+	for (uint32_t i = 0; i < nTriangles * 3; i++)
+		vecAdjOffsets[pIndices[i] + 1]++;
+	for (uint32_t v = 0; v < nVerts; v++)
+		vecAdjOffsets[v + 1] += vecAdjOffsets[v];
+	std::vector<uint32_t> vecAdj(vecAdjOffsets[nVerts]);
+	{
+		std::vector<uint32_t> vecFill(vecAdjOffsets.begin(), vecAdjOffsets.end() - 1);
+		for (uint32_t i = 0; i < nTriangles * 3; i++)
+			vecAdj[vecFill[pIndices[i]]++] = i / 3;
+	}
+
+	std::vector<bool> vecUsed(nTriangles, false);
+	std::vector<int16_t> vecLocal(nVerts, -1);	// vertex's slot in the open cluster
+	std::vector<uint32_t> vecCandidates;
+	uint32_t nSeed = 0;
+
+	while (true)
+	{
+		while (nSeed < nTriangles && vecUsed[nSeed])
+			nSeed++;
+		if (nSeed == nTriangles)
+			break;
+
+		meshlet ml;
+		ml.nVertexOffset = (uint32_t)out.vecVertices.size();
+		ml.nTriangleOffset = (uint32_t)out.vecFaces.size();
+		ml.nVertexCount = 0;
+		ml.nTriangleCount = 0;
+		vecCandidates.clear();
+
+		uint32_t nNext = nSeed;
+		while (true)
+		{
+			// Take it
+			vecUsed[nNext] = true;
+			for (int k = 0; k < 3; k++)
+			{
+				uint32_t v = pIndices[nNext * 3 + k];
+				if (vecLocal[v] < 0)
+				{
+					vecLocal[v] = (int16_t)ml.nVertexCount++;
+					out.vecVertices.push_back(v);
+				}
+				out.vecTriangles.push_back((uint8_t)vecLocal[v]);
+
+				for (uint32_t a = vecAdjOffsets[v]; a < vecAdjOffsets[v + 1]; a++)
+					if (!vecUsed[vecAdj[a]])
+						vecCandidates.push_back(vecAdj[a]);
+			}
+			out.vecFaces.push_back(nNext);
+			ml.nTriangleCount++;
+			if (ml.nTriangleCount == MESHLET_MAX_TRIANGLES)
+				break;
+
+			// Best neighbour, dropping the ones taken since they were queued
+			int nBestNew = 4;
+			uint32_t nBest = 0;
+			size_t nKept = 0;
+			for (size_t c = 0; c < vecCandidates.size(); c++)
+			{
+				uint32_t t = vecCandidates[c];
+				if (vecUsed[t])
+					continue;
+				vecCandidates[nKept++] = t;
+				if (nBestNew == 0)
+					continue;
+
+				int nNew = (vecLocal[pIndices[t * 3 + 0]] < 0) + (vecLocal[pIndices[t * 3 + 1]] < 0) + (vecLocal[pIndices[t * 3 + 2]] < 0);
+				if (ml.nVertexCount + nNew <= MESHLET_MAX_VERTS && nNew < nBestNew)
+				{
+					nBestNew = nNew;
+					nBest = t;
+				}
+			}
+			vecCandidates.resize(nKept);
+			if (nBestNew == 4)
+				break;
+			nNext = nBest;
+		}
+
+		// Bounds over the cluster's vertices, then release them for the next cluster
+		vec3d vMin = pVerts[out.vecVertices[ml.nVertexOffset]], vMax = vMin;
+		for (uint32_t i = 0; i < ml.nVertexCount; i++)
+		{
+			const vec3d& v = pVerts[out.vecVertices[ml.nVertexOffset + i]];
+			vMin.x = (std::min)(vMin.x, v.x);	vMax.x = (std::max)(vMax.x, v.x);
+			vMin.y = (std::min)(vMin.y, v.y);	vMax.y = (std::max)(vMax.y, v.y);
+			vMin.z = (std::min)(vMin.z, v.z);	vMax.z = (std::max)(vMax.z, v.z);
+		}
+		ml.vCenter = vec3d((vMin.x + vMax.x) * 0.5f, (vMin.y + vMax.y) * 0.5f, (vMin.z + vMax.z) * 0.5f);
+		float fRadiusSq = 0.0f;
+		for (uint32_t i = 0; i < ml.nVertexCount; i++)
+		{
+			uint32_t v = out.vecVertices[ml.nVertexOffset + i];
+			float dx = pVerts[v].x - ml.vCenter.x, dy = pVerts[v].y - ml.vCenter.y, dz = pVerts[v].z - ml.vCenter.z;
+			fRadiusSq = (std::max)(fRadiusSq, dx * dx + dy * dy + dz * dz);
+			vecLocal[v] = -1;
+		}
+		ml.fRadius = sqrtf(fRadiusSq);
+
+		// Cone around the average normal. Past 90 degrees some face always looks back
+		// at the camera, such a cluster is never culled by its cone
+		float ax = 0.0f, ay = 0.0f, az = 0.0f;
+		for (uint32_t t = 0; t < ml.nTriangleCount; t++)
+		{
+			const vec3d& n = pNormals[out.vecFaces[ml.nTriangleOffset + t]];
+			ax += n.x; ay += n.y; az += n.z;
+		}
+		float fLength = sqrtf(ax * ax + ay * ay + az * az);
+		ml.vConeAxis = vec3d(0.0f, 0.0f, 0.0f, 0.0f);
+		ml.fConeSin = FLT_MAX;
+		if (fLength > 0.0f)
+		{
+			ml.vConeAxis = vec3d(ax / fLength, ay / fLength, az / fLength, 0.0f);
+			float fMinDot = 1.0f;
+			for (uint32_t t = 0; t < ml.nTriangleCount; t++)
+			{
+				const vec3d& n = pNormals[out.vecFaces[ml.nTriangleOffset + t]];
+				fMinDot = (std::min)(fMinDot, n.x * ml.vConeAxis.x + n.y * ml.vConeAxis.y + n.z * ml.vConeAxis.z);
+			}
+			if (fMinDot > 0.0f)
+				ml.fConeSin = sqrtf((std::max)(0.0f, 1.0f - fMinDot * fMinDot));
+		}
+
+		out.vecMeshlets.push_back(ml);
+	}
+}
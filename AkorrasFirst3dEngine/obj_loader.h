@@ -0,0 +1,314 @@
+#pragma once
+
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Read-only memory mapping of a whole file. The parser works straight on the
+// mapped bytes, nothing is copied or split into lines
+class mapped_file
+{
+public:
+	mapped_file() {}
+	~mapped_file() { Close(); }
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool Open(const std::string& sFilename)
+	{
+		Close();
+#ifdef _WIN32
+		m_hFile = CreateFileA(sFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_hFile, &size))
+		{
+			Close();
+			return false;
+		}
+		m_nSize = (size_t)size.QuadPart;
+		if (m_nSize == 0)
+			return true; // Empty files cannot be mapped, but are valid
+
+		m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_hMapping == nullptr)
+		{
+			Close();
+			return false;
+		}
+
+		m_pData = (const char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		m_nFile = open(sFilename.c_str(), O_RDONLY);
+		if (m_nFile < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(m_nFile, &st) != 0)
+		{
+			Close();
+			return false;
+		}
+		m_nSize = (size_t)st.st_size;
+		if (m_nSize == 0)
+			return true;
+
+		void* p = mmap(nullptr, m_nSize, PROT_READ, MAP_PRIVATE, m_nFile, 0);
+		if (p != MAP_FAILED)
+		{
+			madvise(p, m_nSize, MADV_SEQUENTIAL);
+			m_pData = (const char*)p;
+		}
+#endif
+		if (m_pData == nullptr)
+		{
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (m_pData)	UnmapViewOfFile(m_pData);
+		if (m_hMapping)	CloseHandle(m_hMapping);
+		if (m_hFile != INVALID_HANDLE_VALUE) CloseHandle(m_hFile);
+		m_hMapping = nullptr;
+		m_hFile = INVALID_HANDLE_VALUE;
+#else
+		if (m_pData)	munmap((void*)m_pData, m_nSize);
+		if (m_nFile >= 0) close(m_nFile);
+		m_nFile = -1;
+#endif
+		m_pData = nullptr;
+		m_nSize = 0;
+	}
+
+	const char* Data() const { return m_pData; }
+	size_t Size() const { return m_nSize; }
+
+private:
+	const char* m_pData = nullptr;
+	size_t m_nSize = 0;
+#ifdef _WIN32
+	HANDLE m_hFile = INVALID_HANDLE_VALUE;
+	HANDLE m_hMapping = nullptr;
+#else
+	int m_nFile = -1;
+#endif
+};
+
+struct obj_parse_stats
+{
+	size_t nBytes = 0;
+	size_t nVerts = 0;
+	size_t nFaces = 0;		// polygons as written in the file
+	size_t nTriangles = 0;	// after fan triangulation
+	size_t nSkippedFaces = 0;	// faces referencing vertices that do not exist
+	double fSeconds = 0.0;
+
+	double MegabytesPerSecond() const
+	{
+		return fSeconds > 0.0 ? ((double)nBytes / (1024.0 * 1024.0)) / fSeconds : 0.0;
+	}
+};
+
+// Locale-free number parsing. Each function returns the position after the
+// number, or 'p' unchanged if there was no number to read
+static inline bool ObjIsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* ObjSkipSpace(const char* p, const char* end)
+{
+	while (p < end && ObjIsSpace(*p)) p++;
+	return p;
+}
+
+// Values too big for an int saturate to INT_MAX or INT_MIN, the digits are still consumed
+static inline const char* ObjParseInt(const char* p, const char* end, int& out)
+{
+	const char* start = p;
+	bool bNeg = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		bNeg = *p++ == '-';
+
+	const char* digits = p;
+	int64_t v = 0;
+	while (p < end && (unsigned)(*p - '0') < 10)
+	{
+		v = v * 10 + (*p++ - '0');
+		if (v > (int64_t)INT_MAX + 1)
+			v = (int64_t)INT_MAX + 1;
+	}
+
+	if (p == digits)
+		return start;
+
+	out = bNeg ? (int)(std::max)(-v, (int64_t)INT_MIN) : (int)(std::min)(v, (int64_t)INT_MAX);
+	return p;
+}
+
+static inline const char* ObjParseFloat(const char* p, const char* end, float& out)
+{
+	// Exact powers of ten representable as doubles
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	const char* start = p;
+	bool bNeg = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		bNeg = *p++ == '-';
+
+	// Accumulate up to 19 significant digits, anything after that only moves the exponent
+	uint64_t mantissa = 0;
+	int nSignificant = 0;
+	int nExponent = 0;
+	bool bAnyDigits = false;
+
+	while (p < end && (unsigned)(*p - '0') < 10)
+	{
+		if (nSignificant < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) nSignificant++;
+		}
+		else
+			nExponent++;
+		bAnyDigits = true;
+		p++;
+	}
+
+	if (p < end && *p == '.')
+	{
+		p++;
+		while (p < end && (unsigned)(*p - '0') < 10)
+		{
+			if (nSignificant < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa) nSignificant++;
+				nExponent--;
+			}
+			bAnyDigits = true;
+			p++;
+		}
+	}
+
+	if (!bAnyDigits)
+		return start;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		int e = 0;
+		const char* q = ObjParseInt(p + 1, end, e);
+		if (q != p + 1)
+		{
+			// Far past float range either way, and small enough not to overflow the sum
+			nExponent += (std::max)(-100000, (std::min)(e, 100000));
+			p = q;
+		}
+	}
+
+	double v = (double)mantissa;
+	if (mantissa != 0)
+	{
+		if (nExponent < 0)
+			v = nExponent >= -22 ? v / pow10[-nExponent] : v * std::pow(10.0, (double)nExponent);
+		else if (nExponent > 0)
+			v = nExponent <= 22 ? v * pow10[nExponent] : v * std::pow(10.0, (double)nExponent);
+	}
+
+	out = (float)(bNeg ? -v : v);
+	return p;
+}
+
+// Walks an OBJ buffer line by line. Only 'v' positions and 'f' faces are of
+// interest, everything else (vt, vn, o, g, s, usemtl, comments...) is skipped.
+//
+//	onVertex(float x, float y, float z)
+//	onFace(const int* corners, int nCorners, size_t nVertsSoFar)
+//
+// Face corners are passed through as written (1-based, or negative to count back
+// from the latest vertex) with any /vt/vn part stripped, so the caller can
+// resolve them against its own vertex numbering. 'nVertsSoFar' counts the
+// vertices parsed from this buffer before the face.
+template<typename OnVertex, typename OnFace>
+static void ObjParseBuffer(const char* p, const char* end, OnVertex&& onVertex, OnFace&& onFace)
+{
+	std::vector<int> vecCorners;
+	vecCorners.reserve(16);
+	size_t nVerts = 0;
+
+	while (p < end)
+	{
+		p = ObjSkipSpace(p, end);
+		const char* eol = (const char*)std::memchr(p, '\n', end - p);
+		if (eol == nullptr)
+			eol = end;
+
+		if (eol - p >= 2 && p[0] == 'v' && ObjIsSpace(p[1]))
+		{
+			float xyz[3] = { 0.0f, 0.0f, 0.0f };
+			const char* q = p + 2;
+			for (int k = 0; k < 3; k++)
+				q = ObjParseFloat(ObjSkipSpace(q, eol), eol, xyz[k]);
+
+			onVertex(xyz[0], xyz[1], xyz[2]);
+			nVerts++;
+		}
+		else if (eol - p >= 2 && p[0] == 'f' && ObjIsSpace(p[1]))
+		{
+			vecCorners.clear();
+			const char* q = p + 2;
+			while (true)
+			{
+				q = ObjSkipSpace(q, eol);
+				int idx = 0;
+				const char* next = ObjParseInt(q, eol, idx);
+				if (next == q)
+					break;
+				// A saturated corner was out of range as written, 0 marks it invalid
+				vecCorners.push_back(idx == INT_MAX || idx == INT_MIN ? 0 : idx);
+
+				// Skip "/vt/vn", "//vn" or "/vt"
+				q = next;
+				while (q < eol && !ObjIsSpace(*q)) q++;
+			}
+
+			if (vecCorners.size() >= 3)
+				onFace(vecCorners.data(), (int)vecCorners.size(), nVerts);
+		}
+
+		p = eol < end ? eol + 1 : end;
+	}
+}
+
+// Resolve an OBJ corner to a 0-based vertex index, -1 if it cannot be valid
+static inline int64_t ObjResolveIndex(int nCorner, size_t nVertsSoFar)
+{
+	if (nCorner > 0)
+		return (int64_t)nCorner - 1;
+	if (nCorner < 0)
+		return (int64_t)nVertsSoFar + nCorner;
+	return -1;
+}
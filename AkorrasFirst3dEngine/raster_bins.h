@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "frame_arena.h"
+
+// Screen split into fixed size tiles, each holding the indices of the triangles
+// whose bounding box touches it. Binning is split into chunks of consecutive
+// triangles that can be filled in parallel; reading a tile walks the chunks in
+// order, so every tile sees its triangles in submission order no matter how the
+// binning was scheduled. Bin storage comes from the frame arena.
+class raster_bins
+{
+public:
+	void Create(int nScreenWidth, int nScreenHeight, int nTileWidth, int nTileHeight, unsigned nChunks)
+	{
+		m_nScreenWidth = nScreenWidth;
+		m_nScreenHeight = nScreenHeight;
+		m_nTileWidth = nTileWidth;
+		m_nTileHeight = nTileHeight;
+		m_nTilesX = (nScreenWidth + nTileWidth - 1) / nTileWidth;
+		m_nTilesY = (nScreenHeight + nTileHeight - 1) / nTileHeight;
+		m_nChunks = nChunks == 0 ? 1 : nChunks;
+		m_vecBins.assign((size_t)m_nChunks * m_nTilesX * m_nTilesY, arena_vector<uint32_t>());
+	}
+
+	// Empties every bin, new entries are allocated from the arena. The old bins are
+	// abandoned, so this is safe after the arena was Reset
+	void Clear(frame_arena& arena)
+	{
+		for (auto& b : m_vecBins)
+			ArenaReset(b, arena);
+	}
+
+	unsigned ChunkCount() const { return m_nChunks; }
+	int TileCount() const { return m_nTilesX * m_nTilesY; }
+
+	// Range of triangles chunk nChunk is responsible for
+	void ChunkRange(unsigned nChunk, size_t nTriangles, size_t& nBegin, size_t& nEnd) const
+	{
+		nBegin = nTriangles * nChunk / m_nChunks;
+		nEnd = nTriangles * (nChunk + 1) / m_nChunks;
+	}
+
+	// Inclusive cell rectangle of a tile
+	void TileRect(int nTile, int& x0, int& y0, int& x1, int& y1) const
+	{
+		x0 = (nTile % m_nTilesX) * m_nTileWidth;
+		y0 = (nTile / m_nTilesX) * m_nTileHeight;
+		x1 = (std::min)(x0 + m_nTileWidth, m_nScreenWidth) - 1;
+		y1 = (std::min)(y0 + m_nTileHeight, m_nScreenHeight) - 1;
+	}
+
+	// Bin a triangle by its screen space bounds. Conservative, the rasterizer decides
+	// which cells are really covered. Only one thread may add to a given chunk
+	void Add(unsigned nChunk, uint32_t nIndex, float fMinX, float fMinY, float fMaxX, float fMaxY)
+	{
+		if (!(fMaxX >= 0.0f && fMaxY >= 0.0f && fMinX < (float)m_nScreenWidth && fMinY < (float)m_nScreenHeight))
+			return; // Off screen, or NaN
+
+		int x0 = (int)(std::max)(0.0f, floorf(fMinX)) / m_nTileWidth;
+		int y0 = (int)(std::max)(0.0f, floorf(fMinY)) / m_nTileHeight;
+		int x1 = (int)(std::min)((float)(m_nScreenWidth - 1), fMaxX) / m_nTileWidth;
+		int y1 = (int)(std::min)((float)(m_nScreenHeight - 1), fMaxY) / m_nTileHeight;
+
+		arena_vector<uint32_t>* pBins = &m_vecBins[(size_t)nChunk * m_nTilesX * m_nTilesY];
+		for (int ty = y0; ty <= y1; ty++)
+			for (int tx = x0; tx <= x1; tx++)
+				pBins[ty * m_nTilesX + tx].push_back(nIndex);
+	}
+
+	bool TileEmpty(int nTile) const
+	{
+		size_t nStride = (size_t)m_nTilesX * m_nTilesY;
+		for (unsigned c = 0; c < m_nChunks; c++)
+			if (!m_vecBins[c * nStride + nTile].empty())
+				return false;
+		return true;
+	}
+
+	// Calls fn(uint32_t nIndex) for the tile's triangles in submission order
+	template<typename Fn>
+	void ForEachInTile(int nTile, Fn&& fn) const
+	{
+		size_t nStride = (size_t)m_nTilesX * m_nTilesY;
+		for (unsigned c = 0; c < m_nChunks; c++)
+			for (uint32_t i : m_vecBins[c * nStride + nTile])
+				fn(i);
+	}
+
+private:
+	int m_nScreenWidth = 0, m_nScreenHeight = 0;
+	int m_nTileWidth = 1, m_nTileHeight = 1;
+	int m_nTilesX = 0, m_nTilesY = 0;
+	unsigned m_nChunks = 1;
+	std::vector<arena_vector<uint32_t>> m_vecBins;	// [chunk][tile]
+};
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "engine_utils.h"
+#include "bvh.h"
+#include "meshlet.h"
+#include "simplify.h"
+
+// View frustum as six planes pulled straight out of a view * projection matrix.
+// With row vectors clip = v * M, so column j of M computes clip component j and
+// the inside tests -w <= x <= w, -w <= y <= w, 0 <= z <= w become
+//
+//	col3 + col0 >= 0,	col3 - col0 >= 0,	col3 + col1 >= 0,	col3 - col1 >= 0,	col2 >= 0,	col3 - col2 >= 0
+//
+// Planes are kept as (a, b, c, d) with a unit normal pointing inwards, so
+// a*x + b*y + c*z + d is the signed distance of a world space point.
+struct frustum
+{
+	float plane[6][4];
+
+	static frustum FromMatrix(const mat4x4& mat)
+	{
+		static const int nColumn[6] = { 0, 0, 1, 1, 2, 2 };
+		static const float fSign[6] = { 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f };
+		static const float fUseW[6] = { 1.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f };	// near is z >= 0, no w
+
+		frustum f;
+		for (int p = 0; p < 6; p++)
+		{
+			for (int r = 0; r < 4; r++)
+				f.plane[p][r] = fUseW[p] * mat.m[r][3] + fSign[p] * mat.m[r][nColumn[p]];
+
+			float fLength = sqrtf(f.plane[p][0] * f.plane[p][0] + f.plane[p][1] * f.plane[p][1] + f.plane[p][2] * f.plane[p][2]);
+			float fInv = fLength > 0.0f ? 1.0f / fLength : 0.0f;
+			for (int r = 0; r < 4; r++)
+				f.plane[p][r] *= fInv;
+		}
+		return f;
+	}
+
+	float Distance(int p, const vec3d& v) const
+	{
+		return plane[p][0] * v.x + plane[p][1] * v.y + plane[p][2] * v.z + plane[p][3];
+	}
+
+	// Outside if the sphere lies entirely behind any plane. Sets bInside when it is
+	// entirely in front of all of them, nothing more needs testing then
+	bool CullSphere(const vec3d& vCenter, float fRadius, bool& bInside) const
+	{
+		bInside = true;
+		for (int p = 0; p < 6; p++)
+		{
+			float d = Distance(p, vCenter);
+			if (d < -fRadius)
+				return true;
+			if (d < fRadius)
+				bInside = false;
+		}
+		return false;
+	}
+
+	// Outside if the box's most inward corner is behind any plane
+	bool CullBox(const vec3d& vMin, const vec3d& vMax) const
+	{
+		for (int p = 0; p < 6; p++)
+		{
+			vec3d v(plane[p][0] >= 0.0f ? vMax.x : vMin.x,
+					plane[p][1] >= 0.0f ? vMax.y : vMin.y,
+					plane[p][2] >= 0.0f ? vMax.z : vMin.z);
+			if (Distance(p, v) < 0.0f)
+				return true;
+		}
+		return false;
+	}
+};
+
+// A mesh placed in the world. The bounds are world space, derived from the mesh's
+// object space bounds whenever the transform changes
+struct scene_object
+{
+	const indexed_mesh* pMesh = nullptr;
+	uint32_t nMesh = 0;		// the mesh's slot in the scene, for its triangle hierarchy
+	uint32_t nLod = 0;		// detail level drawn last, 0 is the mesh itself
+	mat4x4 matWorld;
+
+	vec3d vSphereCenter;
+	float fSphereRadius = 0.0f;
+	vec3d vBoundsMin;
+	vec3d vBoundsMax;
+
+	void UpdateBounds()
+	{
+		const indexed_mesh& m = *pMesh;
+
+		// Rows 0-2 are where the object's axes end up, the longest one scales the radius
+		float fScale = 0.0f;
+		for (int r = 0; r < 3; r++)
+			fScale = (std::max)(fScale, matWorld.m[r][0] * matWorld.m[r][0] + matWorld.m[r][1] * matWorld.m[r][1] + matWorld.m[r][2] * matWorld.m[r][2]);
+		vSphereCenter = matWorld * m.vSphereCenter;
+		fSphereRadius = m.fSphereRadius * sqrtf(fScale);
+
+		// Box centre goes through the matrix, the half extents through its absolute value
+		vec3d vCenter((m.vBoundsMin.x + m.vBoundsMax.x) * 0.5f, (m.vBoundsMin.y + m.vBoundsMax.y) * 0.5f, (m.vBoundsMin.z + m.vBoundsMax.z) * 0.5f);
+		float e[3] = { (m.vBoundsMax.x - m.vBoundsMin.x) * 0.5f, (m.vBoundsMax.y - m.vBoundsMin.y) * 0.5f, (m.vBoundsMax.z - m.vBoundsMin.z) * 0.5f };
+		vCenter = matWorld * vCenter;
+		float fExtent[3];
+		for (int c = 0; c < 3; c++)
+			fExtent[c] = fabsf(matWorld.m[0][c]) * e[0] + fabsf(matWorld.m[1][c]) * e[1] + fabsf(matWorld.m[2][c]) * e[2];
+		vBoundsMin = vec3d(vCenter.x - fExtent[0], vCenter.y - fExtent[1], vCenter.z - fExtent[2]);
+		vBoundsMax = vec3d(vCenter.x + fExtent[0], vCenter.y + fExtent[1], vCenter.z + fExtent[2]);
+	}
+};
+
+// Closest surface found by a ray query
+struct scene_hit
+{
+	uint32_t nObject = UINT32_MAX;
+	uint32_t nTriangle = 0;
+	float t = FLT_MAX;		// along the query direction, in its units
+	vec3d vPoint;			// world space
+};
+
+// Everything placed in the world, with two levels of bounding volume hierarchy on
+// top: one over the objects' world boxes for culling and ray queries, and one per
+// unique mesh over its triangles in object space, shared by every copy of the mesh.
+// Unique meshes can also be cut into meshlets once, for cluster culling, and get a
+// chain of simplified versions for distant copies. Meshes must outlive the scene.
+//
+// Call BuildHierarchy() once the objects are placed. Moving an object afterwards
+// refits the object tree in place; when the refits have made it noticeably worse
+// than a fresh build, RebuildIfDegraded() starts over. Without a hierarchy the
+// queries fall back to scanning every object.
+class scene
+{
+public:
+	uint32_t Add(const indexed_mesh& mesh, const mat4x4& matWorld)
+	{
+		scene_object obj;
+		obj.pMesh = &mesh;
+		obj.nMesh = MeshSlot(mesh);
+		obj.matWorld = matWorld;
+		obj.UpdateBounds();
+		m_vecObjects.push_back(obj);
+		m_bvhObjects.Clear();
+		return (uint32_t)m_vecObjects.size() - 1;
+	}
+
+	void SetTransform(uint32_t nObject, const mat4x4& matWorld)
+	{
+		m_vecObjects[nObject].matWorld = matWorld;
+		m_vecObjects[nObject].UpdateBounds();
+		if (!m_bvhObjects.Empty())
+			m_bvhObjects.Refit(nObject, ObjectBounds());
+	}
+
+	void Clear()
+	{
+		m_vecObjects.clear();
+		m_vecMeshes.clear();
+		m_bvhObjects.Clear();
+	}
+
+	uint32_t ObjectCount() const { return (uint32_t)m_vecObjects.size(); }
+	const scene_object& Object(uint32_t nObject) const { return m_vecObjects[nObject]; }
+
+	void BuildHierarchy()
+	{
+		m_bvhObjects.Build((uint32_t)m_vecObjects.size(), ObjectBounds());
+		for (mesh_entry& e : m_vecMeshes)
+		{
+			// Ray queries always see full detail
+			if (!e.bvhTriangles.Empty() || e.bLod)
+				continue;
+			const vec3d* pVerts = e.pMesh->Verts();
+			const uint32_t* pIndices = e.pMesh->Indices();
+			e.bvhTriangles.Build((uint32_t)e.pMesh->TriangleCount(), [pVerts, pIndices](uint32_t t, vec3d& vMin, vec3d& vMax)
+			{
+				const vec3d& a = pVerts[pIndices[t * 3 + 0]];
+				const vec3d& b = pVerts[pIndices[t * 3 + 1]];
+				const vec3d& c = pVerts[pIndices[t * 3 + 2]];
+				vMin = vec3d((std::min)(a.x, (std::min)(b.x, c.x)), (std::min)(a.y, (std::min)(b.y, c.y)), (std::min)(a.z, (std::min)(b.z, c.z)));
+				vMax = vec3d((std::max)(a.x, (std::max)(b.x, c.x)), (std::max)(a.y, (std::max)(b.y, c.y)), (std::max)(a.z, (std::max)(b.z, c.z)));
+			});
+		}
+	}
+
+	// Cluster every unique mesh that has not been yet
+	void BuildMeshlets()
+	{
+		for (mesh_entry& e : m_vecMeshes)
+			if (e.meshlets.vecMeshlets.empty())
+				::BuildMeshlets(*e.pMesh, e.meshlets);
+	}
+
+	// Empty until BuildMeshlets() has run
+	const meshlet_mesh& Meshlets(uint32_t nMesh) const { return m_vecMeshes[nMesh].meshlets; }
+
+	const indexed_mesh& Mesh(uint32_t nMesh) const { return *m_vecMeshes[nMesh].pMesh; }
+
+	// Simplify every unique mesh into up to nMaxLevels coarser versions, each with
+	// fRatio of the triangles of the one before. The chain stops early once a level
+	// would drop under nMinTriangles or simplification stops making progress. Each
+	// level is a mesh slot of its own; run before BuildMeshlets so they get clustered
+	void BuildLods(uint32_t nMaxLevels = 4, float fRatio = 0.5f, size_t nMinTriangles = 64)
+	{
+		uint32_t nMeshes = (uint32_t)m_vecMeshes.size();
+		for (uint32_t i = 0; i < nMeshes; i++)
+		{
+			if (m_vecMeshes[i].bLod || !m_vecMeshes[i].vecLods.empty())
+				continue;
+
+			const indexed_mesh* pPrev = m_vecMeshes[i].pMesh;
+			for (uint32_t nLevel = 0; nLevel < nMaxLevels; nLevel++)
+			{
+				size_t nTarget = (size_t)(pPrev->TriangleCount() * fRatio);
+				if (nTarget < nMinTriangles)
+					break;
+
+				std::unique_ptr<indexed_mesh> pLod(new indexed_mesh());
+				if (!SimplifyMesh(*pPrev, *pLod, nTarget) || pLod->TriangleCount() > pPrev->TriangleCount() * 9 / 10)
+					break;
+
+				mesh_entry e;
+				e.pMesh = pLod.get();
+				e.pOwned = std::move(pLod);
+				e.bLod = true;
+				pPrev = e.pMesh;
+				m_vecMeshes[i].vecLods.push_back((uint32_t)m_vecMeshes.size());
+				m_vecMeshes.push_back(std::move(e));
+			}
+		}
+	}
+
+	// Levels available for the object's mesh, including the mesh itself
+	uint32_t LodCount(uint32_t nObject) const { return (uint32_t)m_vecMeshes[m_vecObjects[nObject].nMesh].vecLods.size() + 1; }
+
+	// Pick the level to draw an object with and return its mesh slot. fTriangleBudget is
+	// how many triangles its size on screen can use; the coarsest level with at least
+	// that many is wanted. To stop objects near a threshold flickering between levels,
+	// the current level is only left once the budget is fHysteresis past the boundary
+	uint32_t SelectLod(uint32_t nObject, float fTriangleBudget, float fHysteresis = 0.25f)
+	{
+		scene_object& obj = m_vecObjects[nObject];
+		const mesh_entry& e = m_vecMeshes[obj.nMesh];
+		uint32_t nLevels = (uint32_t)e.vecLods.size() + 1;
+		auto triangles = [&](uint32_t nLevel) { return (float)m_vecMeshes[nLevel == 0 ? obj.nMesh : e.vecLods[nLevel - 1]].pMesh->TriangleCount(); };
+
+		uint32_t nLod = (std::min)(obj.nLod, nLevels - 1);
+		while (nLod + 1 < nLevels && fTriangleBudget < triangles(nLod + 1) * (1.0f - fHysteresis))
+			nLod++;
+		while (nLod > 0 && fTriangleBudget > triangles(nLod) * (1.0f + fHysteresis))
+			nLod--;
+		obj.nLod = nLod;
+		return nLod == 0 ? obj.nMesh : e.vecLods[nLod - 1];
+	}
+
+	// True if the object tree was rebuilt
+	bool RebuildIfDegraded(float fLimit = 1.5f)
+	{
+		if (m_bvhObjects.Empty() || m_bvhObjects.Degradation() <= fLimit)
+			return false;
+		m_bvhObjects.Build((uint32_t)m_vecObjects.size(), ObjectBounds());
+		return true;
+	}
+
+	// Appends the index of every object that may be in view to vecVisible and returns
+	// how many were culled. Whole subtrees are dropped or accepted at once; objects in
+	// a partially visible leaf get the cheap sphere test and, if that straddles a
+	// plane, their box
+	template<typename Container>
+	uint32_t CullFrustum(const frustum& f, Container& vecVisible) const
+	{
+		size_t nBefore = vecVisible.size();
+		auto test = [&](uint32_t i, bool bContained)
+		{
+			const scene_object& obj = m_vecObjects[i];
+			bool bInside;
+			if (bContained || !(f.CullSphere(obj.vSphereCenter, obj.fSphereRadius, bInside) || (!bInside && f.CullBox(obj.vBoundsMin, obj.vBoundsMax))))
+				vecVisible.push_back(i);
+		};
+
+		if (m_bvhObjects.Empty())
+		{
+			for (uint32_t i = 0; i < (uint32_t)m_vecObjects.size(); i++)
+				test(i, false);
+		}
+		else
+			m_bvhObjects.CullFrustum(f, test);
+		return (uint32_t)(m_vecObjects.size() - (vecVisible.size() - nBefore));
+	}
+
+	// Closest triangle along vOrigin + t * vDir, t in [0, fMaxT]. Each object the ray
+	// reaches gets the ray in its own space, where its mesh's triangle tree lives.
+	// World matrices are rotation and translation only, so t carries over unchanged
+	bool Raycast(const vec3d& vOrigin, const vec3d& vDir, float fMaxT, scene_hit& hit) const
+	{
+		hit = scene_hit();
+		auto testObject = [&](uint32_t nObject, float& fObjectMaxT)
+		{
+			const scene_object& obj = m_vecObjects[nObject];
+			mat4x4 matWorldInv = obj.matWorld.Inverse();
+			vec3d vDirObject = vDir;
+			vDirObject.w = 0.0f;
+			vec3d vOriginObject = matWorldInv * vOrigin;
+			vDirObject = matWorldInv * vDirObject;
+
+			const vec3d* pVerts = obj.pMesh->Verts();
+			const uint32_t* pIndices = obj.pMesh->Indices();
+			uint32_t nTriangle = UINT32_MAX;
+			auto testTriangle = [&](uint32_t t, float& fTriMaxT)
+			{
+				float fHit;
+				if (!RayTriangle(vOriginObject, vDirObject, pVerts[pIndices[t * 3 + 0]], pVerts[pIndices[t * 3 + 1]], pVerts[pIndices[t * 3 + 2]], fHit) || fHit > fTriMaxT)
+					return false;
+				fTriMaxT = fHit;
+				nTriangle = t;
+				return true;
+			};
+
+			const bvh& bvhMesh = m_vecMeshes[obj.nMesh].bvhTriangles;
+			if (bvhMesh.Empty())
+			{
+				for (uint32_t t = 0; t < (uint32_t)obj.pMesh->TriangleCount(); t++)
+					testTriangle(t, fObjectMaxT);
+			}
+			else
+				bvhMesh.Raycast(vOriginObject, vDirObject, fObjectMaxT, testTriangle);
+
+			if (nTriangle == UINT32_MAX)
+				return false;
+			hit.nObject = nObject;
+			hit.nTriangle = nTriangle;
+			return true;
+		};
+
+		if (m_bvhObjects.Empty())
+		{
+			for (uint32_t i = 0; i < (uint32_t)m_vecObjects.size(); i++)
+				testObject(i, fMaxT);
+		}
+		else
+			m_bvhObjects.Raycast(vOrigin, vDir, fMaxT, testObject);
+
+		if (hit.nObject == UINT32_MAX)
+			return false;
+		hit.t = fMaxT;
+		hit.vPoint = vec3d(vOrigin.x + vDir.x * fMaxT, vOrigin.y + vDir.y * fMaxT, vOrigin.z + vDir.z * fMaxT);
+		return true;
+	}
+
+	// First hit on the segment from vStart to vEnd, hit.t is the fraction along it
+	bool Segment(const vec3d& vStart, const vec3d& vEnd, scene_hit& hit) const
+	{
+		return Raycast(vStart, vec3d(vEnd.x - vStart.x, vEnd.y - vStart.y, vEnd.z - vStart.z, 0.0f), 1.0f, hit);
+	}
+
+private:
+	struct mesh_entry
+	{
+		const indexed_mesh* pMesh;
+		bvh bvhTriangles;
+		meshlet_mesh meshlets;
+		std::vector<uint32_t> vecLods;			// slots of the coarser levels, finest first
+		std::unique_ptr<indexed_mesh> pOwned;	// set for levels the scene generated
+		bool bLod = false;
+	};
+
+	uint32_t MeshSlot(const indexed_mesh& mesh)
+	{
+		for (uint32_t i = 0; i < (uint32_t)m_vecMeshes.size(); i++)
+			if (m_vecMeshes[i].pMesh == &mesh)
+				return i;
+		m_vecMeshes.push_back(mesh_entry());
+		m_vecMeshes.back().pMesh = &mesh;
+		return (uint32_t)m_vecMeshes.size() - 1;
+	}
+
+	// Bounds callback for the object tree
+	struct object_bounds
+	{
+		const std::vector<scene_object>* pObjects;
+		void operator()(uint32_t i, vec3d& vMin, vec3d& vMax) const
+		{
+			vMin = (*pObjects)[i].vBoundsMin;
+			vMax = (*pObjects)[i].vBoundsMax;
+		}
+	};
+	object_bounds ObjectBounds() const { return object_bounds{ &m_vecObjects }; }
+
+	std::vector<scene_object> m_vecObjects;
+	std::vector<mesh_entry> m_vecMeshes;
+	bvh m_bvhObjects;
+};
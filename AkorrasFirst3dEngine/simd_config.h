@@ -0,0 +1,17 @@
+#pragma once
+
+// SSE2 is baseline on every target we build for (x64, and x86 with /arch:SSE2),
+// AVX is only used when the CPU and OS report support for it at run time
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define ENGINE_SIMD_SSE 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define ENGINE_TARGET_AVX
+#else
+#include <cpuid.h>
+#define ENGINE_TARGET_AVX __attribute__((target("avx")))
+#endif
+#else
+#define ENGINE_SIMD_SSE 0
+#endif
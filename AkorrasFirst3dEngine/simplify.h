@@ -0,0 +1,317 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "engine_utils.h"
+
+// Mesh simplification by quadric error metrics (Garland & Heckbert). Every vertex
+// keeps the sum of the squared distances to the planes of the faces around it as
+// a 4x4 quadric; collapsing an edge merges the two quadrics and places the vertex
+// where their error is smallest. Edges are collapsed cheapest first until the
+// triangle count is reached.
+//
+// Open edges get an extra plane through them, perpendicular to their face, so
+// holes and borders keep their outline. A collapse that would turn a face over is
+// refused.
+
+// Symmetric 4x4 matrix, upper triangle only
+struct quadric
+{
+	double q[10] = { 0.0 };
+
+	void AddPlane(double a, double b, double c, double d, double fWeight)
+	{
+		q[0] += fWeight * a * a;	q[1] += fWeight * a * b;	q[2] += fWeight * a * c;	q[3] += fWeight * a * d;
+		q[4] += fWeight * b * b;	q[5] += fWeight * b * c;	q[6] += fWeight * b * d;
+		q[7] += fWeight * c * c;	q[8] += fWeight * c * d;
+		q[9] += fWeight * d * d;
+	}
+
+	quadric operator+(const quadric& o) const
+	{
+		quadric r;
+		for (int i = 0; i < 10; i++)
+			r.q[i] = q[i] + o.q[i];
+		return r;
+	}
+
+	double Error(double x, double y, double z) const
+	{
+		return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+			+ q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+			+ q[7] * z * z + 2.0 * q[8] * z
+			+ q[9];
+	}
+
+	// Point of least error, false when the quadric is too close to singular (flat or
+	// straight neighbourhoods), the caller then picks from a few candidates
+	bool Optimum(double& x, double& y, double& z) const
+	{
+		double a00 = q[0], a01 = q[1], a02 = q[2];
+		double a11 = q[4], a12 = q[5], a22 = q[7];
+		double c0 = a11 * a22 - a12 * a12;
+		double c1 = a02 * a12 - a01 * a22;
+		double c2 = a01 * a12 - a02 * a11;
+		double fDet = a00 * c0 + a01 * c1 + a02 * c2;
+		double fScale = a00 * a00 + a11 * a11 + a22 * a22;
+		if (fabs(fDet) <= 1e-12 * fScale * sqrt(fScale))
+			return false;
+
+		double b0 = -q[3], b1 = -q[6], b2 = -q[8];
+		double fInv = 1.0 / fDet;
+		x = (c0 * b0 + c1 * b1 + c2 * b2) * fInv;
+		y = (c1 * b0 + (a00 * a22 - a02 * a02) * b1 + (a01 * a02 - a00 * a12) * b2) * fInv;
+		z = (c2 * b0 + (a01 * a02 - a00 * a12) * b1 + (a00 * a11 - a01 * a01) * b2) * fInv;
+		return true;
+	}
+};
+
+// Simplify 'src' down to about nTargetTriangles into 'dst'. Returns false when
+// nothing could be collapsed
+static bool SimplifyMesh(const indexed_mesh& src, indexed_mesh& dst, size_t nTargetTriangles)
+{
+	const double BOUNDARY_WEIGHT = 100.0;
+
+	uint32_t nVerts = (uint32_t)src.VertexCount();
+	uint32_t nTriangles = (uint32_t)src.TriangleCount();
+	std::vector<vec3d> verts(src.Verts(), src.Verts() + nVerts);
+	std::vector<uint32_t> tris(src.Indices(), src.Indices() + (size_t)nTriangles * 3);
+	std::vector<bool> vecTriRemoved(nTriangles, false);
+	std::vector<bool> vecVertRemoved(nVerts, false);
+	std::vector<uint32_t> vecVersion(nVerts, 0);
+	std::vector<quadric> vecQuadrics(nVerts);
+	std::vector<std::vector<uint32_t>> vecVertTris(nVerts);
+
+	auto faceNormal = [](const vec3d& a, const vec3d& b, const vec3d& c, double n[3])
+	{
+		double e1[3] = { (double)b.x - a.x, (double)b.y - a.y, (double)b.z - a.z };
+		double e2[3] = { (double)c.x - a.x, (double)c.y - a.y, (double)c.z - a.z };
+		n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+	};
+
+	// Face planes, weighted by area
+	for (uint32_t t = 0; t < nTriangles; t++)
+	{
+		const vec3d& a = verts[tris[t * 3 + 0]];
+		double n[3];
+		faceNormal(a, verts[tris[t * 3 + 1]], verts[tris[t * 3 + 2]], n);
+		double fLength = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		for (int k = 0; k < 3; k++)
+			vecVertTris[tris[t * 3 + k]].push_back(t);
+		if (fLength <= 0.0)
+			continue;
+		for (int k = 0; k < 3; k++)
+			n[k] /= fLength;
+		double d = -(n[0] * a.x + n[1] * a.y + n[2] * a.z);
+		for (int k = 0; k < 3; k++)
+			vecQuadrics[tris[t * 3 + k]].AddPlane(n[0], n[1], n[2], d, fLength * 0.5);
+	}
+
+	// Open edges, found as the directed edges without a twin
+	{
+		std::vector<uint64_t> vecEdges;
+		vecEdges.reserve((size_t)nTriangles * 3);
+		for (uint32_t t = 0; t < nTriangles; t++)
+			for (int k = 0; k < 3; k++)
+			{
+				uint32_t a = tris[t * 3 + k], b = tris[t * 3 + (k + 1) % 3];
+				vecEdges.push_back((uint64_t)(std::min)(a, b) << 32 | (std::max)(a, b));
+			}
+		std::sort(vecEdges.begin(), vecEdges.end());
+
+		for (uint32_t t = 0; t < nTriangles; t++)
+			for (int k = 0; k < 3; k++)
+			{
+				uint32_t a = tris[t * 3 + k], b = tris[t * 3 + (k + 1) % 3];
+				uint64_t nKey = (uint64_t)(std::min)(a, b) << 32 | (std::max)(a, b);
+				auto range = std::equal_range(vecEdges.begin(), vecEdges.end(), nKey);
+				if (range.second - range.first != 1)
+					continue;
+
+				double n[3];
+				faceNormal(verts[tris[t * 3 + 0]], verts[tris[t * 3 + 1]], verts[tris[t * 3 + 2]], n);
+				const vec3d& pa = verts[a];
+				const vec3d& pb = verts[b];
+				double e[3] = { (double)pb.x - pa.x, (double)pb.y - pa.y, (double)pb.z - pa.z };
+				double p[3] = { e[1] * n[2] - e[2] * n[1], e[2] * n[0] - e[0] * n[2], e[0] * n[1] - e[1] * n[0] };
+				double fLength = sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+				if (fLength <= 0.0)
+					continue;
+				for (int i = 0; i < 3; i++)
+					p[i] /= fLength;
+				double d = -(p[0] * pa.x + p[1] * pa.y + p[2] * pa.z);
+				double fWeight = BOUNDARY_WEIGHT * (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+				vecQuadrics[a].AddPlane(p[0], p[1], p[2], d, fWeight);
+				vecQuadrics[b].AddPlane(p[0], p[1], p[2], d, fWeight);
+			}
+	}
+
+	struct collapse
+	{
+		double fCost;
+		uint32_t a, b;
+		uint32_t nVersionA, nVersionB;
+		float x, y, z;
+		bool operator<(const collapse& o) const { return fCost > o.fCost; }	// cheapest on top
+	};
+	std::priority_queue<collapse> heap;
+
+	auto pushEdge = [&](uint32_t a, uint32_t b)
+	{
+		quadric q = vecQuadrics[a] + vecQuadrics[b];
+		const vec3d& pa = verts[a];
+		const vec3d& pb = verts[b];
+		double x, y, z;
+		bool bOptimum = q.Optimum(x, y, z);
+		if (bOptimum)
+		{
+			// Nearly singular quadrics can put the optimum far off, keep it near the edge
+			double mx = x - (pa.x + pb.x) * 0.5, my = y - (pa.y + pb.y) * 0.5, mz = z - (pa.z + pb.z) * 0.5;
+			double ex = (double)pb.x - pa.x, ey = (double)pb.y - pa.y, ez = (double)pb.z - pa.z;
+			bOptimum = mx * mx + my * my + mz * mz <= 4.0 * (ex * ex + ey * ey + ez * ez);
+		}
+		if (!bOptimum)
+		{
+			// Best of the ends and the midpoint
+			double c[3][3] = { { pa.x, pa.y, pa.z }, { pb.x, pb.y, pb.z }, { (pa.x + pb.x) * 0.5, (pa.y + pb.y) * 0.5, (pa.z + pb.z) * 0.5 } };
+			int nBest = 0;
+			double fBest = DBL_MAX;
+			for (int i = 0; i < 3; i++)
+			{
+				double fError = q.Error(c[i][0], c[i][1], c[i][2]);
+				if (fError < fBest)
+				{
+					fBest = fError;
+					nBest = i;
+				}
+			}
+			x = c[nBest][0]; y = c[nBest][1]; z = c[nBest][2];
+		}
+		collapse c;
+		c.fCost = (std::max)(0.0, q.Error(x, y, z));
+		c.a = a; c.b = b;
+		c.nVersionA = vecVersion[a]; c.nVersionB = vecVersion[b];
+		c.x = (float)x; c.y = (float)y; c.z = (float)z;
+		heap.push(c);
+	};
+
+	for (uint32_t t = 0; t < nTriangles; t++)
+		for (int k = 0; k < 3; k++)
+		{
+			uint32_t a = tris[t * 3 + k], b = tris[t * 3 + (k + 1) % 3];
+			if (a < b)
+				pushEdge(a, b);
+			else if (a != b)
+			{
+				// Only push once per edge; an open edge only exists in this direction
+				bool bTwin = false;
+				for (uint32_t t2 : vecVertTris[a])
+					for (int k2 = 0; k2 < 3 && !bTwin; k2++)
+						bTwin = tris[t2 * 3 + k2] == b && tris[t2 * 3 + (k2 + 1) % 3] == a;
+				if (!bTwin)
+					pushEdge(b, a);
+			}
+		}
+
+	// Would moving vertex x (one end of the collapse) to v turn any of its faces over?
+	auto flips = [&](uint32_t x, uint32_t nOther, const vec3d& v)
+	{
+		for (uint32_t t : vecVertTris[x])
+		{
+			if (vecTriRemoved[t])
+				continue;
+			uint32_t* pTri = &tris[t * 3];
+			if (pTri[0] == nOther || pTri[1] == nOther || pTri[2] == nOther)
+				continue;	// goes away with the collapse
+
+			double nOld[3], nNew[3];
+			faceNormal(verts[pTri[0]], verts[pTri[1]], verts[pTri[2]], nOld);
+			faceNormal(pTri[0] == x ? v : verts[pTri[0]], pTri[1] == x ? v : verts[pTri[1]], pTri[2] == x ? v : verts[pTri[2]], nNew);
+			if (nOld[0] * nNew[0] + nOld[1] * nNew[1] + nOld[2] * nNew[2] <= 0.0)
+				return true;
+		}
+		return false;
+	};
+
+	size_t nRemaining = nTriangles;
+	bool bCollapsed = false;
+	std::vector<uint32_t> vecNeighbours;
+	while (nRemaining > nTargetTriangles && !heap.empty())
+	{
+		collapse c = heap.top();
+		heap.pop();
+		if (vecVertRemoved[c.a] || vecVertRemoved[c.b] || vecVersion[c.a] != c.nVersionA || vecVersion[c.b] != c.nVersionB)
+			continue;
+
+		vec3d v(c.x, c.y, c.z);
+		if (flips(c.a, c.b, v) || flips(c.b, c.a, v))
+			continue;
+
+		// b folds into a: faces holding both vanish, the rest of b's faces move to a
+		verts[c.a] = v;
+		vecQuadrics[c.a] = vecQuadrics[c.a] + vecQuadrics[c.b];
+		vecVertRemoved[c.b] = true;
+		vecVersion[c.a]++;
+		for (uint32_t t : vecVertTris[c.b])
+		{
+			if (vecTriRemoved[t])
+				continue;
+			uint32_t* pTri = &tris[t * 3];
+			if (pTri[0] == c.a || pTri[1] == c.a || pTri[2] == c.a)
+			{
+				vecTriRemoved[t] = true;
+				nRemaining--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+				if (pTri[k] == c.b)
+					pTri[k] = c.a;
+			vecVertTris[c.a].push_back(t);
+		}
+		vecVertTris[c.b].clear();
+		bCollapsed = true;
+
+		// Drop dead faces from a's list and requeue its edges with the new position
+		auto& vecA = vecVertTris[c.a];
+		vecA.erase(std::remove_if(vecA.begin(), vecA.end(), [&](uint32_t t) { return vecTriRemoved[t]; }), vecA.end());
+		vecNeighbours.clear();
+		for (uint32_t t : vecA)
+			for (int k = 0; k < 3; k++)
+				if (tris[t * 3 + k] != c.a)
+					vecNeighbours.push_back(tris[t * 3 + k]);
+		std::sort(vecNeighbours.begin(), vecNeighbours.end());
+		vecNeighbours.erase(std::unique(vecNeighbours.begin(), vecNeighbours.end()), vecNeighbours.end());
+		for (uint32_t n : vecNeighbours)
+			pushEdge(c.a, n);
+	}
+
+	// Compact what is left
+	std::vector<uint32_t> vecRemap(nVerts, UINT32_MAX);
+	dst.pMapping.reset();
+	dst.verts.clear();
+	dst.indices.clear();
+	for (uint32_t t = 0; t < nTriangles; t++)
+	{
+		if (vecTriRemoved[t])
+			continue;
+		for (int k = 0; k < 3; k++)
+		{
+			uint32_t v = tris[t * 3 + k];
+			if (vecRemap[v] == UINT32_MAX)
+			{
+				vecRemap[v] = (uint32_t)dst.verts.size();
+				dst.verts.push_back(verts[v]);
+			}
+			dst.indices.push_back(vecRemap[v]);
+		}
+	}
+	dst.ComputeDerived();
+	return bCollapsed;
+}
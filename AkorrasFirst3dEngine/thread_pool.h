@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Persistent worker threads for data parallel loops. Workers sleep between jobs,
+// so handing out a loop costs a wake up rather than a thread creation. The calling
+// thread works on the loop too and ParallelFor returns once every index is done.
+//
+//	pool.ParallelFor(nCount, [&](size_t i, unsigned nThread) { ... });
+//
+// nThread is in [0, ThreadCount()) and stable for the duration of the call, so it
+// can index per-thread scratch buffers without locking. Indices are handed out
+// dynamically, which thread runs which index is not deterministic.
+class thread_pool
+{
+public:
+	thread_pool() {}
+	~thread_pool() { Destroy(); }
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	// nThreads counts the caller, 0 uses every hardware thread
+	void Create(unsigned nThreads = 0)
+	{
+		Destroy();
+		if (nThreads == 0)
+			nThreads = std::thread::hardware_concurrency();
+		if (nThreads == 0)
+			nThreads = 1;
+
+		// New workers start out having seen every job so far. Otherwise, after a
+		// re-Create, they would pick up the long finished last one
+		uint64_t nGeneration;
+		{
+			std::lock_guard<std::mutex> lock(m_muxJob);
+			m_bQuit = false;
+			nGeneration = m_nGeneration;
+		}
+		for (unsigned i = 1; i < nThreads; i++)
+			m_vecWorkers.push_back(std::thread(&thread_pool::WorkerThread, this, i, nGeneration));
+	}
+
+	void Destroy()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_muxJob);
+			m_bQuit = true;
+		}
+		m_cvJob.notify_all();
+		for (auto& t : m_vecWorkers)
+			t.join();
+		m_vecWorkers.clear();
+	}
+
+	unsigned ThreadCount() const { return (unsigned)m_vecWorkers.size() + 1; }
+
+	template<typename Fn>
+	void ParallelFor(size_t nCount, Fn&& fn)
+	{
+		if (nCount == 0)
+			return;
+
+		// Not worth waking anyone for a single item
+		if (m_vecWorkers.empty() || nCount == 1)
+		{
+			for (size_t i = 0; i < nCount; i++)
+				fn(i, 0u);
+			return;
+		}
+
+		// The job refers to the caller's functor, nothing is copied or allocated
+		job j;
+		j.pContext = &fn;
+		j.pInvoke = [](void* pContext, size_t i, unsigned nThread) { (*(typename std::remove_reference<Fn>::type*)pContext)(i, nThread); };
+		j.nCount = nCount;
+		j.nNext = 0;
+		j.nBusy = (unsigned)m_vecWorkers.size();
+
+		{
+			std::lock_guard<std::mutex> lock(m_muxJob);
+			m_pJob = &j;
+			m_nGeneration++;
+		}
+		m_cvJob.notify_all();
+
+		RunJob(j, 0);
+
+		// Wait for the workers to let go of the job before it leaves scope
+		std::unique_lock<std::mutex> lock(m_muxJob);
+		m_cvDone.wait(lock, [&j] { return j.nBusy == 0; });
+		m_pJob = nullptr;
+	}
+
+private:
+	struct job
+	{
+		void* pContext;
+		void (*pInvoke)(void* pContext, size_t i, unsigned nThread);
+		size_t nCount;
+		std::atomic<size_t> nNext;
+		unsigned nBusy;		// workers yet to finish, guarded by m_muxJob
+	};
+
+	static void RunJob(job& j, unsigned nThread)
+	{
+		size_t i;
+		while ((i = j.nNext.fetch_add(1, std::memory_order_relaxed)) < j.nCount)
+			j.pInvoke(j.pContext, i, nThread);
+	}
+
+	void WorkerThread(unsigned nThread, uint64_t nSeen)
+	{
+		while (true)
+		{
+			job* pJob;
+			{
+				std::unique_lock<std::mutex> lock(m_muxJob);
+				m_cvJob.wait(lock, [&] { return m_bQuit || m_nGeneration != nSeen; });
+				if (m_bQuit)
+					return;
+				nSeen = m_nGeneration;
+				pJob = m_pJob;
+			}
+
+			RunJob(*pJob, nThread);
+
+			bool bLast;
+			{
+				std::lock_guard<std::mutex> lock(m_muxJob);
+				bLast = --pJob->nBusy == 0;
+			}
+			if (bLast)
+				m_cvDone.notify_one();
+		}
+	}
+
+	std::vector<std::thread> m_vecWorkers;
+	std::mutex m_muxJob;
+	std::condition_variable m_cvJob;
+	std::condition_variable m_cvDone;
+	job* m_pJob = nullptr;
+	uint64_t m_nGeneration = 0;
+	bool m_bQuit = false;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// Summary of a run of timings, in the same unit as the samples. Percentiles are
+// nearest rank: p95 is the smallest sample at least 95% of samples do not exceed,
+// always one of the samples themselves.
+struct timing_stats
+{
+	size_t	nCount = 0;
+	double	fTotal = 0.0;
+	double	fMean = 0.0;
+	double	fMin = 0.0;
+	double	fP50 = 0.0;
+	double	fP95 = 0.0;
+	double	fP99 = 0.0;
+	double	fMax = 0.0;
+
+	static timing_stats FromSamples(std::vector<double> vecSamples)
+	{
+		timing_stats s;
+		s.nCount = vecSamples.size();
+		if (s.nCount == 0)
+			return s;
+
+		std::sort(vecSamples.begin(), vecSamples.end());
+		for (double f : vecSamples)
+			s.fTotal += f;
+		s.fMean = s.fTotal / (double)s.nCount;
+		s.fMin = vecSamples.front();
+		s.fMax = vecSamples.back();
+
+		auto percentile = [&](double p)
+		{
+			size_t nRank = (size_t)std::ceil(p * (double)s.nCount);
+			return vecSamples[nRank > 0 ? nRank - 1 : 0];
+		};
+		s.fP50 = percentile(0.50);
+		s.fP95 = percentile(0.95);
+		s.fP99 = percentile(0.99);
+		return s;
+	}
+};
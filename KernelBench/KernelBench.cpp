@@ -0,0 +1,538 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include "ConsoleGameEngine.h"
+#include "engine_utils.h"
+#include "obj_loader.h"
+#include "depth_sort.h"
+#include "frame_arena.h"
+#include "timing_stats.h"
+
+// The engine's statics, normally defined by Engine3d.cpp
+std::atomic<bool> ConsoleGameEngine::m_bAtomActive(false);
+std::condition_variable ConsoleGameEngine::m_cvGameFinished;
+std::mutex ConsoleGameEngine::m_muxGame;
+
+// Throughput of the engine's inner loops on their own, over input sizes from a few
+// thousand items to millions, so that the point where each one falls out of cache
+// shows up as a step in its curve. Every size gets freshly generated input from a
+// fixed seed, is run once untimed to touch its memory, and then timed repeatedly;
+// the median repeat is reported. Before any of that the parallel OBJ parse is
+// checked against the serial one, and the run stops if they disagree.
+//
+// One CSV line per kernel and size goes to stdout (or --out): the item count, the
+// bytes the kernel reads and writes for it, the median time and the rates. A
+// summary on stderr gives each kernel's peak and the size from which on it stays
+// below CLIFF_FRACTION of it, earliest first.
+//
+//   --max <n>			largest size, in items (10000000)
+//   --min-time <s>		time each size is repeated for, at least (0.05)
+//   --cells <n>		cells one repeat of fill_triangle may draw, larger sizes are skipped (268435456)
+//   --kernels <a,b>	only these kernels, by name
+//   --out <file>		CSV to this file instead of stdout
+
+static const double CLIFF_FRACTION = 0.75;
+
+// Screen FillTriangle draws into, the size the demo runs at
+static const int RASTER_WIDTH = 256;
+static const int RASTER_HEIGHT = 240;
+
+// Fill's screen is this wide and as tall as --max cells need, so that a fill of n
+// cells covers n contiguous cells
+static const int FILL_WIDTH = 4096;
+
+// A headless screen to call the drawing functions on, it never runs a frame
+class bench_screen : public ConsoleGameEngine
+{
+public:
+	bench_screen(int nWidth, int nHeight) { ConstructHeadless(nWidth, nHeight, 1); }
+
+	bool OnUserCreate() override { return true; }
+	bool OnUserUpdate(float) override { return false; }
+};
+
+// One timed size of one kernel
+struct kernel_point
+{
+	size_t nItems = 0;
+	size_t nBytes = 0;		// read and written by one repeat
+	double fSeconds = 0.0;	// median repeat
+	size_t nRepeats = 0;
+};
+
+// Runs fnSetup untimed and fnRun timed, once to warm up and then until at least
+// fMinTime seconds have been timed, and at least three times
+template<typename Setup, typename Run>
+static void MeasureKernel(double fMinTime, Setup&& fnSetup, Run&& fnRun, kernel_point& point)
+{
+	fnSetup();
+	fnRun();
+
+	std::vector<double> vecSamples;
+	double fTotal = 0.0;
+	while (vecSamples.size() < 3 || (fTotal < fMinTime && vecSamples.size() < 100000))
+	{
+		fnSetup();
+		auto tp1 = std::chrono::steady_clock::now();
+		fnRun();
+		auto tp2 = std::chrono::steady_clock::now();
+		double f = std::chrono::duration<double>(tp2 - tp1).count();
+		vecSamples.push_back(f);
+		fTotal += f;
+	}
+	point.fSeconds = timing_stats::FromSamples(vecSamples).fP50;
+	point.nRepeats = vecSamples.size();
+}
+
+// Keeps results alive so the compiler can't drop the work producing them
+static volatile uint64_t g_nSink = 0;
+
+// Triangles anywhere in a cube of side 2 around the origin, each corner independently
+static std::vector<triangle> RandomTriangles(size_t n, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+	std::vector<triangle> vecTris(n);
+	for (triangle& t : vecTris)
+		for (int i = 0; i < 3; i++)
+			t.p[i] = vec3d(dist(rng), dist(rng), dist(rng));
+	return vecTris;
+}
+
+// Screen space triangles of about nArea cells each, rotated at random and placed so
+// they stay on a RASTER_WIDTH x RASTER_HEIGHT screen. Six ints per triangle
+static std::vector<int> RandomScreenTriangles(size_t n, int nArea, std::mt19937& rng)
+{
+	// Circumradius of an equilateral triangle of that area
+	float fRadius = std::sqrt((float)nArea / 1.299f);
+	float fMargin = (std::min)(fRadius, (float)RASTER_HEIGHT / 2.0f - 1.0f);
+	std::uniform_real_distribution<float> distX(fMargin, RASTER_WIDTH - 1.0f - fMargin);
+	std::uniform_real_distribution<float> distY(fMargin, RASTER_HEIGHT - 1.0f - fMargin);
+	std::uniform_real_distribution<float> distAngle(0.0f, 6.2832f);
+
+	std::vector<int> vecCorners(n * 6);
+	for (size_t i = 0; i < n; i++)
+	{
+		float cx = distX(rng), cy = distY(rng), a = distAngle(rng);
+		for (int k = 0; k < 3; k++)
+		{
+			float fAngle = a + (float)k * 2.0944f;
+			vecCorners[i * 6 + k * 2 + 0] = (int)std::lround(cx + fRadius * std::cos(fAngle));
+			vecCorners[i * 6 + k * 2 + 1] = (int)std::lround(cy + fRadius * std::sin(fAngle));
+		}
+	}
+	return vecCorners;
+}
+
+// An OBJ file of a strip of n triangles over n + 2 vertices
+static std::string StripObj(size_t n, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> dist(-100.0f, 100.0f);
+	std::string sObj;
+	sObj.reserve((n + 2) * 32 + n * 32);
+	char sLine[96];
+	for (size_t i = 0; i < n + 2; i++)
+	{
+		int nLen = snprintf(sLine, sizeof(sLine), "v %.4f %.4f %.4f\n", dist(rng), dist(rng), dist(rng));
+		sObj.append(sLine, nLen);
+	}
+	for (size_t i = 1; i <= n; i++)
+	{
+		int nLen = snprintf(sLine, sizeof(sLine), "f %zu %zu %zu\n", i, i + 1, i + 2);
+		sObj.append(sLine, nLen);
+	}
+	return sObj;
+}
+
+// An OBJ file of about nBytes meant to trip up a parser: faces of three to six
+// corners mixing absolute and relative indices, /vt/vn parts, corners pointing at
+// vertices not defined yet or in front of the file, and zeros
+static std::string MessyObj(size_t nBytes, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> dist(-100.0f, 100.0f);
+	std::uniform_int_distribution<int> distKind(0, 99);
+	std::string sObj;
+	char sLine[160];
+	int nVerts = 0;
+	while (sObj.size() < nBytes)
+	{
+		int nLen;
+		if (nVerts < 3 || distKind(rng) < 40)
+		{
+			nLen = snprintf(sLine, sizeof(sLine), "v %.4f %.4f %.4f\n", dist(rng), dist(rng), dist(rng));
+			nVerts++;
+		}
+		else
+		{
+			nLen = snprintf(sLine, sizeof(sLine), "f");
+			int nCorners = 3 + distKind(rng) % 4;
+			for (int k = 0; k < nCorners; k++)
+			{
+				int nKind = distKind(rng), nCorner;
+				if (nKind < 2)
+					nCorner = 0;
+				else if (nKind < 5)
+					nCorner = nVerts + 1 + distKind(rng) % 8;	// not defined yet
+				else if (nKind < 7)
+					nCorner = -(nVerts + 1 + distKind(rng) % 8);	// in front of the file
+				else if (nKind < 50)
+					nCorner = 1 + (int)(rng() % (unsigned)nVerts);
+				else
+					nCorner = -(1 + (int)(rng() % (unsigned)(std::min)(nVerts, 64)));
+				nLen += snprintf(sLine + nLen, sizeof(sLine) - nLen, nKind % 3 ? " %d" : " %d/1/1", nCorner);
+			}
+			nLen += snprintf(sLine + nLen, sizeof(sLine) - nLen, "\n");
+		}
+		sObj.append(sLine, nLen);
+	}
+	return sObj;
+}
+
+// The parallel OBJ parse must give exactly what the serial one does, indices, skipped
+// faces and all. Checked before anything is timed
+static bool CheckObjParallel()
+{
+	std::mt19937 rng(6);
+	std::string sObj = MessyObj((size_t)8 << 20, rng);
+	std::vector<vec3d> vertsSerial, vertsParallel;
+	std::vector<uint32_t> indicesSerial, indicesParallel;
+	obj_parse_stats statsSerial, statsParallel;
+	ParseObjIndexed(sObj.data(), sObj.data() + sObj.size(), vertsSerial, indicesSerial, statsSerial);
+	ParseObjIndexedParallel(sObj.data(), sObj.data() + sObj.size(), vertsParallel, indicesParallel, statsParallel, 4);
+
+	bool bSame = vertsSerial.size() == vertsParallel.size() && indicesSerial == indicesParallel &&
+		statsSerial.nFaces == statsParallel.nFaces && statsSerial.nSkippedFaces == statsParallel.nSkippedFaces &&
+		statsSerial.nTriangles == statsParallel.nTriangles &&
+		std::memcmp(vertsSerial.data(), vertsParallel.data(), vertsSerial.size() * sizeof(vec3d)) == 0;
+	if (!bSame)
+		fprintf(stderr, "Parallel OBJ parse differs from the serial one: %zu/%zu faces skipped, %zu/%zu triangles\n",
+			statsSerial.nSkippedFaces, statsParallel.nSkippedFaces, statsSerial.nTriangles, statsParallel.nTriangles);
+	return bSame;
+}
+
+struct kernel
+{
+	std::string sName;
+	std::string sUnit;
+	// Times n items, false if this size is left out
+	std::function<bool(size_t n, double fMinTime, kernel_point& point)> fnRun;
+};
+
+static std::vector<kernel> BuildKernels(size_t nCellBudget, std::shared_ptr<bench_screen> screenRaster, std::shared_ptr<bench_screen> screenFill)
+{
+	std::vector<kernel> vecKernels;
+
+	mat4x4 matWorld = mat4x4::RotationY(0.7f) * mat4x4::Translation(1.0f, 2.0f, 5.0f);
+
+	// The vertex transform, three vertices per triangle from one array into another
+	auto addTransform = [&](const std::string& sName, bool bBatch)
+	{
+		vecKernels.push_back({ sName, "triangles", [=](size_t n, double fMinTime, kernel_point& point)
+		{
+			std::mt19937 rng(1);
+			std::vector<triangle> vecTris = RandomTriangles(n, rng);
+			std::vector<vec3d> vecIn(n * 3), vecOut(n * 3);
+			for (size_t i = 0; i < n; i++)
+				for (int k = 0; k < 3; k++)
+					vecIn[i * 3 + k] = vecTris[i].p[k];
+			vecTris.clear();
+			vecTris.shrink_to_fit();
+
+			MeasureKernel(fMinTime, [] {}, [&]
+			{
+				if (bBatch)
+					matWorld.TransformBatch(vecIn.data(), vecOut.data(), vecIn.size());
+				else
+					for (size_t i = 0; i < vecIn.size(); i++)
+						vecOut[i] = matWorld * vecIn[i];
+			}, point);
+			g_nSink = g_nSink + (uint64_t)vecOut.back().x;
+			point.nItems = n;
+			point.nBytes = 2 * vecIn.size() * sizeof(vec3d);
+			return true;
+		} });
+	};
+	addTransform("transform_batch", true);
+	addTransform("transform_scalar", false);
+
+	// Near plane clip, corners spread either side of it so all four outcomes turn up
+	vecKernels.push_back({ "clip_near", "triangles", [](size_t n, double fMinTime, kernel_point& point)
+	{
+		std::mt19937 rng(2);
+		std::vector<triangle> vecTris = RandomTriangles(n, rng);
+		std::vector<triangle> vecOut(n * 2);
+		size_t nOut = 0;
+		MeasureKernel(fMinTime, [] {}, [&]
+		{
+			nOut = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				int nClipped = ClipTriangleAgainstPlane(vec3d(0.0f, 0.0f, 0.1f), vec3d(0.0f, 0.0f, 1.0f), vecTris[i], vecOut[nOut], vecOut[nOut + 1]);
+				nOut += nClipped;
+			}
+		}, point);
+		g_nSink = g_nSink + nOut;
+		point.nItems = n;
+		point.nBytes = (n + nOut) * sizeof(triangle);
+		return true;
+	} });
+
+	// Scanline fill at a few triangle sizes, on a screen that stays the same size
+	for (int nArea : { 4, 64, 1024, 16384 })
+	{
+		if (nArea > RASTER_WIDTH * RASTER_HEIGHT / 2)
+			continue;
+		vecKernels.push_back({ "fill_triangle_" + std::to_string(nArea), "triangles", [=](size_t n, double fMinTime, kernel_point& point)
+		{
+			if (n * (size_t)nArea > nCellBudget)
+				return false;
+			std::mt19937 rng(3);
+			std::vector<int> vecCorners = RandomScreenTriangles(n, nArea, rng);
+			const int* c = vecCorners.data();
+			MeasureKernel(fMinTime, [] {}, [&]
+			{
+				for (size_t i = 0; i < n; i++)
+					screenRaster->FillTriangle(c[i * 6 + 0], c[i * 6 + 1], c[i * 6 + 2], c[i * 6 + 3], c[i * 6 + 4], c[i * 6 + 5], 0x2588, (short)(i & 0x0F));
+			}, point);
+			point.nItems = n;
+			point.nBytes = vecCorners.size() * sizeof(int) + (size_t)RASTER_WIDTH * RASTER_HEIGHT * sizeof(CHAR_INFO);
+			return true;
+		} });
+	}
+
+	// Rectangle fill of n cells, whole rows of the wide screen so they are contiguous
+	vecKernels.push_back({ "fill", "cells", [=](size_t n, double fMinTime, kernel_point& point)
+	{
+		int nWidth = (int)(std::min)(n, (size_t)FILL_WIDTH);
+		int nRows = (int)(n / nWidth);
+		if ((size_t)nRows * nWidth > (size_t)screenFill->ScreenWidth() * screenFill->ScreenHeight())
+			return false;
+		MeasureKernel(fMinTime, [] {}, [&]
+		{
+			screenFill->Fill(0, 0, nWidth, nRows, 0x2588, 0x000F);
+		}, point);
+		point.nItems = (size_t)nRows * nWidth;
+		point.nBytes = point.nItems * sizeof(CHAR_INFO);
+		return true;
+	} });
+
+	// Depth sort of triangles in random order, so the frame to frame guess never helps
+	vecKernels.push_back({ "depth_sort", "triangles", [](size_t n, double fMinTime, kernel_point& point)
+	{
+		std::mt19937 rng(4);
+		std::vector<triangle> vecSource = RandomTriangles(n, rng);
+		frame_arena arenaFrame;
+		arena_vector<triangle> vecTris{ arena_allocator<triangle>(arenaFrame) };
+		depth_sorter sorter;
+		sorter.bCoherent = false;
+		MeasureKernel(fMinTime, [&]
+		{
+			arenaFrame.Reset();
+			ArenaReset(vecTris, arenaFrame);
+			vecTris.assign(vecSource.begin(), vecSource.end());
+		}, [&]
+		{
+			sorter.Sort(vecTris, true, arenaFrame);
+		}, point);
+		g_nSink = g_nSink + (uint64_t)vecTris.front().p[0].z;
+		point.nItems = n;
+		point.nBytes = n * (2 * sizeof(triangle) + 3 * sizeof(uint32_t));
+		return true;
+	} });
+
+	// OBJ text to indexed mesh, from memory so the disk stays out of it
+	vecKernels.push_back({ "obj_parse", "triangles", [](size_t n, double fMinTime, kernel_point& point)
+	{
+		std::mt19937 rng(5);
+		std::string sObj = StripObj(n, rng);
+		std::vector<vec3d> verts;
+		std::vector<uint32_t> indices;
+		MeasureKernel(fMinTime, [&]
+		{
+			verts.clear();
+			indices.clear();
+		}, [&]
+		{
+			obj_parse_stats stats;
+			ParseObjIndexed(sObj.data(), sObj.data() + sObj.size(), verts, indices, stats);
+		}, point);
+		g_nSink = g_nSink + indices.size();
+		point.nItems = n;
+		point.nBytes = sObj.size() + verts.size() * sizeof(vec3d) + indices.size() * sizeof(uint32_t);
+		return true;
+	} });
+
+	// The same on every core, serial below the loader's chunk size
+	vecKernels.push_back({ "obj_parse_parallel", "triangles", [](size_t n, double fMinTime, kernel_point& point)
+	{
+		std::mt19937 rng(5);
+		std::string sObj = StripObj(n, rng);
+		std::vector<vec3d> verts;
+		std::vector<uint32_t> indices;
+		MeasureKernel(fMinTime, [&]
+		{
+			verts.clear();
+			indices.clear();
+		}, [&]
+		{
+			obj_parse_stats stats;
+			ParseObjIndexedParallel(sObj.data(), sObj.data() + sObj.size(), verts, indices, stats);
+		}, point);
+		g_nSink = g_nSink + indices.size();
+		point.nItems = n;
+		point.nBytes = sObj.size() + verts.size() * sizeof(vec3d) + indices.size() * sizeof(uint32_t);
+		return true;
+	} });
+
+	return vecKernels;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t nMaxItems = 10000000;
+	double fMinTime = 0.05;
+	size_t nCellBudget = (size_t)1 << 28;
+	std::vector<std::string> vecOnly;
+	std::string sOut;
+	for (int i = 1; i < argc; i += 2)
+	{
+		std::string sOption = argv[i];
+		if (i + 1 == argc)
+		{
+			fprintf(stderr, "Option %s needs a value\n", argv[i]);
+			return 1;
+		}
+		if (sOption == "--max")
+			nMaxItems = (std::max)((size_t)1000, (size_t)strtoull(argv[i + 1], nullptr, 10));
+		else if (sOption == "--min-time")
+			fMinTime = atof(argv[i + 1]);
+		else if (sOption == "--cells")
+			nCellBudget = (size_t)strtoull(argv[i + 1], nullptr, 10);
+		else if (sOption == "--kernels")
+		{
+			std::stringstream ss(argv[i + 1]);
+			std::string sName;
+			while (std::getline(ss, sName, ','))
+				vecOnly.push_back(sName);
+		}
+		else if (sOption == "--out")
+			sOut = argv[i + 1];
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (!CheckObjParallel())
+		return 1;
+
+	// 1000, 2000, 4000 ... and the maximum itself
+	std::vector<size_t> vecSizes;
+	for (size_t n = 1000; n < nMaxItems; n *= 2)
+		vecSizes.push_back(n);
+	vecSizes.push_back(nMaxItems);
+
+	auto screenRaster = std::make_shared<bench_screen>(RASTER_WIDTH, RASTER_HEIGHT);
+	int nFillRows = (int)((nMaxItems + FILL_WIDTH - 1) / FILL_WIDTH);
+	auto screenFill = std::make_shared<bench_screen>(FILL_WIDTH, nFillRows);
+	std::vector<kernel> vecKernels = BuildKernels(nCellBudget, screenRaster, screenFill);
+
+	FILE* f = stdout;
+	if (!sOut.empty())
+	{
+#ifdef _MSC_VER
+		if (fopen_s(&f, sOut.c_str(), "w") != 0)
+			f = nullptr;
+#else
+		f = std::fopen(sOut.c_str(), "w");
+#endif
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Could not write %s\n", sOut.c_str());
+			return 1;
+		}
+	}
+
+	struct kernel_summary
+	{
+		std::string sName;
+		std::vector<kernel_point> vecPoints;
+		std::vector<double> vecRates;
+		size_t nPeak = 0;
+		size_t nCliff = 0;		// vecPoints.size() if it kept up
+	};
+	std::vector<kernel_summary> vecSummary;
+
+	fprintf(f, "kernel,unit,items,bytes,repeats,median_ms,ns_per_item,items_per_s,mb_per_s\n");
+	for (const kernel& k : vecKernels)
+	{
+		if (!vecOnly.empty() && std::find(vecOnly.begin(), vecOnly.end(), k.sName) == vecOnly.end())
+			continue;
+
+		kernel_summary summary;
+		summary.sName = k.sName;
+		for (size_t n : vecSizes)
+		{
+			kernel_point point;
+			if (!k.fnRun(n, fMinTime, point))
+			{
+				fprintf(stderr, "%-20s %10zu  skipped\n", k.sName.c_str(), n);
+				continue;
+			}
+
+			double fRate = point.fSeconds > 0.0 ? (double)point.nItems / point.fSeconds : 0.0;
+			double fMBs = point.fSeconds > 0.0 ? (double)point.nBytes / (1024.0 * 1024.0) / point.fSeconds : 0.0;
+			fprintf(f, "%s,%s,%zu,%zu,%zu,%.6f,%.3f,%.0f,%.1f\n", k.sName.c_str(), k.sUnit.c_str(), point.nItems, point.nBytes,
+				point.nRepeats, point.fSeconds * 1000.0, point.fSeconds * 1e9 / (double)point.nItems, fRate, fMBs);
+			fflush(f);
+			fprintf(stderr, "%-20s %10zu  %8.2f MB  %12.0f %s/s\n", k.sName.c_str(), point.nItems,
+				(double)point.nBytes / (1024.0 * 1024.0), fRate, k.sUnit.c_str());
+			summary.vecPoints.push_back(point);
+			summary.vecRates.push_back(fRate);
+		}
+		if (summary.vecPoints.empty())
+			continue;
+
+		// A single slow size is noise; the cliff is where it drops and never recovers
+		const std::vector<double>& r = summary.vecRates;
+		summary.nPeak = std::max_element(r.begin(), r.end()) - r.begin();
+		summary.nCliff = r.size();
+		while (summary.nCliff > summary.nPeak + 1 && r[summary.nCliff - 1] < r[summary.nPeak] * CLIFF_FRACTION)
+			summary.nCliff--;
+		vecSummary.push_back(summary);
+	}
+	if (f != stdout)
+		fclose(f);
+
+	// Earliest cliff first, by working set; kernels that kept up last
+	auto cliffBytes = [](const kernel_summary& s)
+	{
+		return s.nCliff < s.vecPoints.size() ? s.vecPoints[s.nCliff].nBytes : SIZE_MAX;
+	};
+	std::stable_sort(vecSummary.begin(), vecSummary.end(), [&](const kernel_summary& a, const kernel_summary& b)
+	{
+		return cliffBytes(a) < cliffBytes(b);
+	});
+	fprintf(stderr, "\nPeak throughput, and the size from which on it stays below %.0f%% of it:\n", CLIFF_FRACTION * 100.0);
+	for (const kernel_summary& s : vecSummary)
+	{
+		const kernel_point& peak = s.vecPoints[s.nPeak];
+		fprintf(stderr, "%-20s peak %12.0f/s at %10zu (%8.2f MB)", s.sName.c_str(), s.vecRates[s.nPeak], peak.nItems, (double)peak.nBytes / (1024.0 * 1024.0));
+		if (s.nCliff < s.vecPoints.size())
+		{
+			const kernel_point& cliff = s.vecPoints[s.nCliff];
+			fprintf(stderr, ", %12.0f/s at %10zu (%8.2f MB)\n", s.vecRates[s.nCliff], cliff.nItems, (double)cliff.nBytes / (1024.0 * 1024.0));
+		}
+		else
+			fprintf(stderr, ", no drop\n");
+	}
+	return 0;
+}